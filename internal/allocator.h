@@ -34,11 +34,27 @@
 // 5. The allocator is now reverted to its original state, except that
 //    it retained its allocated storage, so the next Commit() will be faster.
 //    The allocated storage is only freed when the Allocator object is
-//    destroyed.
+//    destroyed, when calling Trim(), or when it decays, see
+//    set_decay_commits().
+//
+// Large storage can optionally be backed by huge pages, see
+// Allocator::set_use_huge_pages, and storage can be obtained from a
+// user-supplied MemoryProvider.
+//
+// ScratchArena, also here, serves the small objects that a Gemm needs for
+// its duration, such as its tasks, in the same persistent fashion.
 
 #ifndef GEMMLOWP_INTERNAL_ALLOCATOR_H_
 #define GEMMLOWP_INTERNAL_ALLOCATOR_H_
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 #include "common.h"
 
 namespace gemmlowp {
@@ -69,12 +85,51 @@ GEMMLOWP_REGISTER_TYPEID(std::int16_t, Int16)
 GEMMLOWP_REGISTER_TYPEID(std::uint32_t, Uint32)
 GEMMLOWP_REGISTER_TYPEID(std::int32_t, Int32)
 
+// What the storage of an Allocator is backed with.
+enum class HugePages {
+  // Regular pages.
+  None,
+  // Transparent huge pages, requested with madvise. The kernel may still
+  // back some of the storage with regular pages.
+  Transparent,
+  // Explicit huge pages, from those reserved by the system for hugetlbfs.
+  Explicit
+};
+
+// A source of storage for Allocators, replacing aligned_alloc, e.g. to
+// account for the memory of a context, or to take it from a memory arena
+// of the application. See Allocator::set_memory_provider.
+//
+// Allocators of worker threads commit from those threads, so
+// implementations must be thread-safe.
+class MemoryProvider {
+ public:
+  virtual ~MemoryProvider() {}
+
+  // Returns size bytes aligned on alignment, a power of two, or nullptr on
+  // failure.
+  virtual void* Allocate(std::size_t size, std::size_t alignment) = 0;
+
+  // Frees storage returned by Allocate, given its size.
+  virtual void Free(void* data, std::size_t size) = 0;
+};
+
 class Allocator {
  public:
   Allocator()
       : committed_(false),
         storage_size_(0),
         storage_(nullptr),
+        use_huge_pages_(false),
+        huge_pages_(HugePages::None),
+        mapped_(false),
+        memory_provider_(nullptr),
+        high_water_storage_size_(0),
+        high_water_reserved_bytes_(0),
+        growths_(0),
+        decay_commits_(0),
+        oversized_commits_(0),
+        oversized_reserved_bytes_(0),
         reserved_blocks_(0),
         reserved_bytes_(0),
         generation_(0) {}
@@ -92,19 +147,90 @@ class Allocator {
   // there is no point in allowing more until we need to.
   static const std::size_t kMaxBlocks = 5;
 
+  // The size of the huge pages that storage may be backed with.
+  static const std::size_t kHugePageSize = 2 * 1024 * 1024;
+
   void Commit() {
     assert(!committed_);
 
     if (reserved_bytes_ > storage_size_) {
       DeallocateStorage();
-      storage_size_ = RoundUpToPowerOfTwo(reserved_bytes_);
-      storage_ = aligned_alloc(kAlignment, storage_size_);
+      AllocateStorage(RoundUpToPowerOfTwo(reserved_bytes_));
+      growths_++;
+    } else if (decay_commits_) {
+      Decay();
     }
+    high_water_reserved_bytes_ =
+        std::max(high_water_reserved_bytes_, reserved_bytes_);
 
     ReleaseBuildAssertion(!storage_size_ || storage_, "allocation failure");
     committed_ = true;
   }
 
+  // Writes to all of the storage, so that the OS maps its pages now rather
+  // than when they are first used. Must be called after committing.
+  void Prefault() {
+    assert(committed_);
+    std::memset(storage_, 0, storage_size_);
+  }
+
+  // Backs storage of at least kHugePageSize bytes with huge pages, to spare
+  // TLB misses when traversing large packed blocks: explicit huge pages if
+  // the system has some reserved, otherwise transparent huge pages if
+  // enabled, otherwise regular pages. Linux only; see huge_pages() for the
+  // outcome. Takes effect at the next Commit. Must not be called while
+  // committed.
+  void set_use_huge_pages(bool use_huge_pages) {
+    assert(!committed_);
+    if (use_huge_pages != use_huge_pages_) {
+      use_huge_pages_ = use_huge_pages;
+      DeallocateStorage();
+    }
+  }
+  bool use_huge_pages() const { return use_huge_pages_; }
+
+  // What the current storage is backed with.
+  HugePages huge_pages() const { return huge_pages_; }
+
+  // Makes storage come from the given provider, which must outlive its use
+  // by this allocator, rather than aligned_alloc or huge pages; nullptr
+  // reverts to these. Must not be called while committed.
+  void set_memory_provider(MemoryProvider* memory_provider) {
+    assert(!committed_);
+    if (memory_provider != memory_provider_) {
+      DeallocateStorage();
+      memory_provider_ = memory_provider;
+    }
+  }
+  MemoryProvider* memory_provider() const { return memory_provider_; }
+
+  // Frees the storage, which the next Commit() allocates again. Must not
+  // be called while committed.
+  void Trim() { DeallocateStorage(); }
+
+  // Makes Commit() shrink storage once it has been at least twice as large
+  // as needed for decay_commits commits in a row, to what these needed.
+  // The default value 0 means that storage never shrinks.
+  void set_decay_commits(int decay_commits) {
+    decay_commits_ = decay_commits;
+    oversized_commits_ = 0;
+    oversized_reserved_bytes_ = 0;
+  }
+  int decay_commits() const { return decay_commits_; }
+
+  // The size of the current storage, the largest it has been, and the
+  // most bytes reserved for a commit, that is, actually used.
+  std::size_t storage_size() const { return storage_size_; }
+  std::size_t high_water_storage_size() const {
+    return high_water_storage_size_;
+  }
+  std::size_t high_water_reserved_bytes() const {
+    return high_water_reserved_bytes_;
+  }
+
+  // The count of commits that had to grow the storage.
+  std::size_t growths() const { return growths_; }
+
   void Decommit() {
     assert(committed_);
     committed_ = false;
@@ -167,10 +293,102 @@ class Allocator {
   }
 
  private:
+  void Decay() {
+    if (RoundUpToPowerOfTwo(reserved_bytes_) >= storage_size_) {
+      oversized_commits_ = 0;
+      oversized_reserved_bytes_ = 0;
+      return;
+    }
+    oversized_reserved_bytes_ =
+        std::max(oversized_reserved_bytes_, reserved_bytes_);
+    if (++oversized_commits_ < decay_commits_) {
+      return;
+    }
+    const std::size_t size = oversized_reserved_bytes_;
+    oversized_commits_ = 0;
+    oversized_reserved_bytes_ = 0;
+    DeallocateStorage();
+    if (size) {
+      AllocateStorage(RoundUpToPowerOfTwo(size));
+    }
+  }
+
+  void AllocateStorage(std::size_t size) {
+    storage_size_ = size;
+    high_water_storage_size_ = std::max(high_water_storage_size_, size);
+    if (memory_provider_) {
+      storage_ = memory_provider_->Allocate(size, kAlignment);
+      return;
+    }
+    storage_ = nullptr;
+#ifdef __linux__
+    if (use_huge_pages_ && size >= kHugePageSize) {
+      storage_ = MapHugePages(size);
+      mapped_ = storage_ != nullptr;
+    }
+#endif
+    if (!storage_) {
+      storage_ = aligned_alloc(kAlignment, size);
+    }
+  }
+
+#ifdef __linux__
+  // Maps size bytes, a multiple of kHugePageSize, backed by huge pages if
+  // possible, setting huge_pages_ accordingly. Returns nullptr on failure.
+  void* MapHugePages(std::size_t size) {
+#ifdef MAP_HUGETLB
+    void* explicit_pages =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (explicit_pages != MAP_FAILED) {
+      huge_pages_ = HugePages::Explicit;
+      return explicit_pages;
+    }
+#endif
+    // Transparent huge pages need aligned ranges: map one more huge page,
+    // and unmap what lies outside of the aligned range.
+    const std::size_t mapped_size = size + kHugePageSize;
+    void* mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+      return nullptr;
+    }
+    const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(mapped);
+    const std::uintptr_t aligned = RoundUp<kHugePageSize>(begin);
+    if (aligned > begin) {
+      munmap(mapped, aligned - begin);
+    }
+    if (aligned + size < begin + mapped_size) {
+      munmap(reinterpret_cast<void*>(aligned + size),
+             begin + mapped_size - aligned - size);
+    }
+    void* data = reinterpret_cast<void*>(aligned);
+#ifdef MADV_HUGEPAGE
+    if (!madvise(data, size, MADV_HUGEPAGE)) {
+      huge_pages_ = HugePages::Transparent;
+    }
+#endif
+    return data;
+  }
+#endif
+
   void DeallocateStorage() {
     assert(!committed_);
-    aligned_free(storage_);
+    if (memory_provider_) {
+      if (storage_) {
+        memory_provider_->Free(storage_, storage_size_);
+      }
+    } else if (mapped_) {
+#ifdef __linux__
+      munmap(storage_, storage_size_);
+#endif
+    } else {
+      aligned_free(storage_);
+    }
+    storage_ = nullptr;
     storage_size_ = 0;
+    huge_pages_ = HugePages::None;
+    mapped_ = false;
   }
 
   // Set to true by Commit() and to false by Decommit(). Initially false.
@@ -180,6 +398,28 @@ class Allocator {
   std::size_t storage_size_;
   mutable void* storage_;
 
+  // Whether to use huge pages, what the storage is backed with, and whether
+  // it was mapped with mmap rather than allocated with aligned_alloc.
+  bool use_huge_pages_;
+  HugePages huge_pages_;
+  bool mapped_;
+
+  // The source of storage, if not the default one.
+  MemoryProvider* memory_provider_;
+
+  // See high_water_storage_size() and high_water_reserved_bytes().
+  std::size_t high_water_storage_size_;
+  std::size_t high_water_reserved_bytes_;
+
+  // See growths().
+  std::size_t growths_;
+
+  // See set_decay_commits(): how many commits in a row the storage was
+  // oversized for, and the most bytes they reserved.
+  int decay_commits_;
+  int oversized_commits_;
+  std::size_t oversized_reserved_bytes_;
+
   // The number of blocks that have been reserved by Reserve().
   std::size_t reserved_blocks_;
   // The number of bytes that have been reserved by Reserve().
@@ -192,6 +432,80 @@ class Allocator {
   generation_t generation_;
 };
 
+// A bump allocator for objects living for the duration of a Gemm, such as
+// its tasks, so that they do not have to be allocated from the heap. Like
+// Allocator, it retains its storage from one use to the next: once it has
+// grown to what a Gemm needs, further Gemms of the same shape allocate
+// nothing. Storage comes in chunks that are never moved, so that pointers
+// handed out remain valid until the next Reset().
+class ScratchArena {
+ public:
+  ScratchArena() : current_chunk_(0), offset_(0) {}
+
+  ~ScratchArena() { Trim(); }
+
+  // Alignment of allocated arrays.
+  static const std::size_t kAlignment = kDefaultCacheLineSize;
+
+  // Returns uninitialized storage for n objects of type T, valid until the
+  // next Reset(). Objects constructed there must be destroyed by the
+  // caller.
+  template <typename T>
+  T* Allocate(std::size_t n) {
+    static_assert(alignof(T) <= kAlignment, "over-aligned type");
+    const std::size_t bytes = RoundUp<kAlignment>(n * sizeof(T));
+    while (current_chunk_ < chunks_.size() &&
+           offset_ + bytes > chunks_[current_chunk_].size) {
+      current_chunk_++;
+      offset_ = 0;
+    }
+    if (current_chunk_ == chunks_.size()) {
+      Chunk chunk;
+      chunk.size = RoundUpToPowerOfTwo(std::max(
+          bytes, chunks_.empty() ? kMinChunkSize : 2 * chunks_.back().size));
+      chunk.data = aligned_alloc(kAlignment, chunk.size);
+      ReleaseBuildAssertion(chunk.data != nullptr, "allocation failure");
+      chunks_.push_back(chunk);
+    }
+    void* result =
+        static_cast<std::uint8_t*>(chunks_[current_chunk_].data) + offset_;
+    offset_ += bytes;
+    return static_cast<T*>(result);
+  }
+
+  // Makes all the storage available again.
+  void Reset() {
+    current_chunk_ = 0;
+    offset_ = 0;
+  }
+
+  // Frees all the storage. Objects constructed in it must have been
+  // destroyed.
+  void Trim() {
+    for (const Chunk& chunk : chunks_) {
+      aligned_free(chunk.data);
+    }
+    chunks_.clear();
+    Reset();
+  }
+
+ private:
+  static const std::size_t kMinChunkSize = 4096;
+
+  struct Chunk {
+    void* data;
+    std::size_t size;
+  };
+
+  ScratchArena(const ScratchArena&) = delete;
+
+  std::vector<Chunk> chunks_;
+
+  // The chunk being allocated from, and the offset of its free space.
+  std::size_t current_chunk_;
+  std::size_t offset_;
+};
+
 }  // namespace gemmlowp
 
 #endif  // GEMMLOWP_INTERNAL_ALLOCATOR_H_
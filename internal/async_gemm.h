@@ -0,0 +1,318 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// async_gemm.h: support for asynchronous Gemms, see GemmAsync in
+// public/gemmlowp.h.
+//
+// Each asynchronous Gemm runs on a lane: a worker thread, acting as the
+// master thread of the Gemm, with a context of its own. A context keeps up
+// to a maximum number of lanes, reused from one Gemm to the next, and
+// queues Gemms beyond that, see AsyncGemmLanes.
+
+#ifndef GEMMLOWP_INTERNAL_ASYNC_GEMM_H_
+#define GEMMLOWP_INTERNAL_ASYNC_GEMM_H_
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "dispatch_gemm_shape.h"
+
+namespace gemmlowp {
+
+// The state of an asynchronous Gemm, shared by its handles and the task
+// running it.
+struct AsyncGemmState {
+  AsyncGemmState() : done(0) {}
+
+  // Set to 1 once the Gemm, and its callback if any, have completed.
+  WaitableAtomic<int> done;
+
+  // Called on the lane thread once the result is written.
+  std::function<void()> callback;
+};
+
+// A handle on an asynchronous Gemm, to poll or wait for its completion.
+// Handles are cheap to copy, and may outlive the context. A default-
+// constructed handle refers to no Gemm, and is always complete.
+class GemmHandle {
+ public:
+  GemmHandle() {}
+  explicit GemmHandle(const std::shared_ptr<AsyncGemmState>& state)
+      : state_(state) {}
+
+  // Returns whether the Gemm, including its callback, has completed.
+  bool Poll() const { return !state_ || state_->done.load() != 0; }
+
+  // Waits until the Gemm, including its callback, has completed.
+  void Wait() const {
+    if (!state_) {
+      return;
+    }
+    while (state_->done.load() == 0) {
+      state_->done.WaitForChange(0);
+    }
+  }
+
+ private:
+  std::shared_ptr<AsyncGemmState> state_;
+};
+
+// An asynchronous Gemm, queued or running on a lane, with the settings
+// that its context had when it was started. Run computes the result, then
+// Complete reports it.
+struct AsyncGemmTaskBase : Task {
+  AsyncGemmTaskBase(const MultiThreadGemmSettings& _settings,
+                    const std::shared_ptr<AsyncGemmState>& _state)
+      : settings(_settings), context(nullptr), state(_state) {}
+
+  void Complete() {
+    if (state->callback) {
+      state->callback();
+    }
+    state->done.store(1);
+  }
+
+  MultiThreadGemmSettings settings;
+
+  // The context of the lane running the Gemm, set up with settings.
+  MultiThreadGemmContext* context;
+
+  const std::shared_ptr<AsyncGemmState> state;
+};
+
+// The task running an asynchronous Gemm on a lane, through the usual
+// synchronous code path. It holds copies of the maps of the operands and
+// of the output pipeline.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename OutputPipelineType>
+struct AsyncGemmTask : AsyncGemmTaskBase {
+  AsyncGemmTask(const MultiThreadGemmSettings& _settings,
+                const MatrixMap<const InputScalar, LhsOrder>& _lhs,
+                const MatrixMap<const InputScalar, RhsOrder>& _rhs,
+                const MatrixMap<OutputScalar, ResultOrder>& _result,
+                int _lhs_offset, int _rhs_offset,
+                const OutputPipelineType& _output_pipeline,
+                const std::shared_ptr<AsyncGemmState>& _state)
+      : AsyncGemmTaskBase(_settings, _state),
+        lhs(_lhs),
+        rhs(_rhs),
+        result(_result),
+        lhs_offset(_lhs_offset),
+        rhs_offset(_rhs_offset),
+        output_pipeline(_output_pipeline) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("AsyncGemmTask");
+    typedef VectorDup<const std::int32_t, VectorShape::Col> OffsetColDup;
+    typedef VectorDup<const std::int32_t, VectorShape::Row> OffsetRowDup;
+    const OffsetColDup lhs_offset_vector(lhs_offset, lhs.rows());
+    const OffsetRowDup rhs_offset_vector(rhs_offset, rhs.cols());
+    DispatchGemmShape<InputScalar, OutputScalar, BitDepthParams>(
+        context, lhs, rhs, &result, lhs_offset_vector, rhs_offset_vector,
+        output_pipeline);
+  }
+
+  const MatrixMap<const InputScalar, LhsOrder> lhs;
+  const MatrixMap<const InputScalar, RhsOrder> rhs;
+  MatrixMap<OutputScalar, ResultOrder> result;
+  const int lhs_offset;
+  const int rhs_offset;
+  const OutputPipelineType output_pipeline;
+};
+
+class AsyncGemmLanes;
+
+// A thread running asynchronous Gemms, one at a time, on a context of its
+// own: the Gemm that it is started with, then Gemms queued on its
+// AsyncGemmLanes until none is left. It is the task of its own worker.
+class AsyncGemmLane : public Task {
+ public:
+  explicit AsyncGemmLane(AsyncGemmLanes* lanes) : lanes_(lanes), busy_(false) {
+    counter_.Reset(1);
+    worker_.reset(new Worker(&counter_, &spin_policy_));
+    counter_.Wait();
+    // Asynchronous Gemms are typically not issued back-to-back.
+    spin_policy_.set_mode(SpinMode::PowerFirst);
+  }
+
+  // Waits for the running Gemms, if any, before stopping the thread.
+  ~AsyncGemmLane() { counter_.Wait(); }
+
+  // Starts running the given Gemm, taking ownership of it. The lane must
+  // have been marked busy, see AsyncGemmLanes::Start.
+  void Start(AsyncGemmTaskBase* task) {
+    // The worker may still be returning from the previous Run.
+    counter_.Wait();
+    gemm_.reset(task);
+    counter_.Reset(1);
+    worker_->StartWork(this, &counter_);
+  }
+
+  void Run() override;
+
+ private:
+  friend class AsyncGemmLanes;
+
+  AsyncGemmLane(const AsyncGemmLane&) = delete;
+
+  AsyncGemmLanes* const lanes_;
+
+  // Whether Gemms are running on this lane, guarded by the mutex of
+  // lanes_.
+  bool busy_;
+
+  // Reaches zero when the worker is ready for a new task.
+  BlockingCounter counter_;
+  SpinPolicy spin_policy_;
+  std::unique_ptr<Worker> worker_;
+
+  // The context that Gemms on this lane run on, and the Gemm to start
+  // with.
+  MultiThreadGemmContext context_;
+  std::unique_ptr<AsyncGemmTaskBase> gemm_;
+};
+
+// The lanes of a context, see GemmContext. There are at most max_lanes of
+// them, beyond which Gemms are queued until a lane is done with its
+// current one. Unless Gemms are started with a SharedWorkersPool, the
+// lanes share one of their own, so that Gemms in flight together use at
+// most max_lanes threads besides those of the pool.
+class AsyncGemmLanes {
+ public:
+  AsyncGemmLanes() : max_lanes_(0) { pthread_mutex_init(&mutex_, nullptr); }
+
+  // Waits for the Gemms in flight, queued ones included.
+  ~AsyncGemmLanes() {
+    lanes_.clear();
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  // The maximum number of lanes, hence of asynchronous Gemms running at
+  // once. The default value 0 means one per CPU that this process may use,
+  // see GetAvailableCpus.
+  void set_max_lanes(int max_lanes) { max_lanes_ = max_lanes; }
+  int max_lanes() const { return max_lanes_ ? max_lanes_ : GetAvailableCpus(); }
+
+  // Starts running the given Gemm, taking ownership of it, on a lane that
+  // is not busy, on a new one if there are fewer than max_lanes, or else
+  // once a lane is done with the Gemms queued before it.
+  void Start(AsyncGemmTaskBase* task) {
+    pthread_mutex_lock(&mutex_);
+    MultiThreadGemmSettings& settings = task->settings;
+    const int workers_count =
+        GetAvailableConcurrency(settings.max_num_threads) - 1;
+    if (!settings.shared_workers_pool && workers_count > 0) {
+      if (!shared_workers_pool_) {
+        shared_workers_pool_.reset(new SharedWorkersPool(workers_count));
+      }
+      settings.shared_workers_pool = shared_workers_pool_.get();
+    }
+    AsyncGemmLane* lane = nullptr;
+    for (const auto& l : lanes_) {
+      if (!l->busy_) {
+        lane = l.get();
+        break;
+      }
+    }
+    if (!lane && static_cast<int>(lanes_.size()) < max_lanes()) {
+      lanes_.emplace_back(new AsyncGemmLane(this));
+      lane = lanes_.back().get();
+    }
+    if (!lane) {
+      queue_.push_back(task);
+      pthread_mutex_unlock(&mutex_);
+      return;
+    }
+    lane->busy_ = true;
+    pthread_mutex_unlock(&mutex_);
+    lane->Start(task);
+  }
+
+  // Called by a lane done with a Gemm: returns the next queued Gemm, or
+  // nullptr, making the lane idle, if there is none.
+  AsyncGemmTaskBase* TakeQueued(AsyncGemmLane* lane) {
+    pthread_mutex_lock(&mutex_);
+    AsyncGemmTaskBase* task = nullptr;
+    if (queue_.empty()) {
+      lane->busy_ = false;
+    } else {
+      task = queue_.front();
+      queue_.pop_front();
+    }
+    pthread_mutex_unlock(&mutex_);
+    return task;
+  }
+
+  // Stops the threads of the lanes that are not busy, freeing the memory
+  // of their contexts, and the shared workers of the lanes once there is
+  // no lane left.
+  void TrimMemory() {
+    pthread_mutex_lock(&mutex_);
+    lanes_.erase(std::remove_if(lanes_.begin(), lanes_.end(),
+                                [](const std::unique_ptr<AsyncGemmLane>& l) {
+                                  return !l->busy_;
+                                }),
+                 lanes_.end());
+    if (lanes_.empty()) {
+      shared_workers_pool_.reset();
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // The number of lanes, each with a thread of its own.
+  int lanes_count() {
+    pthread_mutex_lock(&mutex_);
+    const int count = static_cast<int>(lanes_.size());
+    pthread_mutex_unlock(&mutex_);
+    return count;
+  }
+
+ private:
+  AsyncGemmLanes(const AsyncGemmLanes&) = delete;
+
+  int max_lanes_;
+  pthread_mutex_t mutex_;
+
+  // The workers shared by the lanes, created with the first Gemm needing
+  // them, sized for its max_num_threads.
+  std::unique_ptr<SharedWorkersPool> shared_workers_pool_;
+
+  std::vector<std::unique_ptr<AsyncGemmLane>> lanes_;
+
+  // The Gemms waiting for a lane, owned by this object.
+  std::deque<AsyncGemmTaskBase*> queue_;
+};
+
+inline void AsyncGemmLane::Run() {
+  std::unique_ptr<AsyncGemmTaskBase> gemm = std::move(gemm_);
+  while (gemm) {
+    gemm->settings.ApplyTo(&context_);
+    gemm->context = &context_;
+    gemm->Run();
+    // Becomes idle, if no Gemm is queued, before reporting completion, so
+    // that this lane is seen idle once its Gemms are seen complete.
+    std::unique_ptr<AsyncGemmTaskBase> next(lanes_->TakeQueued(this));
+    gemm->Complete();
+    gemm = std::move(next);
+  }
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_ASYNC_GEMM_H_
@@ -13,11 +13,13 @@
 // limitations under the License.
 
 // block_params.h: Logic to choose L1 and L2 block sizes
-// to optimize cache-friendliness.
+// to optimize cache-friendliness, within a scratch memory budget if any.
 
 #ifndef GEMMLOWP_INTERNAL_BLOCK_PARAMS_H_
 #define GEMMLOWP_INTERNAL_BLOCK_PARAMS_H_
 
+#include <cstdint>
+
 #include "common.h"
 
 namespace gemmlowp {
@@ -29,6 +31,9 @@ namespace gemmlowp {
 // and then another subdivision into smaller blocks that should fit in
 // L1 cache. There is then actually a third level of subdivision to fit
 // in registers, but we are not concerned with that here.
+// When the last-level cache is modeled separately from a private L2 cache
+// (see FindL2BlockSizes), the large RHS blocks, which all threads share,
+// are sized for the former, and the large LHS blocks for the latter.
 struct BlockParams {
   // L1 block parameters determine the size of small blocks that should
   // fit in L1 cache.
@@ -46,17 +51,60 @@ struct BlockParams {
   void Init(int rows, int cols, int depth, int num_threads, int l1_bytes_to_use,
             int l2_bytes_to_use, float l2_rhs_factor) {
     FindL2BlockSizes<KernelFormat>(rows, cols, depth, num_threads,
-                                   l2_bytes_to_use, l2_rhs_factor, &l2_rows,
+                                   l2_bytes_to_use, 0, l2_rhs_factor, &l2_rows,
                                    &l2_cols, &l2_depth);
     FindL1BlockSizes<KernelFormat>(l2_rows, l2_cols, l2_depth, l1_bytes_to_use,
                                    &l1_rows, &l1_cols, &l1_depth);
   }
 
+  // Like the above, but with a per-thread budget of last-level cache, see
+  // FindL2BlockSizes, and then shrinks the L2 blocks until scratch_bytes,
+  // giving the scratch memory that a Gemm needs for given BlockParams,
+  // returns at most max_scratch_bytes, unless blocks of a single kernel
+  // width already don't fit: there is no L2 blocking in the depth
+  // dimension. The special value 0 means no budget.
+  template <typename KernelFormat, typename ScratchBytesFunc>
+  void Init(int rows, int cols, int depth, int num_threads, int l1_bytes_to_use,
+            int l2_bytes_to_use, int llc_bytes_to_use, float l2_rhs_factor,
+            std::size_t max_scratch_bytes, ScratchBytesFunc scratch_bytes) {
+    FindL2BlockSizes<KernelFormat>(rows, cols, depth, num_threads,
+                                   l2_bytes_to_use, llc_bytes_to_use,
+                                   l2_rhs_factor, &l2_rows, &l2_cols,
+                                   &l2_depth);
+    if (max_scratch_bytes) {
+      ShrinkL2BlockSizes<KernelFormat>(max_scratch_bytes, scratch_bytes);
+    }
+    FindL1BlockSizes<KernelFormat>(l2_rows, l2_cols, l2_depth, l1_bytes_to_use,
+                                   &l1_rows, &l1_cols, &l1_depth);
+  }
+
+  // Halves the larger of l2_rows and l2_cols until scratch_bytes(*this)
+  // fits in max_scratch_bytes, or both are down to the kernel width.
+  template <typename KernelFormat, typename ScratchBytesFunc>
+  void ShrinkL2BlockSizes(std::size_t max_scratch_bytes,
+                          ScratchBytesFunc scratch_bytes) {
+    while (scratch_bytes(*this) > max_scratch_bytes) {
+      const bool can_shrink_rows = l2_rows > KernelFormat::kRows;
+      const bool can_shrink_cols = l2_cols > KernelFormat::kCols;
+      if (can_shrink_cols && (l2_cols >= l2_rows || !can_shrink_rows)) {
+        l2_cols = RoundUp<KernelFormat::kCols>(l2_cols / 2);
+      } else if (can_shrink_rows) {
+        l2_rows = RoundUp<KernelFormat::kRows>(l2_rows / 2);
+      } else {
+        break;
+      }
+    }
+  }
+
+  // llc_bytes_to_use is the share of the last-level cache of each thread,
+  // when it is modeled separately from a private L2 cache of
+  // l2_bytes_to_use, or 0 to model a single level of L2 cache, shared by
+  // the threads.
   template <typename KernelFormat>
   static void FindL2BlockSizes(int rows, int cols, int depth, int num_threads,
-                               int l2_bytes_to_use, float l2_rhs_factor,
-                               int* out_l2_rows, int* out_l2_cols,
-                               int* out_l2_depth) {
+                               int l2_bytes_to_use, int llc_bytes_to_use,
+                               float l2_rhs_factor, int* out_l2_rows,
+                               int* out_l2_cols, int* out_l2_depth) {
     int l2_rows = 0;
     int l2_cols = 0;
     int l2_depth = 0;
@@ -72,8 +120,14 @@ struct BlockParams {
     l2_depth = RoundUp<kRegisterSize>(depth);
 
     {
-      int max_cache_friendly_l2_cols = std::max(
-          1, static_cast<int>(l2_rhs_factor * (l2_bytes_to_use / l2_depth)));
+      // The RHS block is shared by all threads, so it may take the shares
+      // of all of them of the last-level cache.
+      const std::int64_t rhs_bytes_to_use = std::max<std::int64_t>(
+          l2_bytes_to_use, std::int64_t(num_threads) * llc_bytes_to_use);
+      const std::int64_t max_rhs_cols = static_cast<std::int64_t>(
+          l2_rhs_factor * (rhs_bytes_to_use / l2_depth));
+      int max_cache_friendly_l2_cols = static_cast<int>(
+          std::max<std::int64_t>(1, std::min<std::int64_t>(cols, max_rhs_cols)));
       int min_l2_cols_blocks =
           std::max(1, CeilQuotient(cols, max_cache_friendly_l2_cols));
       l2_cols =
@@ -85,6 +139,15 @@ struct BlockParams {
     // the performance on x86.
     if (l2_rhs_factor == 1.0f) {
       l2_rows = RoundUp<KernelFormat::kRows>(per_thread_rows);
+    } else if (llc_bytes_to_use) {
+      // The RHS block lives in the last-level cache, leaving the private L2
+      // cache of each thread to its LHS and result blocks.
+      int max_cache_friendly_l2_rows =
+          std::max(1, l2_bytes_to_use / (l2_depth + 4 * l2_cols));
+      int min_l2_rows_blocks = std::max(
+          1, CeilQuotient(per_thread_rows, max_cache_friendly_l2_rows));
+      l2_rows = RoundUp<KernelFormat::kRows>(
+          CeilQuotient(per_thread_rows, min_l2_rows_blocks));
     } else {
       int max_cache_friendly_l2_rows =
           std::max(1, (l2_bytes_to_use - l2_depth * l2_cols) /
@@ -161,6 +224,26 @@ struct SideBlockParams {
 
 enum class Side { Lhs, Rhs };
 
+// The scratch memory that an Allocator reserves for a packed LHS block,
+// a packed RHS block, and a packed result block, see PackedSideBlock and
+// PackedResult.
+inline std::size_t PackedLhsBytes(const BlockParams& block_params) {
+  return RoundUp<kDefaultCacheLineSize>(
+             std::size_t(block_params.l2_rows) * block_params.l2_depth) +
+         RoundUp<kDefaultCacheLineSize>(4 * std::size_t(block_params.l2_rows));
+}
+
+inline std::size_t PackedRhsBytes(const BlockParams& block_params) {
+  return RoundUp<kDefaultCacheLineSize>(
+             std::size_t(block_params.l2_cols) * block_params.l2_depth) +
+         RoundUp<kDefaultCacheLineSize>(4 * std::size_t(block_params.l2_cols));
+}
+
+inline std::size_t PackedResultBytes(const BlockParams& block_params) {
+  return RoundUp<kDefaultCacheLineSize>(4 * std::size_t(block_params.l2_rows) *
+                                        block_params.l2_cols);
+}
+
 inline void GetSideBlockParams(Side side, SideBlockParams* side_block_params,
                                const BlockParams& block_params) {
   side_block_params->l1_width =
@@ -0,0 +1,145 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// cost_model.h: a model of the time that a Gemm takes on a given number of
+// threads, from costs measured on the current machine, used to choose
+// thread counts (see HowManyThreads in multi_thread_gemm.h). Models are
+// measured by GemmContext::CalibrateCostModel, and may be saved to and
+// loaded from profile files so as not to measure them on every start.
+
+#ifndef GEMMLOWP_INTERNAL_COST_MODEL_H_
+#define GEMMLOWP_INTERNAL_COST_MODEL_H_
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+#include "common.h"
+
+namespace gemmlowp {
+
+struct ThreadCostModel {
+  // The time that it takes to start a task on one more thread and to wait
+  // for it, in seconds.
+  double dispatch_seconds_per_thread = 0;
+  // The rate of multiply-accumulates of the kernel on one thread.
+  double macs_per_second = 0;
+  // The rate at which one thread packs operands, in bytes per second.
+  double pack_bytes_per_second = 0;
+
+  // Whether all costs are known. Otherwise, thread counts are chosen by
+  // the heuristic of HowManyThreads.
+  bool calibrated() const {
+    return dispatch_seconds_per_thread > 0 && macs_per_second > 0 &&
+           pack_bytes_per_second > 0;
+  }
+
+  // Returns the predicted time of a Gemm split over a number of threads
+  // like MultiThreadGemm does: each thread computes and packs the LHS of
+  // its own rows, rounded up to the kernel width, and they pack the RHS
+  // together.
+  double PredictSeconds(int rows, int cols, int depth, int threads,
+                        int kernel_rows) const {
+    const double rows_per_thread = std::min(
+        rows, CeilQuotient(CeilQuotient(rows, threads), kernel_rows) *
+                  kernel_rows);
+    const double macs = rows_per_thread * cols * depth;
+    const double pack_bytes =
+        rows_per_thread * depth + static_cast<double>(cols) * depth / threads;
+    return macs / macs_per_second + pack_bytes / pack_bytes_per_second +
+           (threads - 1) * dispatch_seconds_per_thread;
+  }
+
+  // Fits macs_per_second and pack_bytes_per_second to the times of two
+  // single-threaded Gemms, of the given counts of multiply-accumulates and
+  // of packed bytes. Returns false, leaving them unchanged, if the times
+  // don't fit positive rates.
+  bool FitRates(double macs_a, double pack_bytes_a, double seconds_a,
+                double macs_b, double pack_bytes_b, double seconds_b) {
+    const double det = macs_a * pack_bytes_b - macs_b * pack_bytes_a;
+    if (det == 0) {
+      return false;
+    }
+    const double seconds_per_mac =
+        (seconds_a * pack_bytes_b - seconds_b * pack_bytes_a) / det;
+    const double seconds_per_pack_byte =
+        (macs_a * seconds_b - macs_b * seconds_a) / det;
+    if (!(seconds_per_mac > 0 && seconds_per_pack_byte > 0)) {
+      return false;
+    }
+    macs_per_second = 1 / seconds_per_mac;
+    pack_bytes_per_second = 1 / seconds_per_pack_byte;
+    return true;
+  }
+
+  // The first line of profile files, followed by a line of the three
+  // costs above.
+  static const char* header() { return "gemmlowp_cost_model 1"; }
+
+  std::string Serialize() const {
+    char text[256];
+    snprintf(text, sizeof(text), "%s\n%.9g %.9g %.9g\n", header(),
+             dispatch_seconds_per_thread, macs_per_second,
+             pack_bytes_per_second);
+    return text;
+  }
+
+  // Reads a serialized model. Returns false, leaving the model
+  // uncalibrated, if the text is malformed.
+  bool Parse(const std::string& text) {
+    *this = ThreadCostModel();
+    std::istringstream stream(text);
+    std::string line;
+    ThreadCostModel model;
+    std::string extra;
+    if (!std::getline(stream, line) || line != header() ||
+        !(stream >> model.dispatch_seconds_per_thread >>
+          model.macs_per_second >> model.pack_bytes_per_second) ||
+        (stream >> extra) || !model.calibrated()) {
+      return false;
+    }
+    *this = model;
+    return true;
+  }
+
+  // Writes the model to a profile file. Returns false on failure.
+  bool Save(const std::string& path) const {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+      return false;
+    }
+    const std::string text = Serialize();
+    bool success = fwrite(text.data(), 1, text.size(), file) == text.size();
+    success = fclose(file) == 0 && success;
+    return success;
+  }
+
+  // Reads the model from a profile file, see Parse. Returns false on
+  // failure.
+  bool Load(const std::string& path) {
+    *this = ThreadCostModel();
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+      return false;
+    }
+    char buf[256];
+    const std::size_t count = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    return Parse(std::string(buf, count));
+  }
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_COST_MODEL_H_
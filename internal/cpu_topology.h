@@ -0,0 +1,627 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// cpu_topology.h: detection of the layout of CPU cores and caches, used to
+// place worker threads (see AffinityPolicy), to size thread counts and
+// per-thread cache budgets accordingly, and for the default cache budgets
+// of contexts (see GetCacheSizes). Also detection of the CPUs that the
+// process may use, for default thread counts (see GetAvailableCpus).
+//
+// The topology is read from /sys/devices/system/cpu on Linux. Elsewhere,
+// or if that fails, every hardware thread is assumed to be its own physical
+// core, with no cache information. Cache sizes then come from cpuid on x86.
+
+#ifndef GEMMLOWP_INTERNAL_CPU_TOPOLOGY_H_
+#define GEMMLOWP_INTERNAL_CPU_TOPOLOGY_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+#include "common.h"
+
+#if defined(GEMMLOWP_X86) && (defined(__GNUC__) || defined(__clang__))
+#define GEMMLOWP_USE_CPUID
+#include <cpuid.h>
+#endif
+
+namespace gemmlowp {
+
+// How worker threads should be placed on CPUs.
+enum class AffinityPolicy {
+  // Let the OS place and migrate threads freely. This is the default.
+  None,
+  // Pin each thread to a distinct physical core, letting the OS pick any
+  // of the hardware threads (SMT siblings) of that core.
+  PhysicalCores,
+  // Pin each thread to a single hardware thread, the first one of a
+  // distinct physical core, so that no two threads are SMT siblings.
+  AvoidSmtSiblings,
+  // Pin threads to CPUs from a caller-supplied set, one CPU per thread.
+  CpuSet
+};
+
+struct CpuTopology {
+  // A cache shared by a set of hardware threads.
+  struct Cache {
+    int size_bytes;
+    std::vector<int> cpus;
+    // The size of cache lines, or 0 if unknown.
+    int line_bytes;
+  };
+
+  // The online hardware threads, i.e. logical CPUs.
+  std::vector<int> cpus;
+
+  // The hardware threads of each physical core, ordered by their first
+  // hardware thread.
+  std::vector<std::vector<int>> cores;
+
+  // The L1 data caches, the L2 caches, and the last-level caches, that is
+  // those of the highest level above 2 (normally L3), if known.
+  std::vector<Cache> l1_caches;
+  std::vector<Cache> l2_caches;
+  std::vector<Cache> llc_caches;
+
+  // The hardware threads of each NUMA node, if there is more than one.
+  std::vector<std::vector<int>> numa_nodes;
+};
+
+// Returns the index in topology.numa_nodes of the node of the given CPU,
+// or 0 if unknown.
+inline int GetNumaNodeOfCpu(const CpuTopology& topology, int cpu) {
+  for (std::size_t node = 0; node < topology.numa_nodes.size(); node++) {
+    const auto& cpus = topology.numa_nodes[node];
+    if (std::count(cpus.begin(), cpus.end(), cpu)) {
+      return static_cast<int>(node);
+    }
+  }
+  return 0;
+}
+
+// Parses a list of CPUs in the format used by sysfs, e.g. "0-3,8,10-11".
+// Returns false on a malformed list.
+inline bool ParseCpuList(const std::string& list, std::vector<int>* cpus) {
+  cpus->clear();
+  const char* p = list.c_str();
+  while (*p && *p != '\n') {
+    char* end;
+    const long first = std::strtol(p, &end, 10);
+    if (end == p || first < 0) {
+      return false;
+    }
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      last = std::strtol(p + 1, &end, 10);
+      if (end == p + 1 || last < first) {
+        return false;
+      }
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      cpus->push_back(static_cast<int>(cpu));
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p && *p != '\n') {
+      return false;
+    }
+  }
+  return !cpus->empty();
+}
+
+// Parses a cache size in the format used by sysfs, e.g. "1024K".
+inline int ParseCacheSize(const std::string& size) {
+  char* end;
+  const long value = std::strtol(size.c_str(), &end, 10);
+  switch (*end) {
+    case 'K':
+      return static_cast<int>(value * 1024);
+    case 'M':
+      return static_cast<int>(value * 1024 * 1024);
+    default:
+      return static_cast<int>(value);
+  }
+}
+
+// Reads the first line of a (sysfs) file. Returns false if it can't be read.
+inline bool ReadFirstLine(const std::string& path, std::string* line) {
+  FILE* file = fopen(path.c_str(), "r");
+  if (!file) {
+    return false;
+  }
+  char buf[256];
+  const bool success = fgets(buf, sizeof(buf), file) != nullptr;
+  fclose(file);
+  if (success) {
+    *line = buf;
+  }
+  return success;
+}
+
+// Reads a whole file. Returns false if it can't be read.
+inline bool ReadFile(const std::string& path, std::string* contents) {
+  FILE* file = fopen(path.c_str(), "r");
+  if (!file) {
+    return false;
+  }
+  contents->clear();
+  char buf[4096];
+  std::size_t count;
+  while ((count = fread(buf, 1, sizeof(buf), file)) > 0) {
+    contents->append(buf, count);
+  }
+  fclose(file);
+  return true;
+}
+
+// Returns the NUMA node of a CPU given its sysfs directory, which has a
+// nodeN entry on NUMA systems, or -1 if there is none.
+inline int ReadNumaNode(const std::string& cpu_dir) {
+  int node = -1;
+#ifdef __linux__
+  DIR* dir = opendir(cpu_dir.c_str());
+  if (!dir) {
+    return node;
+  }
+  while (const dirent* entry = readdir(dir)) {
+    const char* name = entry->d_name;
+    if (!strncmp(name, "node", 4) && name[4] >= '0' && name[4] <= '9') {
+      node = std::atoi(name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+#else
+  (void)cpu_dir;
+#endif
+  return node;
+}
+
+// Reads the topology from a sysfs tree rooted at sysfs_cpu_dir, normally
+// /sys/devices/system/cpu. Returns false if the layout of cores can't be
+// determined; cache and NUMA information are optional.
+inline bool ReadCpuTopology(const std::string& sysfs_cpu_dir,
+                            CpuTopology* topology) {
+  *topology = CpuTopology();
+  std::string line;
+  // The CPUs of each NUMA node, indexed by node id.
+  std::vector<std::vector<int>> cpus_by_node;
+  // The level of the caches in topology->llc_caches.
+  int llc_level = 2;
+  if (!ReadFirstLine(sysfs_cpu_dir + "/online", &line) ||
+      !ParseCpuList(line, &topology->cpus)) {
+    return false;
+  }
+  for (int cpu : topology->cpus) {
+    const std::string cpu_dir = sysfs_cpu_dir + "/cpu" + std::to_string(cpu);
+    std::vector<int> siblings;
+    if (!ReadFirstLine(cpu_dir + "/topology/thread_siblings_list", &line) ||
+        !ParseCpuList(line, &siblings)) {
+      return false;
+    }
+    // Only keep online siblings, and record each core once, when visiting
+    // its first online hardware thread.
+    std::vector<int> online_siblings;
+    for (int sibling : siblings) {
+      if (std::count(topology->cpus.begin(), topology->cpus.end(), sibling)) {
+        online_siblings.push_back(sibling);
+      }
+    }
+    if (!online_siblings.empty() && online_siblings[0] == cpu) {
+      topology->cores.push_back(online_siblings);
+    }
+
+    const int node = ReadNumaNode(cpu_dir);
+    if (node >= 0) {
+      if (node >= static_cast<int>(cpus_by_node.size())) {
+        cpus_by_node.resize(node + 1);
+      }
+      cpus_by_node[node].push_back(cpu);
+    }
+
+    for (int index = 0;; index++) {
+      const std::string cache_dir =
+          cpu_dir + "/cache/index" + std::to_string(index);
+      if (!ReadFirstLine(cache_dir + "/level", &line)) {
+        break;
+      }
+      const int level = std::atoi(line.c_str());
+      std::string type;
+      if (level < 1 || !ReadFirstLine(cache_dir + "/type", &type) ||
+          type.compare(0, 11, "Instruction") == 0) {
+        continue;
+      }
+      CpuTopology::Cache cache;
+      if (!ReadFirstLine(cache_dir + "/size", &line)) {
+        continue;
+      }
+      cache.size_bytes = ParseCacheSize(line);
+      if (!ReadFirstLine(cache_dir + "/shared_cpu_list", &line) ||
+          !ParseCpuList(line, &cache.cpus)) {
+        cache.cpus.assign(1, cpu);
+      }
+      cache.line_bytes = 0;
+      if (ReadFirstLine(cache_dir + "/coherency_line_size", &line)) {
+        cache.line_bytes = std::atoi(line.c_str());
+      }
+      // Record each cache once, when visiting its first CPU.
+      if (cache.size_bytes <= 0 || cache.cpus[0] != cpu) {
+        continue;
+      }
+      if (level == 1) {
+        topology->l1_caches.push_back(cache);
+      } else if (level == 2) {
+        topology->l2_caches.push_back(cache);
+      } else if (level >= llc_level) {
+        if (level > llc_level) {
+          topology->llc_caches.clear();
+          llc_level = level;
+        }
+        topology->llc_caches.push_back(cache);
+      }
+    }
+  }
+  for (const auto& cpus : cpus_by_node) {
+    if (!cpus.empty()) {
+      topology->numa_nodes.push_back(cpus);
+    }
+  }
+  if (topology->numa_nodes.size() < 2) {
+    topology->numa_nodes.clear();
+  }
+  return !topology->cores.empty();
+}
+
+// Returns the topology of the current machine, detected once.
+inline const CpuTopology& GetCpuTopology() {
+  static const CpuTopology topology = []() {
+    CpuTopology result;
+#ifdef __linux__
+    if (ReadCpuTopology("/sys/devices/system/cpu", &result)) {
+      return result;
+    }
+#endif
+    result = CpuTopology();
+    const int cpus_count = GetHardwareConcurrency(0);
+    for (int cpu = 0; cpu < cpus_count; cpu++) {
+      result.cpus.push_back(cpu);
+      result.cores.push_back(std::vector<int>(1, cpu));
+    }
+    return result;
+  }();
+  return topology;
+}
+
+// Returns the number of CPUs that a CFS quota of quota microseconds per
+// period microseconds amounts to, rounded up, or 0 if there is no quota,
+// which cgroups denote by a negative quota.
+inline int CpusOfCfsQuota(long quota, long period) {
+  if (quota <= 0 || period <= 0) {
+    return 0;
+  }
+  return static_cast<int>(std::max(1L, (quota + period - 1) / period));
+}
+
+// Parses a cgroup v2 cpu.max file, "$MAX $PERIOD" where $MAX may be "max"
+// for no quota, see CpusOfCfsQuota.
+inline int ParseCgroupCpuMax(const std::string& cpu_max) {
+  char* end;
+  const long quota = std::strtol(cpu_max.c_str(), &end, 10);
+  if (end == cpu_max.c_str()) {
+    return 0;
+  }
+  return CpusOfCfsQuota(quota, std::strtol(end, nullptr, 10));
+}
+
+// Returns the CPU quota of a process from the cgroup filesystem mounted at
+// cgroup_root, normally /sys/fs/cgroup, given the contents of its
+// /proc/<pid>/cgroup file, or 0 if there is none. Both the unified (v2)
+// hierarchy, with cpu.max files, and the cpu controller of the v1
+// hierarchies, with cpu.cfs_quota_us files, are supported. The quotas of
+// the ancestors of the cgroup of the process apply to it as well. When
+// the cgroup path is not visible, e.g. in a container without a cgroup
+// namespace, whose own cgroup is mounted at the root, only the ancestors
+// that are visible are read, down to the root.
+inline int ReadCgroupCpuLimit(const std::string& cgroup_root,
+                              const std::string& proc_cgroup) {
+  int limit = 0;
+  auto apply = [&limit](int cpus) {
+    if (cpus > 0) {
+      limit = limit ? std::min(limit, cpus) : cpus;
+    }
+  };
+  std::size_t begin = 0;
+  while (begin < proc_cgroup.size()) {
+    std::size_t end = proc_cgroup.find('\n', begin);
+    if (end == std::string::npos) {
+      end = proc_cgroup.size();
+    }
+    // Lines are "$ID:$CONTROLLERS:$PATH", with an empty list of
+    // controllers for the unified hierarchy.
+    const std::string line = proc_cgroup.substr(begin, end - begin);
+    begin = end + 1;
+    const std::size_t colon1 = line.find(':');
+    const std::size_t colon2 =
+        colon1 == std::string::npos ? colon1 : line.find(':', colon1 + 1);
+    if (colon2 == std::string::npos) {
+      continue;
+    }
+    const std::string controllers =
+        line.substr(colon1 + 1, colon2 - colon1 - 1);
+    std::string path = line.substr(colon2 + 1);
+    std::vector<std::string> mounts;
+    if (controllers.empty()) {
+      mounts = {cgroup_root, cgroup_root + "/unified"};
+    } else if (("," + controllers + ",").find(",cpu,") != std::string::npos) {
+      mounts = {cgroup_root + "/" + controllers, cgroup_root + "/cpu",
+                cgroup_root + "/cpu,cpuacct"};
+    } else {
+      continue;
+    }
+    for (const std::string& mount : mounts) {
+      std::string dir_path = path;
+      while (true) {
+        const std::string dir = mount + dir_path;
+        std::string contents;
+        if (controllers.empty()) {
+          if (ReadFirstLine(dir + "/cpu.max", &contents)) {
+            apply(ParseCgroupCpuMax(contents));
+          }
+        } else if (ReadFirstLine(dir + "/cpu.cfs_quota_us", &contents)) {
+          const long quota = std::strtol(contents.c_str(), nullptr, 10);
+          if (ReadFirstLine(dir + "/cpu.cfs_period_us", &contents)) {
+            apply(CpusOfCfsQuota(quota,
+                                 std::strtol(contents.c_str(), nullptr, 10)));
+          }
+        }
+        const std::size_t slash = dir_path.find_last_of('/');
+        if (slash == std::string::npos || dir_path == "/") {
+          break;
+        }
+        dir_path = slash ? dir_path.substr(0, slash) : "/";
+      }
+    }
+  }
+  return limit;
+}
+
+// Returns the number of CPUs that this process may use, that is the
+// smallest of the number of hardware threads, of the number of CPUs in the
+// affinity mask of the calling thread, and of the CPU quota of the cgroups
+// of the process, rounded up.
+inline int DetectAvailableCpus() {
+  int cpus = GetHardwareConcurrency(0);
+  const int affinity_cpus = GetCurrentThreadAffinityCount();
+  if (affinity_cpus > 0) {
+    cpus = std::min(cpus, affinity_cpus);
+  }
+#ifdef __linux__
+  std::string proc_cgroup;
+  if (ReadFile("/proc/self/cgroup", &proc_cgroup)) {
+    const int cgroup_cpus = ReadCgroupCpuLimit("/sys/fs/cgroup", proc_cgroup);
+    if (cgroup_cpus > 0) {
+      cpus = std::min(cpus, cgroup_cpus);
+    }
+  }
+#endif
+  return std::max(1, cpus);
+}
+
+// The cached result of DetectAvailableCpus, or 0 before the first call.
+inline std::atomic<int>& AvailableCpusCache() {
+  static std::atomic<int> cpus(0);
+  return cpus;
+}
+
+// Detects again the number of CPUs that this process may use, see
+// GetAvailableCpus, e.g. after its affinity mask or its CPU quota changed,
+// and returns it.
+inline int RefreshAvailableCpus() {
+  const int cpus = DetectAvailableCpus();
+  AvailableCpusCache().store(cpus, std::memory_order_relaxed);
+  return cpus;
+}
+
+// Returns the number of CPUs that this process may use, see
+// DetectAvailableCpus. This is detected on the first call, and then only
+// by calls to RefreshAvailableCpus. This is what the special value 0 of
+// MultiThreadGemmContextBase::max_num_threads_ stands for.
+inline int GetAvailableCpus() {
+  const int cpus = AvailableCpusCache().load(std::memory_order_relaxed);
+  return cpus ? cpus : RefreshAvailableCpus();
+}
+
+// Like GetHardwareConcurrency, but with the special value 0 meaning the
+// CPUs that this process may use, see GetAvailableCpus.
+inline int GetAvailableConcurrency(int max_threads) {
+  return max_threads ? max_threads : GetAvailableCpus();
+}
+
+// The caches seen by a hardware thread: their sizes, in bytes, and the
+// number of hardware threads sharing them. Values are 0 if unknown. The
+// last-level cache is that of the highest level above 2, if any.
+struct CacheSizes {
+  int l1_bytes = 0;
+  int l2_bytes = 0;
+  int l2_sharing = 0;
+  int llc_bytes = 0;
+  int llc_sharing = 0;
+  int line_bytes = 0;
+};
+
+// Returns the caches of the first CPU of a topology.
+inline CacheSizes GetCacheSizesOfTopology(const CpuTopology& topology) {
+  CacheSizes sizes;
+  if (!topology.l1_caches.empty()) {
+    sizes.l1_bytes = topology.l1_caches[0].size_bytes;
+    sizes.line_bytes = topology.l1_caches[0].line_bytes;
+  }
+  if (!topology.l2_caches.empty()) {
+    sizes.l2_bytes = topology.l2_caches[0].size_bytes;
+    sizes.l2_sharing = static_cast<int>(topology.l2_caches[0].cpus.size());
+  }
+  if (!topology.llc_caches.empty()) {
+    sizes.llc_bytes = topology.llc_caches[0].size_bytes;
+    sizes.llc_sharing = static_cast<int>(topology.llc_caches[0].cpus.size());
+  }
+  return sizes;
+}
+
+// Reads the caches of the current CPU from cpuid, through the
+// deterministic cache parameters leaf, or its AMD counterpart. Returns
+// false if they can't be read that way.
+inline bool ReadCacheSizesFromCpuid(CacheSizes* sizes) {
+#ifdef GEMMLOWP_USE_CPUID
+  for (unsigned int leaf : {0x4u, 0x8000001du}) {
+    if (__get_cpuid_max(leaf & 0x80000000u, nullptr) < leaf) {
+      continue;
+    }
+    CacheSizes result;
+    int llc_level = 2;
+    for (unsigned int index = 0; index < 16; index++) {
+      unsigned int eax, ebx, ecx, edx;
+      __cpuid_count(leaf, index, eax, ebx, ecx, edx);
+      // Cache types are 1 for data, 2 for instruction and 3 for unified
+      // caches, and 0 past the last cache.
+      const unsigned int type = eax & 0x1f;
+      if (type == 0) {
+        break;
+      }
+      if (type == 2) {
+        continue;
+      }
+      const int level = (eax >> 5) & 0x7;
+      const int sharing = static_cast<int>((eax >> 14) & 0xfff) + 1;
+      const int line_bytes = static_cast<int>(ebx & 0xfff) + 1;
+      const int partitions = static_cast<int>((ebx >> 12) & 0x3ff) + 1;
+      const int ways = static_cast<int>((ebx >> 22) & 0x3ff) + 1;
+      const int sets = static_cast<int>(ecx) + 1;
+      const int size_bytes = ways * partitions * line_bytes * sets;
+      if (level == 1) {
+        result.l1_bytes = size_bytes;
+        result.line_bytes = line_bytes;
+      } else if (level == 2) {
+        result.l2_bytes = size_bytes;
+        result.l2_sharing = sharing;
+      } else if (level >= llc_level) {
+        llc_level = level;
+        result.llc_bytes = size_bytes;
+        result.llc_sharing = sharing;
+      }
+    }
+    if (result.l1_bytes || result.l2_bytes) {
+      *sizes = result;
+      return true;
+    }
+  }
+#else
+  (void)sizes;
+#endif
+  return false;
+}
+
+// Returns the caches of the current machine, detected once: those of the
+// topology (see GetCpuTopology) if known, else those from cpuid.
+inline const CacheSizes& GetCacheSizes() {
+  static const CacheSizes sizes = []() {
+    CacheSizes result = GetCacheSizesOfTopology(GetCpuTopology());
+    if (!result.l1_bytes && !result.l2_bytes) {
+      ReadCacheSizesFromCpuid(&result);
+    }
+    return result;
+  }();
+  return sizes;
+}
+
+// The default cache budgets of contexts, see SingleThreadGemmContext: the
+// sizes of the detected caches, or the compile-time defaults of common.h
+// when unknown. The last-level cache budget is the share of one of the
+// hardware threads sharing it, and 0, for no such budget, if there is no
+// last-level cache above L2.
+inline int DefaultL1BytesToUse() {
+  const int l1_bytes = GetCacheSizes().l1_bytes;
+  return l1_bytes ? l1_bytes : kDefaultL1CacheSize;
+}
+
+inline int DefaultL2BytesToUse() {
+  const int l2_bytes = GetCacheSizes().l2_bytes;
+  return l2_bytes ? l2_bytes : kDefaultL2CacheSize;
+}
+
+inline int DefaultLlcBytesToUse() {
+  const CacheSizes& sizes = GetCacheSizes();
+  return sizes.llc_bytes / std::max(1, sizes.llc_sharing);
+}
+
+// Returns the sets of CPUs that successive threads should be pinned to
+// under the given policy, or an empty vector for AffinityPolicy::None.
+// cpu_set is only used by AffinityPolicy::CpuSet.
+inline std::vector<std::vector<int>> GetThreadPlacement(
+    const CpuTopology& topology, AffinityPolicy policy,
+    const std::vector<int>& cpu_set) {
+  std::vector<std::vector<int>> placement;
+  switch (policy) {
+    case AffinityPolicy::None:
+      break;
+    case AffinityPolicy::PhysicalCores:
+      placement = topology.cores;
+      break;
+    case AffinityPolicy::AvoidSmtSiblings:
+      for (const auto& core : topology.cores) {
+        placement.push_back(std::vector<int>(1, core[0]));
+      }
+      break;
+    case AffinityPolicy::CpuSet:
+      for (int cpu : cpu_set) {
+        placement.push_back(std::vector<int>(1, cpu));
+      }
+      break;
+  }
+  return placement;
+}
+
+// Returns how many bytes of L2 cache each thread can use when threads are
+// placed as given, that is, the size of the L2 caches divided by the
+// largest number of threads sharing one of them. Returns 0 if unknown.
+inline int GetL2BytesPerThread(const CpuTopology& topology,
+                               const std::vector<std::vector<int>>& placement) {
+  int result = 0;
+  for (const auto& cache : topology.l2_caches) {
+    int threads_sharing = 0;
+    for (const auto& cpus : placement) {
+      if (std::count(cache.cpus.begin(), cache.cpus.end(), cpus[0])) {
+        threads_sharing++;
+      }
+    }
+    if (threads_sharing) {
+      const int bytes_per_thread = cache.size_bytes / threads_sharing;
+      result = result ? std::min(result, bytes_per_thread) : bytes_per_thread;
+    }
+  }
+  return result;
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_CPU_TOPOLOGY_H_
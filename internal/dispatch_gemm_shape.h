@@ -152,12 +152,11 @@ template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
           MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
           typename LhsOffset, typename RhsOffset, typename OutputPipelineType,
           typename GemmContextType>
-void DispatchGemmShape(GemmContextType* context,
-                       const MatrixMap<const InputScalar, LhsOrder>& lhs,
-                       const MatrixMap<const InputScalar, RhsOrder>& rhs,
-                       MatrixMap<OutputScalar, ResultOrder>* result,
-                       const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
-                       const OutputPipelineType& output_pipeline) {
+void DispatchGemmShapeUnrecorded(
+    GemmContextType* context, const MatrixMap<const InputScalar, LhsOrder>& lhs,
+    const MatrixMap<const InputScalar, RhsOrder>& rhs,
+    MatrixMap<OutputScalar, ResultOrder>* result, const LhsOffset& lhs_offset,
+    const RhsOffset& rhs_offset, const OutputPipelineType& output_pipeline) {
   assert(lhs.cols() == rhs.rows());
 
   int rows = result->rows();
@@ -172,7 +171,8 @@ void DispatchGemmShape(GemmContextType* context,
 
   if (rows < cols) {
     auto transposed_result_map = Transpose(*result);
-    return DispatchGemmShape<InputScalar, OutputScalar, BitDepthParams>(
+    return DispatchGemmShapeUnrecorded<InputScalar, OutputScalar,
+                                       BitDepthParams>(
         context, Transpose(rhs), Transpose(lhs), &transposed_result_map,
         Transpose(rhs_offset), Transpose(lhs_offset),
         TransposeTuple(output_pipeline));
@@ -184,6 +184,33 @@ void DispatchGemmShape(GemmContextType* context,
                                   lhs_offset, rhs_offset, output_pipeline);
 }
 
+// Runs a Gemm, recording it if the context has a recorder, see
+// SingleThreadGemmContext::set_gemm_recorder.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType,
+          typename GemmContextType>
+void DispatchGemmShape(GemmContextType* context,
+                       const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                       const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                       MatrixMap<OutputScalar, ResultOrder>* result,
+                       const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
+                       const OutputPipelineType& output_pipeline) {
+  GemmRecorder* recorder = context->gemm_recorder();
+  if (!recorder) {
+    return DispatchGemmShapeUnrecorded<InputScalar, OutputScalar,
+                                       BitDepthParams>(
+        context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline);
+  }
+  const double start_seconds = GemmRecorder::NowSeconds();
+  DispatchGemmShapeUnrecorded<InputScalar, OutputScalar, BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline);
+  recorder->Record(
+      MakeGemmRecord<InputScalar, OutputScalar, BitDepthParams, LhsOrder,
+                     RhsOrder, ResultOrder, OutputPipelineType>(
+          lhs, *result, GemmRecorder::NowSeconds() - start_seconds));
+}
+
 }  // end namespace gemmlowp
 
 #endif  // GEMMLOWP_INTERNAL_DISPATCH_GEMM_SHAPE_H_
@@ -0,0 +1,270 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// gemm_recorder.h: records of the Gemms run by an application, with their
+// shapes, operand types and latencies, for test/benchmark_replay.cc to
+// replay them as a benchmark of the actual mix of Gemms of the
+// application. A context given a recorder (see
+// SingleThreadGemmContext::set_gemm_recorder) records each of its Gemms.
+
+#ifndef GEMMLOWP_INTERNAL_GEMM_RECORDER_H_
+#define GEMMLOWP_INTERNAL_GEMM_RECORDER_H_
+
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "../public/map.h"
+#include "allocator.h"
+
+namespace gemmlowp {
+
+// A Gemm, as called: before it is transposed to have at least as many rows
+// as columns.
+struct GemmRecord {
+  int rows;
+  int depth;
+  int cols;
+  MapOrder lhs_order;
+  MapOrder rhs_order;
+  MapOrder result_order;
+  // The ranges of the operands, see BitDepthParams.
+  int lhs_min;
+  int lhs_max;
+  int rhs_min;
+  int rhs_max;
+  TypeId input_type;
+  TypeId output_type;
+  // The count of stages of the output pipeline.
+  int output_stages;
+  double seconds;
+};
+
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename OutputPipelineType>
+GemmRecord MakeGemmRecord(const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                          const MatrixMap<OutputScalar, ResultOrder>& result,
+                          double seconds) {
+  GemmRecord record;
+  record.rows = result.rows();
+  record.depth = lhs.cols();
+  record.cols = result.cols();
+  record.lhs_order = LhsOrder;
+  record.rhs_order = RhsOrder;
+  record.result_order = ResultOrder;
+  record.lhs_min = BitDepthParams::LhsRange::kMinValue;
+  record.lhs_max = BitDepthParams::LhsRange::kMaxValue;
+  record.rhs_min = BitDepthParams::RhsRange::kMinValue;
+  record.rhs_max = BitDepthParams::RhsRange::kMaxValue;
+  record.input_type = GetTypeId<InputScalar>();
+  record.output_type = GetTypeId<OutputScalar>();
+  record.output_stages = std::tuple_size<OutputPipelineType>::value;
+  record.seconds = seconds;
+  return record;
+}
+
+// Collects GemmRecords from any number of threads, either in memory or
+// streamed to a file, see Open.
+class GemmRecorder {
+ public:
+  GemmRecorder() : file_(nullptr) {}
+  ~GemmRecorder() { Close(); }
+
+  // A monotonic time, for the latencies of Gemms.
+  static double NowSeconds() {
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // The first line of record files, followed by a line per Gemm made of
+  // its dimensions, its orders as R or C, its operand ranges, its input and
+  // output types, its count of output stages and its latency in seconds.
+  static const char* header() { return "gemmlowp_gemm_records 1"; }
+
+  static std::string Serialize(const GemmRecord& record) {
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%d %d %d %c %c %c %d %d %d %d %s %s %d %.9g\n", record.rows,
+             record.depth, record.cols, OrderName(record.lhs_order),
+             OrderName(record.rhs_order), OrderName(record.result_order),
+             record.lhs_min, record.lhs_max, record.rhs_min, record.rhs_max,
+             TypeName(record.input_type), TypeName(record.output_type),
+             record.output_stages, record.seconds);
+    return line;
+  }
+
+  // Reads a line of a record file. Returns false if it is malformed.
+  static bool Parse(const std::string& line, GemmRecord* record) {
+    std::istringstream fields(line);
+    char lhs_order, rhs_order, result_order;
+    std::string input_type, output_type, extra;
+    if (!(fields >> record->rows >> record->depth >> record->cols >>
+          lhs_order >> rhs_order >> result_order >> record->lhs_min >>
+          record->lhs_max >> record->rhs_min >> record->rhs_max >>
+          input_type >> output_type >> record->output_stages >>
+          record->seconds) ||
+        (fields >> extra)) {
+      return false;
+    }
+    return record->rows >= 0 && record->depth >= 0 && record->cols >= 0 &&
+           ParseOrder(lhs_order, &record->lhs_order) &&
+           ParseOrder(rhs_order, &record->rhs_order) &&
+           ParseOrder(result_order, &record->result_order) &&
+           ParseType(input_type, &record->input_type) &&
+           ParseType(output_type, &record->output_type);
+  }
+
+  // Streams subsequent records to the given file, instead of keeping them
+  // in memory. Returns false on failure.
+  bool Open(const std::string& path) {
+    ScopedLock sl(&mutex_);
+    CloseLocked();
+    file_ = fopen(path.c_str(), "w");
+    if (!file_) {
+      return false;
+    }
+    fprintf(file_, "%s\n", header());
+    return true;
+  }
+
+  // Stops streaming records to a file, and flushes it.
+  void Close() {
+    ScopedLock sl(&mutex_);
+    CloseLocked();
+  }
+
+  void Record(const GemmRecord& record) {
+    ScopedLock sl(&mutex_);
+    if (file_) {
+      const std::string line = Serialize(record);
+      fwrite(line.data(), 1, line.size(), file_);
+    } else {
+      records_.push_back(record);
+    }
+  }
+
+  // The records kept in memory.
+  std::vector<GemmRecord> records() {
+    ScopedLock sl(&mutex_);
+    return records_;
+  }
+  void clear() {
+    ScopedLock sl(&mutex_);
+    records_.clear();
+  }
+
+  // Writes the records kept in memory to a file. Returns false on failure.
+  bool Save(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+      return false;
+    }
+    std::string text = header();
+    text += '\n';
+    for (const GemmRecord& record : records()) {
+      text += Serialize(record);
+    }
+    bool success = fwrite(text.data(), 1, text.size(), file) == text.size();
+    success = fclose(file) == 0 && success;
+    return success;
+  }
+
+  // Reads the records of a file. Returns false if it can't be read or is
+  // malformed.
+  static bool Load(const std::string& path, std::vector<GemmRecord>* records) {
+    records->clear();
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+      return false;
+    }
+    std::string text;
+    char buf[4096];
+    std::size_t count;
+    while ((count = fread(buf, 1, sizeof(buf), file)) > 0) {
+      text.append(buf, count);
+    }
+    fclose(file);
+    std::istringstream stream(text);
+    std::string line;
+    if (!std::getline(stream, line) || line != header()) {
+      return false;
+    }
+    while (std::getline(stream, line)) {
+      if (line.empty()) {
+        continue;
+      }
+      GemmRecord record;
+      if (!Parse(line, &record)) {
+        records->clear();
+        return false;
+      }
+      records->push_back(record);
+    }
+    return true;
+  }
+
+ private:
+  GemmRecorder(const GemmRecorder&) = delete;
+
+  static char OrderName(MapOrder order) {
+    return order == MapOrder::RowMajor ? 'R' : 'C';
+  }
+
+  static bool ParseOrder(char name, MapOrder* order) {
+    if (name != 'R' && name != 'C') {
+      return false;
+    }
+    *order = name == 'R' ? MapOrder::RowMajor : MapOrder::ColMajor;
+    return true;
+  }
+
+  static const char* const* TypeNames() {
+    static const char* const names[] = {"u8", "i8", "u16", "i16", "u32", "i32"};
+    return names;
+  }
+
+  static const char* TypeName(TypeId type) {
+    return TypeNames()[static_cast<int>(type)];
+  }
+
+  static bool ParseType(const std::string& name, TypeId* type) {
+    for (int i = 0; i <= static_cast<int>(TypeId::Int32); i++) {
+      if (name == TypeNames()[i]) {
+        *type = static_cast<TypeId>(i);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void CloseLocked() {
+    if (file_) {
+      fclose(file_);
+      file_ = nullptr;
+    }
+  }
+
+  Mutex mutex_;
+  FILE* file_;
+  std::vector<GemmRecord> records_;
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_GEMM_RECORDER_H_
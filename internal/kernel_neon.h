@@ -43,7 +43,8 @@ struct NEON_32_Kernel12x4Depth2 : KernelBase {
            std::size_t dst_col_stride, const std::uint8_t* lhs_ptr,
            const std::uint8_t* rhs_ptr, std::size_t start_depth,
            std::size_t run_depth) const override {
-    ScopedProfilingLabel label("optimized kernel (NEON 12x4)");
+    ScopedProfilingLabel label("optimized kernel (NEON 12x4)",
+                               NotTraced());
 
 // For iOS assembler, the %= style of local labels cause compilation errors,
 //  so use numerical ones instead. See
@@ -306,7 +307,8 @@ struct NEON_32_Kernel12x4Depth2Assuming12BitProducts : KernelBase {
            const std::uint8_t* rhs_ptr, std::size_t start_depth,
            std::size_t run_depth) const override {
     ScopedProfilingLabel label(
-        "optimized kernel (NEON 12x4, assuming 12-bit products)");
+        "optimized kernel (NEON 12x4, assuming 12-bit products)",
+        NotTraced());
     assert(dst_row_stride == 1);
 
 // See comments above for why we need local numerical labels in our asm.
@@ -1275,7 +1277,8 @@ struct NEON_64_Kernel12x8Depth2 : KernelBase {
            std::size_t dst_col_stride, const std::uint8_t* lhs_ptr,
            const std::uint8_t* rhs_ptr, std::size_t start_depth,
            std::size_t run_depth) const override {
-    ScopedProfilingLabel label("optimized kernel (NEON 12x8)");
+    ScopedProfilingLabel label("optimized kernel (NEON 12x8)",
+                               NotTraced());
 // See comments above for why we need local numerical labels in our asm.
 #define GEMMLOWP_LABEL_CLEAR_ACCUMULATORS "1"
 #define GEMMLOWP_LABEL_BEFORE_LOOP "2"
@@ -41,7 +41,7 @@ struct SSE4_32_Kernel4x4Depth2 : KernelBase {
            std::size_t dst_col_stride, const std::uint8_t* lhs_ptr,
            const std::uint8_t* rhs_ptr, std::size_t start_depth,
            std::size_t run_depth) const override {
-    ScopedProfilingLabel label("optimized kernel");
+    ScopedProfilingLabel label("optimized kernel", NotTraced());
     assert(dst_row_stride == 1);
     std::int32_t run_depth_cells = run_depth / Format::kDepth;
     /* Main loop */
@@ -215,7 +215,7 @@ struct SSE4_64_Kernel12x4Depth2 : KernelBase {
            std::size_t dst_col_stride, const std::uint8_t* lhs_ptr,
            const std::uint8_t* rhs_ptr, std::size_t start_depth,
            std::size_t run_depth) const override {
-    ScopedProfilingLabel label("optimized kernel");
+    ScopedProfilingLabel label("optimized kernel", NotTraced());
     assert(dst_row_stride == 1);
     const std::int64_t run_depth_cells = run_depth / Format::kDepth;
     const std::int64_t dst_col_stride_q = dst_col_stride;
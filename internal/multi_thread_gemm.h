@@ -19,23 +19,27 @@
 #ifndef GEMMLOWP_INTERNAL_MULTI_THREAD_GEMM_H_
 #define GEMMLOWP_INTERNAL_MULTI_THREAD_GEMM_H_
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
 #include <vector>
 
+#include "cost_model.h"
+#include "cpu_topology.h"
 #include "single_thread_gemm.h"
 
 namespace gemmlowp {
 
-// On X86 and ARM platforms we enable a busy-wait spinlock before waiting on a
-// pthread conditional variable. In order to implement that correctly we need
-// to put some explicit memory load/store barriers.
+// On X86 and ARM platforms we enable a busy-wait spinlock before blocking
+// on a futex or condition variable.
 
 #if defined(GEMMLOWP_ALLOW_INLINE_ASM) && !defined(GEMMLOWP_NO_BUSYWAIT) && \
     (defined(GEMMLOWP_ARM) || defined(GEMMLOWP_X86))
 
 #define GEMMLOWP_USE_BUSYWAIT
 
-const int kMaxBusyWaitNOPs = 32 * 1000 * 1000;
-
 #define GEMMLOWP_NOP "nop\n"
 
 #define GEMMLOWP_STRING_CONCAT_4(X) X X X X
@@ -55,48 +59,35 @@ inline int Do256NOPs() {
 #undef GEMMLOWP_NOP4
 #undef GEMMLOWP_NOP
 
-inline void WriteBarrier() {
-#if defined(_MSC_VER)
-  MemoryBarrier();
-#elif defined(GEMMLOWP_ARM_32)
-  asm volatile("" ::: "memory");
-#elif defined(GEMMLOWP_ARM_64)
-  asm volatile("dmb ishst" ::: "memory");
-#elif defined(GEMMLOWP_X86)
-  asm volatile("sfence" ::: "memory");
-#else
-#error "Unsupported architecture for WriteBarrier."
-#endif
+// Returns an estimate of how many NOPs per second Do256NOPs() runs,
+// measured on first use. This allows to size spin windows in time units.
+inline double BusyWaitNOPsPerSecond() {
+  static const double nops_per_second = []() {
+    const int kCalibrationNOPs = 1 << 20;
+    const double time_start = real_time_in_seconds();
+    for (int nops = 0; nops < kCalibrationNOPs;) {
+      nops += Do256NOPs();
+    }
+    const double elapsed = real_time_in_seconds() - time_start;
+    return elapsed > 0 ? kCalibrationNOPs / elapsed : 1e9;
+  }();
+  return nops_per_second;
 }
 
-inline void ReadBarrier() {
-#if defined(_MSC_VER)
-  MemoryBarrier();
-#elif defined(GEMMLOWP_ARM_32)
-  asm volatile("" ::: "memory");
-#elif defined(GEMMLOWP_ARM_64)
-  asm volatile("dmb ishld" ::: "memory");
-#elif defined(GEMMLOWP_X86)
-  asm volatile("lfence" ::: "memory");
-#else
-#error "Unsupported architecture for ReadBarrier."
 #endif
-}
 
-#endif
+// The default, and maximum, number of NOPs to busy-wait for before
+// reverting to passive waiting. See SpinPolicy for how the number of NOPs
+// actually used by workers waiting for work is chosen.
+const int kMaxBusyWaitNOPs = 32 * 1000 * 1000;
 
-// Waits until *var != initial_value.
-//
-// Returns the new value of *var. The guarantee here is that
-// the return value is different from initial_value, and that that
-// new value has been taken by *var at some point during the
-// execution of this function. There is no guarantee that this is
-// still the value of *var when this function returns, since *var is
-// not assumed to be guarded by any lock.
+// An atomic variable that threads can wait on until it changes value.
 //
-// First does some busy-waiting for a fixed number of no-op cycles,
-// then falls back to passive waiting for the given condvar, guarded
-// by the given mutex.
+// All accesses are lock-free. Waiting first does some busy-waiting for a
+// fixed number of no-op cycles, then falls back to passive waiting: on
+// Linux, directly on the futex of the variable, elsewhere on a condvar.
+// Threads modifying the variable only pay for a wake-up syscall if some
+// thread is actually passively waiting on it.
 //
 // The idea of doing some initial busy-waiting is to help get
 // better and more consistent multithreading benefits for small GEMM sizes.
@@ -107,68 +98,151 @@ inline void ReadBarrier() {
 // (e.g. worker threads having finished a GEMM and waiting until the next GEMM)
 // so as to avoid permanently spinning.
 //
+// T must be an int-sized integer or enum type.
 template <typename T>
-T WaitForVariableChange(volatile T* var, T initial_value, pthread_cond_t* cond,
-                        pthread_mutex_t* mutex) {
-#ifdef GEMMLOWP_USE_BUSYWAIT
-  // If we are on a platform that supports it, spin for some time.
-  {
-    int nops = 0;
+class WaitableAtomic {
+ public:
+  explicit WaitableAtomic(T initial_value = T())
+      : value_(static_cast<int>(initial_value)), sleepers_(0) {
+    static_assert(sizeof(T) == sizeof(int), "T must be int-sized");
+#ifndef GEMMLOWP_USE_FUTEX
+    pthread_cond_init(&cond_, nullptr);
+    pthread_mutex_init(&mutex_, nullptr);
+#endif
+  }
+
+  ~WaitableAtomic() {
+#ifndef GEMMLOWP_USE_FUTEX
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+#endif
+  }
+
+  T load() const {
+    return static_cast<T>(value_.load(std::memory_order_acquire));
+  }
+
+  // The modifying operations have release semantics, pairing with the
+  // acquire semantics of load() and WaitForChange(), and wake up any
+  // passively waiting thread.
+  void store(T new_value) {
+    value_.store(static_cast<int>(new_value), std::memory_order_seq_cst);
+    WakeSleepers();
+  }
+
+  T exchange(T new_value) {
+    const int old_value =
+        value_.exchange(static_cast<int>(new_value), std::memory_order_seq_cst);
+    WakeSleepers();
+    return static_cast<T>(old_value);
+  }
+
+  // Returns the previous value.
+  T fetch_sub(T arg) {
+    const int old_value =
+        value_.fetch_sub(static_cast<int>(arg), std::memory_order_seq_cst);
+    WakeSleepers();
+    return static_cast<T>(old_value);
+  }
+
+  // Waits until the value != initial_value, busy-waiting for at most
+  // max_busy_wait_nops NOPs before waiting passively. If slept is not null,
+  // it is set to whether passive waiting was needed.
+  //
+  // Returns the new value. The guarantee here is that the return value is
+  // different from initial_value, and that that new value has been taken
+  // by the variable at some point during the execution of this function.
+  // There is no guarantee that this is still its value when this function
+  // returns.
+  T WaitForChange(T initial_value, int max_busy_wait_nops = kMaxBusyWaitNOPs,
+                  bool* slept = nullptr) {
+    const int initial = static_cast<int>(initial_value);
+    if (slept) {
+      *slept = false;
+    }
     // First, trivial case where the variable already changed value.
-    T new_value = *var;
-    if (new_value != initial_value) {
-      ReadBarrier();
-      return new_value;
+    int new_value = value_.load(std::memory_order_acquire);
+    if (new_value != initial) {
+      return static_cast<T>(new_value);
     }
-    // Then try busy-waiting.
-    while (nops < kMaxBusyWaitNOPs) {
+#ifdef GEMMLOWP_USE_BUSYWAIT
+    // If we are on a platform that supports it, spin for some time.
+    for (int nops = 0; nops < max_busy_wait_nops;) {
       nops += Do256NOPs();
-      new_value = *var;
-      if (new_value != initial_value) {
-        ReadBarrier();
-        return new_value;
+      new_value = value_.load(std::memory_order_acquire);
+      if (new_value != initial) {
+        return static_cast<T>(new_value);
       }
     }
-  }
+#else
+    (void)max_busy_wait_nops;
 #endif
+    if (slept) {
+      *slept = true;
+    }
+    // Finally, do real passive waiting. Registering as a sleeper before
+    // re-checking the value, both sequentially consistent, ensures that
+    // either we see the new value or the modifying thread sees us.
+    ScopedProfilingLabel label("WaitableAtomic::WaitForChange (passive)");
+#ifdef GEMMLOWP_USE_FUTEX
+    sleepers_.fetch_add(1, std::memory_order_seq_cst);
+    while ((new_value = value_.load(std::memory_order_seq_cst)) == initial) {
+      FutexWait(&value_, initial);
+    }
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+#else
+    pthread_mutex_lock(&mutex_);
+    sleepers_.fetch_add(1, std::memory_order_seq_cst);
+    while ((new_value = value_.load(std::memory_order_seq_cst)) == initial) {
+      pthread_cond_wait(&cond_, &mutex_);
+    }
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+    pthread_mutex_unlock(&mutex_);
+#endif
+    return static_cast<T>(new_value);
+  }
+
+ private:
+  WaitableAtomic(const WaitableAtomic&) = delete;
 
-  // Finally, do real passive waiting.
-  pthread_mutex_lock(mutex);
-  T new_value = *var;
-  if (new_value == initial_value) {
-    pthread_cond_wait(cond, mutex);
-    new_value = *var;
-    assert(new_value != initial_value);
+  void WakeSleepers() {
+    if (!sleepers_.load(std::memory_order_seq_cst)) {
+      return;
+    }
+#ifdef GEMMLOWP_USE_FUTEX
+    FutexWakeAll(&value_);
+#else
+    pthread_mutex_lock(&mutex_);
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+#endif
   }
-  pthread_mutex_unlock(mutex);
-  return new_value;
-}
+
+  std::atomic<int> value_;
+
+  // How many threads are passively waiting for value_ to change.
+  std::atomic<int> sleepers_;
+
+#ifndef GEMMLOWP_USE_FUTEX
+  // The condition variable and mutex used for passive waiting where
+  // futexes are not available.
+  pthread_cond_t cond_;
+  pthread_mutex_t mutex_;
+#endif
+};
 
 // A BlockingCounter lets one thread to wait for N events to occur.
 // This is how the master thread waits for all the worker threads
 // to have finished working.
 class BlockingCounter {
  public:
-  BlockingCounter()
-      : count_(0),
-        initial_count_(0) {
-    pthread_cond_init(&cond_, nullptr);
-    pthread_mutex_init(&mutex_, nullptr);
-  }
-
-  ~BlockingCounter() {
-    pthread_cond_destroy(&cond_);
-    pthread_mutex_destroy(&mutex_);
-  }
+  BlockingCounter() : count_(0), decrementing_(0) {}
 
   // Sets/resets the counter; initial_count is the number of
   // decrementing events that the Wait() call will be waiting for.
   void Reset(std::size_t initial_count) {
-    pthread_mutex_lock(&mutex_);
-    assert(count_ == 0);
-    initial_count_ = initial_count;
-    count_ = initial_count_;
-    pthread_mutex_unlock(&mutex_);
+    assert(count_.load() == 0);
+    count_.store(static_cast<int>(initial_count));
   }
 
   // Decrements the counter; if the counter hits zero, signals
@@ -176,90 +250,236 @@ class BlockingCounter {
   // Otherwise (if the decremented count is still nonzero),
   // returns false.
   bool DecrementCount() {
-    pthread_mutex_lock(&mutex_);
-    assert(count_ > 0);
-    count_--;
-#ifdef GEMMLOWP_USE_BUSYWAIT
-    WriteBarrier();
-#endif
-    if (count_ == 0) {
-      pthread_cond_signal(&cond_);
-    }
-    bool retval = count_ == 0;
-    pthread_mutex_unlock(&mutex_);
-    return retval;
+    decrementing_.fetch_add(1, std::memory_order_relaxed);
+    const int old_count = count_.fetch_sub(1);
+    assert(old_count > 0);
+    decrementing_.fetch_sub(1, std::memory_order_release);
+    return old_count == 1;
   }
 
+  // Returns whether the counter is zero, i.e. Wait() would not block.
+  bool IsZero() const { return count_.load() == 0; }
+
   // Waits for the N other threads (N having been set by Reset())
-  // to hit the BlockingCounter.
-  void Wait() {
+  // to hit the BlockingCounter. Once this returns, the counter may be
+  // destroyed: this also waits for them to be done waking us up, as the
+  // workers of a SharedWorkersPool may outlive the counters they hit.
+  void Wait(int max_busy_wait_nops = kMaxBusyWaitNOPs) {
     ScopedProfilingLabel label("BlockingCounter::Wait");
-    while (count_) {
+    int count_value;
+    while ((count_value = count_.load()) != 0) {
+      count_.WaitForChange(count_value, max_busy_wait_nops);
+    }
+    while (decrementing_.load(std::memory_order_acquire)) {
+    }
+  }
+
+ private:
+  WaitableAtomic<int> count_;
+
+  // How many threads are in DecrementCount.
+  std::atomic<int> decrementing_;
+};
+
+// How worker threads should trade off latency against power when waiting,
+// see SpinPolicy.
+enum class SpinMode {
+  // Always busy-wait for the maximum time before sleeping, as was done
+  // historically. Lowest latency, but burns CPU after every GEMM.
+  LatencyFirst,
+  // Busy-wait only as long as the next GEMM is expected to come soon,
+  // based on the recent gaps between GEMMs. This is the default.
+  Balanced,
+  // Never busy-wait: sleep right away, and rely on the OS to wake us up.
+  PowerFirst
+};
+
+// Counts of waits for new work by worker threads, distinguishing those
+// satisfied while busy-waiting ("hits") from those that had to revert to
+// passive waiting ("misses").
+struct SpinStats {
+  std::size_t hits;
+  std::size_t misses;
+};
+
+// The policy deciding how long the threads of a WorkersPool busy-wait.
+//
+// Spinning for a fixed amount of time before sleeping is wasteful when
+// GEMMs are seconds apart, yet too short when they come every few
+// milliseconds. So the pool records the time between consecutive
+// dispatches, and in Balanced mode sizes the spin window of idle workers
+// after an exponentially-weighted moving average of these gaps: workers
+// spin for up to twice the expected gap if that fits within
+// kMaxBusyWaitNOPs, and otherwise go to sleep right away since they would
+// be woken up by the OS anyway.
+class SpinPolicy {
+ public:
+  SpinPolicy()
+      : mode_(SpinMode::Balanced),
+        last_dispatch_time_(0),
+        dispatch_gap_average_(0),
+        idle_spin_nops_(kMaxBusyWaitNOPs),
+        hits_(0),
+        misses_(0) {}
+
+  void set_mode(SpinMode mode) {
+    mode_ = mode;
+    UpdateIdleSpinNOPs();
+  }
+  SpinMode mode() const { return mode_; }
+
+  // Called by the master thread each time it dispatches work.
+  void RecordDispatch() {
+    const double now = real_time_in_seconds();
+    if (last_dispatch_time_ > 0) {
+      const double gap = now - last_dispatch_time_;
+      dispatch_gap_average_ = dispatch_gap_average_ > 0
+                                  ? kAverageWeight * gap +
+                                        (1 - kAverageWeight) *
+                                            dispatch_gap_average_
+                                  : gap;
+    }
+    last_dispatch_time_ = now;
+    UpdateIdleSpinNOPs();
+  }
+
+  // How long workers waiting for new work should busy-wait.
+  int idle_spin_nops() const {
+    return idle_spin_nops_.load(std::memory_order_relaxed);
+  }
+
+  // How long the master thread waiting for workers to finish their
+  // current work should busy-wait.
+  int busy_spin_nops() const {
+    return mode_ == SpinMode::PowerFirst ? 0 : kMaxBusyWaitNOPs;
+  }
+
+  // Called by workers after each wait for new work.
+  void RecordWait(bool slept) {
+    (slept ? misses_ : hits_).fetch_add(1, std::memory_order_relaxed);
+  }
+
+  SpinStats stats() const {
+    SpinStats result;
+    result.hits = hits_.load(std::memory_order_relaxed);
+    result.misses = misses_.load(std::memory_order_relaxed);
+    return result;
+  }
+
+ private:
+  // The weight of the latest gap in the moving average.
+  static constexpr double kAverageWeight = 0.25;
+
+  void UpdateIdleSpinNOPs() {
+    int nops = kMaxBusyWaitNOPs;
+    if (mode_ == SpinMode::PowerFirst) {
+      nops = 0;
+    } else if (mode_ == SpinMode::Balanced && dispatch_gap_average_ > 0) {
 #ifdef GEMMLOWP_USE_BUSYWAIT
-      ReadBarrier();
-#else
-      // This is likely unnecessary, but is kept to ensure regressions are not
-      // introduced.
-#ifndef _WIN32
-      asm volatile("" ::: "memory");
-#endif
+      const double expected_gap_nops =
+          dispatch_gap_average_ * BusyWaitNOPsPerSecond();
+      nops = expected_gap_nops > kMaxBusyWaitNOPs
+                 ? 0
+                 : static_cast<int>(std::min<double>(kMaxBusyWaitNOPs,
+                                                     2 * expected_gap_nops));
 #endif
-      const std::size_t count_value = count_;
-      if (count_value) {
-        WaitForVariableChange(&count_, count_value, &cond_, &mutex_);
-      }
     }
+    idle_spin_nops_.store(nops, std::memory_order_relaxed);
   }
 
- private:
-  pthread_cond_t cond_;
-  pthread_mutex_t mutex_;
-  std::size_t count_;
-  std::size_t initial_count_;
+  SpinPolicy(const SpinPolicy&) = delete;
+
+  // Only accessed by the master thread.
+  SpinMode mode_;
+  double last_dispatch_time_;
+  double dispatch_gap_average_;
+
+  // Read by the worker threads.
+  std::atomic<int> idle_spin_nops_;
+
+  // Updated by the worker threads.
+  std::atomic<std::size_t> hits_;
+  std::atomic<std::size_t> misses_;
+};
+
+// The priority of Gemms in a SharedWorkersPool.
+enum class Priority { Low, Normal, High };
+
+// Queueing statistics of the callers of a given priority in a
+// SharedWorkersPool: how many leases of workers they asked for, how many
+// workers they asked for and got, how long they waited for them in total
+// and at most, in seconds, and how many of their tasks yielded to higher
+// priorities.
+struct PriorityStats {
+  std::size_t leases = 0;
+  std::size_t workers_requested = 0;
+  std::size_t workers_granted = 0;
+  double total_queueing_delay = 0;
+  double max_queueing_delay = 0;
+  std::size_t yields = 0;
 };
 
+class SharedWorkersPool;
+
 // A workload for a worker.
 struct Task {
-  Task() : local_allocator(nullptr) {}
+  Task()
+      : local_allocator(nullptr),
+        start_work_ns(0),
+        run_start_ns(0),
+        run_end_ns(0) {}
   virtual ~Task() {}
   virtual void Run() = 0;
   Allocator* local_allocator;
+
+  // When the task was given to a worker, and started and finished
+  // running, see PoolTelemetry.
+  std::uint64_t start_work_ns;
+  std::uint64_t run_start_ns;
+  std::uint64_t run_end_ns;
 };
 
 // A worker thread.
 class Worker {
  public:
-  enum class State {
+  enum class State : int {
     ThreadStartup,  // The initial state before the thread main loop runs.
     Ready,          // Is not working, has not yet received new work to do.
     HasWork,        // Has work to do.
     ExitAsSoonAsPossible  // Should exit at earliest convenience.
   };
 
-  explicit Worker(BlockingCounter* counter_to_decrement_when_ready)
+  // Workers of a SharedWorkersPool give themselves back to it whenever
+  // they become ready for new work.
+  Worker(BlockingCounter* counter_to_decrement_when_ready,
+         SpinPolicy* spin_policy,
+         SharedWorkersPool* shared_workers_pool = nullptr)
       : task_(nullptr),
         state_(State::ThreadStartup),
-        counter_to_decrement_when_ready_(counter_to_decrement_when_ready) {
-    pthread_cond_init(&state_cond_, nullptr);
-    pthread_mutex_init(&state_mutex_, nullptr);
+        counter_to_decrement_when_ready_(counter_to_decrement_when_ready),
+        spin_policy_(spin_policy),
+        shared_workers_pool_(shared_workers_pool),
+        cpus_changed_(false) {
     pthread_create(&thread_, nullptr, ThreadFunc, this);
   }
 
   ~Worker() {
     ChangeState(State::ExitAsSoonAsPossible);
     pthread_join(thread_, nullptr);
-    pthread_cond_destroy(&state_cond_);
-    pthread_mutex_destroy(&state_mutex_);
   }
 
   // Changes State; may be called from either the worker thread
   // or the master thread; however, not all state transitions are legal,
   // which is guarded by assertions.
+  //
+  // This is lock-free: the new state is published with release semantics,
+  // so that whatever was written before (e.g. task_) is visible to the
+  // thread that sees the new state.
   void ChangeState(State new_state) {
     ScopedProfilingLabel label("Worker::ChangeState");
-    pthread_mutex_lock(&state_mutex_);
-    assert(new_state != state_);
-    switch (state_) {
+    const State old_state = state_.exchange(new_state);
+    assert(new_state != old_state);
+    switch (old_state) {
       case State::ThreadStartup:
         assert(new_state == State::Ready);
         break;
@@ -274,12 +494,21 @@ class Worker {
       default:
         abort();
     }
-    state_ = new_state;
-    pthread_cond_signal(&state_cond_);
-    if (state_ == State::Ready) {
-      counter_to_decrement_when_ready_->DecrementCount();
+  }
+
+  // Switches to the Ready state once started or done with a task, then
+  // notifies the master thread. Workers of a SharedWorkersPool give
+  // themselves back to it in between, so that they can be leased again as
+  // soon as the master thread is done waiting for them. The counter to
+  // decrement is read first, as a new master thread may replace it as soon
+  // as this worker is given back.
+  void BecomeReady() {
+    BlockingCounter* counter_to_decrement = counter_to_decrement_when_ready_;
+    ChangeState(State::Ready);
+    if (shared_workers_pool_) {
+      GiveBackToSharedWorkersPool();
     }
-    pthread_mutex_unlock(&state_mutex_);
+    counter_to_decrement->DecrementCount();
   }
 
   // Thread entry point.
@@ -287,24 +516,32 @@ class Worker {
     ScopedProfilingLabel label("Worker::ThreadFunc");
     RegisterCurrentThreadForProfiling();
 
-    ChangeState(State::Ready);
+    BecomeReady();
 
     // Thread main loop
     while (true) {
       // Get a state to act on
       // In the 'Ready' state, we have nothing to do but to wait until
       // we switch to another state.
-      State state_to_act_upon = WaitForVariableChange(
-          &state_, State::Ready, &state_cond_, &state_mutex_);
+      bool slept;
+      State state_to_act_upon = state_.WaitForChange(
+          State::Ready, spin_policy_->idle_spin_nops(), &slept);
+      spin_policy_->RecordWait(slept);
 
       // We now have a state to act on, so act.
       switch (state_to_act_upon) {
         case State::HasWork:
           // Got work to do! So do it, and then revert to 'Ready' state.
           assert(task_);
+          if (cpus_changed_) {
+            SetCurrentThreadAffinity(cpus_);
+            cpus_changed_ = false;
+          }
+          task_->run_start_ns = PerfCounterSet::NowNanoseconds();
           task_->Run();
+          task_->run_end_ns = PerfCounterSet::NowNanoseconds();
           task_ = nullptr;
-          ChangeState(State::Ready);
+          BecomeReady();
           break;
         case State::ExitAsSoonAsPossible:
           return;
@@ -319,120 +556,1002 @@ class Worker {
     return nullptr;
   }
 
+  // Called by the master thread, while this worker is not working, to set
+  // the CPUs that it should run on. This takes effect when it is next given
+  // work to do.
+  void set_cpus(const std::vector<int>& cpus) {
+    assert(state_.load() != State::HasWork);
+    cpus_ = cpus;
+    cpus_changed_ = true;
+  }
+
+  // The allocator of the tasks run by this worker. May only be used by
+  // the master thread while this worker is not working.
+  Allocator* local_allocator() { return &local_allocator_; }
+
   // Called by the master thead to give this worker work to do.
   // It is only legal to call this if the worker
-  void StartWork(Task* task) {
+  //
+  // The worker then decrements the given counter when done, if any, and
+  // otherwise the counter it was last given.
+  void StartWork(Task* task,
+                 BlockingCounter* counter_to_decrement_when_ready = nullptr) {
     assert(!task_);
     task->local_allocator = &local_allocator_;
+    task->start_work_ns = PerfCounterSet::NowNanoseconds();
     task_ = task;
-#ifdef GEMMLOWP_USE_BUSYWAIT
-    WriteBarrier();
-#endif
-    assert(state_ == State::Ready);
+    if (counter_to_decrement_when_ready) {
+      counter_to_decrement_when_ready_ = counter_to_decrement_when_ready;
+    }
+    assert(state_.load() == State::Ready);
     ChangeState(State::HasWork);
   }
 
- private:
-  // The underlying thread.
-  pthread_t thread_;
+ private:
+  // The underlying thread.
+  pthread_t thread_;
+
+  // The task to be worked on.
+  Task* task_;
+
+  // The state enum tells if we're currently working, waiting for work, etc.
+  WaitableAtomic<State> state_;
+
+  // Each thread had a local allocator so they can allocate temporary
+  // buffers without blocking each other.
+  Allocator local_allocator_;
+
+  // pointer to the master's thread BlockingCounter object, to notify the
+  // master thread of when this worker switches to the 'Ready' state.
+  // Workers of a SharedWorkersPool serve several master threads in turn.
+  BlockingCounter* counter_to_decrement_when_ready_;
+
+  // The policy of the pool that this worker belongs to, deciding how long
+  // to busy-wait for new work.
+  SpinPolicy* const spin_policy_;
+
+  // The shared pool that this worker belongs to, if any.
+  SharedWorkersPool* const shared_workers_pool_;
+  void GiveBackToSharedWorkersPool();
+
+  // The CPUs that this thread should run on, set by the master thread, and
+  // whether they changed since the thread last applied them.
+  std::vector<int> cpus_;
+  bool cpus_changed_;
+};
+
+// A pool of workers shared by several WorkersPools, typically those of the
+// contexts of concurrent callers, so that they don't each have their own
+// threads, oversubscribing the CPUs. See
+// MultiThreadGemmContext::set_shared_workers_pool.
+//
+// The tasks of a Gemm wait on each other, so they must all run at once:
+// rather than queueing tasks, the pool lends idle workers to a WorkersPool
+// for the duration of one Execute call, see WorkersPool::ReserveWorkers.
+// Callers of the same priority never wait for each other: when no worker
+// is idle, a caller gets none, and runs its Gemm on its own thread. To
+// interleave callers fairly, each lease is capped to the share of the
+// workers that each caller gets given how many callers were recently using
+// the pool at once.
+//
+// A caller may however wait for workers lent to callers of lower priority,
+// which then give them back at their next yield point, see ShouldYield.
+class SharedWorkersPool {
+ public:
+  // Creates a pool with the given count of workers. The special value 0
+  // means one per CPU that this process may use (see GetAvailableCpus),
+  // except one for a calling thread.
+  explicit SharedWorkersPool(int workers_count = 0)
+      : starving_priority_(-1), leased_callers_(0), callers_average_(1) {
+    if (workers_count == 0) {
+      workers_count = std::max(0, GetAvailableCpus() - 1);
+    }
+    pthread_mutex_init(&mutex_, nullptr);
+    pthread_cond_init(&cond_, nullptr);
+    for (int p = 0; p < kPrioritiesCount; p++) {
+      waiting_callers_[p] = 0;
+      leased_workers_count_[p] = 0;
+      stats_[p] = PriorityStats();
+      yields_[p].store(0);
+    }
+    // Workers add themselves to idle_workers_ once started, before
+    // decrementing the counter, which they can't do before we release the
+    // mutex.
+    lease_priority_.assign(workers_count, -1);
+    counter_to_decrement_when_ready_.Reset(workers_count);
+    pthread_mutex_lock(&mutex_);
+    for (int i = 0; i < workers_count; i++) {
+      workers_.push_back(
+          new Worker(&counter_to_decrement_when_ready_, &spin_policy_, this));
+    }
+    pthread_mutex_unlock(&mutex_);
+    counter_to_decrement_when_ready_.Wait();
+  }
+
+  ~SharedWorkersPool() {
+    // Wait for the last workers to have given themselves back.
+    pthread_mutex_lock(&mutex_);
+    while (idle_workers_.size() < workers_.size()) {
+      pthread_cond_wait(&cond_, &mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+    for (auto w : workers_) {
+      delete w;
+    }
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  int workers_count() const { return static_cast<int>(workers_.size()); }
+
+  // Lends up to max_count workers to a caller of the given priority,
+  // appending them to *workers. Idle workers are lent right away; if there
+  // are not enough of them, waits for workers lent to callers of lower
+  // priority to be given back. Each worker is given back by itself once
+  // done with the task it is given; EndLease must then be called.
+  void Lease(int max_count, Priority priority, std::vector<Worker*>* workers) {
+    if (max_count <= 0) {
+      return;
+    }
+    const double start_time = real_time_in_seconds();
+    const int p = static_cast<int>(priority);
+    pthread_mutex_lock(&mutex_);
+    spin_policy_.RecordDispatch();
+    callers_average_ = kAverageWeight * (leased_callers_ + 1) +
+                       (1 - kAverageWeight) * callers_average_;
+    const int fair_share = std::max(
+        1, static_cast<int>(workers_.size() / callers_average_ + 0.5));
+    const int wanted = std::min(max_count, fair_share);
+    waiting_callers_[p]++;
+    UpdateStarvingPriority();
+    while (static_cast<int>(idle_workers_.size()) < wanted &&
+           LeasedWorkersBelow(p) > 0) {
+      pthread_cond_wait(&cond_, &mutex_);
+    }
+    waiting_callers_[p]--;
+    UpdateStarvingPriority();
+    const int count =
+        std::min(wanted, static_cast<int>(idle_workers_.size()));
+    for (int i = 0; i < count; i++) {
+      Worker* worker = idle_workers_.back();
+      idle_workers_.pop_back();
+      lease_priority_[IndexOf(worker)] = p;
+      workers->push_back(worker);
+    }
+    leased_workers_count_[p] += count;
+    if (count) {
+      leased_callers_++;
+    }
+    const double delay = real_time_in_seconds() - start_time;
+    PriorityStats& stats = stats_[p];
+    stats.leases++;
+    stats.workers_requested += max_count;
+    stats.workers_granted += count;
+    stats.total_queueing_delay += delay;
+    stats.max_queueing_delay = std::max(stats.max_queueing_delay, delay);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Ends a lease of a non-zero count of workers, once they are done.
+  void EndLease() {
+    pthread_mutex_lock(&mutex_);
+    leased_callers_--;
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Called by workers when done with a task, or started, to make
+  // themselves available again.
+  void GiveBack(Worker* worker) {
+    pthread_mutex_lock(&mutex_);
+    int& lease_priority = lease_priority_[IndexOf(worker)];
+    if (lease_priority >= 0) {
+      leased_workers_count_[lease_priority]--;
+      lease_priority = -1;
+    }
+    idle_workers_.push_back(worker);
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Yield points: whether the task of a caller of the given priority, run
+  // by a lent worker, should stop there and let its peers take over its
+  // remaining work, as a caller of higher priority is waiting for workers.
+  // Tasks ask before each L2 block, the first one included, and after each
+  // tile, so that even a Gemm of a single L2 block gives its workers back
+  // within a tile's worth of work.
+  bool ShouldYield(Priority priority) {
+    const int starving = starving_priority_.load(std::memory_order_relaxed);
+    const int p = static_cast<int>(priority);
+    if (starving <= p) {
+      return false;
+    }
+    yields_[p].fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Queueing statistics of the callers of the given priority.
+  PriorityStats priority_stats(Priority priority) {
+    const int p = static_cast<int>(priority);
+    pthread_mutex_lock(&mutex_);
+    PriorityStats result = stats_[p];
+    pthread_mutex_unlock(&mutex_);
+    result.yields = yields_[p].load(std::memory_order_relaxed);
+    return result;
+  }
+
+  // How often workers waiting for new work got it while busy-waiting.
+  SpinStats spin_stats() const { return spin_policy_.stats(); }
+
+ private:
+  // The weight of the latest count of callers in their moving average.
+  static constexpr double kAverageWeight = 0.25;
+
+  static const int kPrioritiesCount = 3;
+
+  SharedWorkersPool(const SharedWorkersPool&) = delete;
+
+  std::size_t IndexOf(Worker* worker) const {
+    return std::find(workers_.begin(), workers_.end(), worker) -
+           workers_.begin();
+  }
+
+  int LeasedWorkersBelow(int priority) const {
+    int count = 0;
+    for (int p = 0; p < priority; p++) {
+      count += leased_workers_count_[p];
+    }
+    return count;
+  }
+
+  void UpdateStarvingPriority() {
+    int starving = -1;
+    for (int p = 0; p < kPrioritiesCount; p++) {
+      if (waiting_callers_[p]) {
+        starving = p;
+      }
+    }
+    starving_priority_.store(starving, std::memory_order_relaxed);
+  }
+
+  // All the workers, owned by this pool.
+  std::vector<Worker*> workers_;
+
+  // The BlockingCounter used to wait for the workers to start up.
+  BlockingCounter counter_to_decrement_when_ready_;
+
+  // Decides how long workers busy-wait before sleeping.
+  SpinPolicy spin_policy_;
+
+  // The highest priority of the callers waiting for workers, or -1. Read
+  // by workers at yield points.
+  std::atomic<int> starving_priority_;
+
+  // Counts of yields by priority, updated by workers.
+  std::atomic<std::size_t> yields_[kPrioritiesCount];
+
+  // Guard the members below; cond_ is signaled when a worker is given back.
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+
+  // The workers not currently lent.
+  std::vector<Worker*> idle_workers_;
+
+  // The priority of the caller each worker is lent to, or -1, and counts
+  // by priority of the lent workers and of the callers waiting for some.
+  std::vector<int> lease_priority_;
+  int leased_workers_count_[kPrioritiesCount];
+  int waiting_callers_[kPrioritiesCount];
+
+  // How many callers currently hold workers, and a moving average of that
+  // count plus one, for the caller asking for workers, over Lease calls.
+  int leased_callers_;
+  double callers_average_;
+
+  PriorityStats stats_[kPrioritiesCount];
+};
+
+inline void Worker::GiveBackToSharedWorkersPool() {
+  shared_workers_pool_->GiveBack(this);
+}
+
+// A very simple pool of workers, that only allows the very
+// specific parallelization pattern that we use here:
+// a fixed number of workers can be given work, and one then
+// waits for all of them to finish.
+//
+// See MultiThreadGemmContextBase for how other WorkersPool implementations can
+// be used. Note that in those implementations, StartWorker can be free to
+// ignore the <index> value; that is, the caller of WorkersPool does not rely on
+// <index> to order tasks with equal <index>.
+class WorkersPool {
+ public:
+  WorkersPool()
+      : shared_workers_pool_(nullptr),
+        priority_(Priority::Normal),
+        use_huge_pages_(false),
+        memory_provider_(nullptr),
+        decay_commits_(0) {}
+
+  ~WorkersPool() {
+    for (auto w : workers_) {
+      delete w;
+    }
+  }
+
+  // With a shared pool, tasks beyond the count of workers reserved by
+  // ReserveWorkers, or leased here if there was no such call, run in turn
+  // on the current thread, which is only valid for tasks that never wait
+  // for tasks that have yet to start, like those of MultiThreadGemm, see
+  // PackedRhsPipeline.
+  void Execute(const std::vector<Task*>& tasks) {
+    assert(tasks.size() >= 1);
+    RunTasks(tasks.size(), [&tasks](std::size_t n) { return tasks[n]; });
+    // Cleanup tasks (best to do this from the same thread that allocated
+    // the memory).
+    std::for_each(tasks.begin(), tasks.end(), [](Task* task) { delete task; });
+  }
+
+  // Like Execute, but on an array of tasks that remain owned by the caller,
+  // e.g. constructed in a ScratchArena, so that running them needs no heap
+  // allocation.
+  template <typename TaskType>
+  void ExecuteUnowned(TaskType* tasks, int tasks_count) {
+    assert(tasks_count >= 1);
+    RunTasks(tasks_count,
+             [tasks](std::size_t n) -> Task* { return &tasks[n]; });
+  }
+
+  // Sets how worker threads are placed on CPUs. Worker i is pinned to the
+  // (i+1)-th CPU set of the placement (modulo its size), leaving the first
+  // one to the calling thread, which runs one of the tasks but is not
+  // pinned by us. The placement is computed on the given topology, normally
+  // the detected one. Must not be called concurrently with Execute().
+  void set_affinity(AffinityPolicy policy,
+                    const std::vector<int>& cpu_set = std::vector<int>(),
+                    const CpuTopology& topology = GetCpuTopology()) {
+    set_placement(GetThreadPlacement(topology, policy, cpu_set));
+  }
+
+  // The CPU sets that threads are pinned to, if any, see set_affinity.
+  // set_placement takes one computed by set_affinity, e.g. that of another
+  // pool.
+  const std::vector<std::vector<int>>& placement() const { return placement_; }
+  void set_placement(const std::vector<std::vector<int>>& placement) {
+    placement_ = placement;
+    for (std::size_t i = 0; i < workers_.size(); i++) {
+      PlaceWorker(i);
+    }
+  }
+
+  // Makes this pool borrow workers from the given shared pool for each
+  // Execute call, instead of using workers of its own, which are then left
+  // idle; nullptr reverts to them. Affinity settings only apply to the
+  // pool's own workers. Must not be called concurrently with Execute().
+  void set_shared_workers_pool(SharedWorkersPool* shared_workers_pool) {
+    assert(leased_workers_.empty());
+    shared_workers_pool_ = shared_workers_pool;
+  }
+  SharedWorkersPool* shared_workers_pool() const {
+    return shared_workers_pool_;
+  }
+
+  // Returns how many workers the next Execute call may use, up to
+  // workers_count: all of them with the pool's own workers, and as many as
+  // could be leased with a shared pool. Leased workers are returned at the
+  // end of the Execute call, which must follow.
+  int ReserveWorkers(int workers_count) {
+    if (!shared_workers_pool_) {
+      return workers_count;
+    }
+    assert(leased_workers_.empty());
+    shared_workers_pool_->Lease(workers_count, priority_, &leased_workers_);
+    return static_cast<int>(leased_workers_.size());
+  }
+
+  // The priority of the work of this pool in the shared pool.
+  void set_priority(Priority priority) { priority_ = priority; }
+  Priority priority() const { return priority_; }
+
+  // See SharedWorkersPool::ShouldYield.
+  bool ShouldYield() const {
+    return shared_workers_pool_ && shared_workers_pool_->ShouldYield(priority_);
+  }
+
+  void set_spin_mode(SpinMode mode) { spin_policy_.set_mode(mode); }
+  SpinMode spin_mode() const { return spin_policy_.mode(); }
+  SpinStats spin_stats() const { return spin_policy_.stats(); }
+
+  // The timings of the Execute calls so far, or since the last call to
+  // ResetTelemetry. Must not be called concurrently with Execute().
+  const PoolTelemetry& telemetry() const { return telemetry_; }
+  void ResetTelemetry() { telemetry_.Reset(); }
+
+  // Calls f on the allocators of the tasks run by this pool: that of the
+  // calling thread, and those of the pool's own workers. Those of the
+  // workers of a shared pool are not included. Must not be called
+  // concurrently with Execute().
+  template <typename F>
+  void ForEachAllocator(F f) {
+    f(&main_thread_task_allocator_);
+    for (auto w : workers_) {
+      f(w->local_allocator());
+    }
+  }
+
+  // See Allocator::set_use_huge_pages and Allocator::set_memory_provider.
+  // These apply to the allocators given by ForEachAllocator, including
+  // those of workers created later.
+  void set_use_huge_pages(bool use_huge_pages) {
+    use_huge_pages_ = use_huge_pages;
+    ForEachAllocator([this](Allocator* allocator) {
+      ConfigureAllocator(allocator);
+    });
+  }
+  void set_memory_provider(MemoryProvider* memory_provider) {
+    memory_provider_ = memory_provider;
+    ForEachAllocator([this](Allocator* allocator) {
+      ConfigureAllocator(allocator);
+    });
+  }
+
+  // See Allocator::set_decay_commits. Applies like set_use_huge_pages.
+  void set_decay_commits(int decay_commits) {
+    decay_commits_ = decay_commits;
+    ForEachAllocator([this](Allocator* allocator) {
+      ConfigureAllocator(allocator);
+    });
+  }
+
+ private:
+  // Runs tasks_count tasks, the n-th being given by get_task(n), see
+  // Execute.
+  template <typename GetTask>
+  void RunTasks(std::size_t tasks_count, GetTask get_task) {
+    spin_policy_.RecordDispatch();
+    // One of the tasks will be run on the current thread.
+    std::size_t workers_count = tasks_count - 1;
+    std::vector<Worker*>* workers = &workers_;
+    if (shared_workers_pool_) {
+      if (leased_workers_.empty()) {
+        shared_workers_pool_->Lease(workers_count, priority_,
+                                    &leased_workers_);
+      }
+      workers_count = leased_workers_.size();
+      workers = &leased_workers_;
+    } else {
+      CreateWorkers(workers_count);
+    }
+    assert(workers_count <= workers->size());
+    counter_to_decrement_when_ready_.Reset(workers_count);
+    for (std::size_t n = 0; n < workers_count; n++) {
+      (*workers)[n]->StartWork(get_task(n), &counter_to_decrement_when_ready_);
+    }
+    // Execute the remaining workload immediately on the current thread.
+    for (std::size_t n = workers_count; n < tasks_count; n++) {
+      Task* task = get_task(n);
+      task->local_allocator = &main_thread_task_allocator_;
+      task->run_start_ns = PerfCounterSet::NowNanoseconds();
+      task->Run();
+      task->run_end_ns = PerfCounterSet::NowNanoseconds();
+    }
+    // Wait for the workers submitted above to finish.
+    counter_to_decrement_when_ready_.Wait(spin_policy_.busy_spin_nops());
+    RecordTelemetry(tasks_count, workers_count, get_task);
+    // Leased workers have given themselves back by now, see
+    // Worker::BecomeReady.
+    if (!leased_workers_.empty()) {
+      shared_workers_pool_->EndLease();
+      leased_workers_.clear();
+    }
+  }
+
+  // Adds the timings of the tasks of a finished dispatch to the telemetry.
+  // The first workers_count tasks ran on workers, one each, and the others
+  // in turn on the current thread, which is busy for all of them and idle
+  // after the last one. Per-thread timings are recorded once per thread,
+  // this one included, see PoolTelemetry.
+  template <typename GetTask>
+  void RecordTelemetry(std::size_t tasks_count, std::size_t workers_count,
+                       GetTask get_task) {
+#ifndef GEMMLOWP_NO_PERF_COUNTERS
+    const std::uint64_t end_ns = PerfCounterSet::NowNanoseconds();
+    telemetry_.dispatches++;
+    std::uint64_t total_busy_ns = 0;
+    std::uint64_t max_busy_ns = 0;
+    std::uint64_t current_thread_busy_ns = 0;
+    for (std::size_t n = 0; n < tasks_count; n++) {
+      const Task* task = get_task(n);
+      const std::uint64_t time_ns = task->run_end_ns - task->run_start_ns;
+      telemetry_.task_time_ns.Add(time_ns);
+      if (n < workers_count) {
+        telemetry_.wake_latency_ns.Add(task->run_start_ns -
+                                       task->start_work_ns);
+        telemetry_.idle_time_ns.Add(end_ns - task->run_end_ns);
+        total_busy_ns += time_ns;
+        max_busy_ns = std::max(max_busy_ns, time_ns);
+      } else {
+        current_thread_busy_ns += time_ns;
+      }
+    }
+    telemetry_.idle_time_ns.Add(end_ns -
+                                get_task(tasks_count - 1)->run_end_ns);
+    total_busy_ns += current_thread_busy_ns;
+    max_busy_ns = std::max(max_busy_ns, current_thread_busy_ns);
+    const std::size_t threads_count = workers_count + 1;
+    if (threads_count > 1 && total_busy_ns > 0) {
+      telemetry_.imbalance_percent.Add(100 * max_busy_ns * threads_count /
+                                       total_busy_ns);
+    }
+#endif
+  }
+
+  // Ensures that the pool has at least the given count of workers.
+  // If any new worker has to be created, this function waits for it to
+  // be ready.
+  void CreateWorkers(std::size_t workers_count) {
+    if (workers_.size() >= workers_count) {
+      return;
+    }
+    counter_to_decrement_when_ready_.Reset(workers_count - workers_.size());
+    while (workers_.size() < workers_count) {
+      workers_.push_back(
+          new Worker(&counter_to_decrement_when_ready_, &spin_policy_));
+      ConfigureAllocator(workers_.back()->local_allocator());
+      if (!placement_.empty()) {
+        PlaceWorker(workers_.size() - 1);
+      }
+    }
+    counter_to_decrement_when_ready_.Wait();
+  }
+
+  void ConfigureAllocator(Allocator* allocator) {
+    allocator->set_use_huge_pages(use_huge_pages_);
+    allocator->set_memory_provider(memory_provider_);
+    allocator->set_decay_commits(decay_commits_);
+  }
+
+  void PlaceWorker(std::size_t i) {
+    // An empty placement means no pinning, i.e. any online CPU.
+    workers_[i]->set_cpus(placement_.empty()
+                              ? GetCpuTopology().cpus
+                              : placement_[(i + 1) % placement_.size()]);
+  }
+
+  // copy construction disallowed
+  WorkersPool(const WorkersPool&) = delete;
+
+  // The workers in this pool. They are owned by the pool:
+  // the pool creates workers and destroys them in its destructor.
+  std::vector<Worker*> workers_;
+
+  // The BlockingCounter used to wait for the workers.
+  BlockingCounter counter_to_decrement_when_ready_;
+
+  // Decides how long threads busy-wait before sleeping.
+  SpinPolicy spin_policy_;
+
+  // The CPU sets that threads are pinned to, empty if not pinned.
+  std::vector<std::vector<int>> placement_;
+
+  // The pool to borrow workers from instead of workers_, if any, and the
+  // workers currently borrowed from it.
+  SharedWorkersPool* shared_workers_pool_;
+  std::vector<Worker*> leased_workers_;
+  Priority priority_;
+
+  // For N-threaded operations, we will use only N-1 worker threads
+  // while the last task will be run directly on the main thread.
+  // It will then use this main_thread_task_allocator_; having a
+  // dedicated allocator for that (separate from the base allocator_)
+  // allows to use the same code for all tasks regardless of which
+  // thread they run on.
+  Allocator main_thread_task_allocator_;
+
+  // How allocators get and release their storage, see set_use_huge_pages,
+  // set_memory_provider and set_decay_commits.
+  bool use_huge_pages_;
+  MemoryProvider* memory_provider_;
+  int decay_commits_;
+
+  // See telemetry(). Only accessed by the calling thread.
+  PoolTelemetry telemetry_;
+};
+
+// A task packing a range of columns of a block of the RHS. Running one such
+// task per worker allows to pack a large RHS block in parallel, instead of
+// having a single thread do it, see ParallelPackRhs.
+//
+// The range must start at a multiple of the kernel width. Since ranges are
+// disjoint, so are the slices of packed data and of sums_of_each_slice that
+// each task writes to, so no reduction is needed afterwards.
+template <typename PackedRhs, typename RhsMapType>
+struct PackRhsTask : Task {
+  PackRhsTask(const PackedRhs& _packed_rhs, const RhsMapType& _rhs,
+              int _start_col, int _cols)
+      : packed_rhs(_packed_rhs),
+        rhs(_rhs),
+        start_col(_start_col),
+        cols(_cols) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("PackRhsTask",
+                               TraceArgs(-1, rhs.rows(), cols));
+    PackRhsWidthRange(&packed_rhs, rhs, start_col, cols);
+  }
+
+  // A private copy, as packing mutates its current position.
+  PackedRhs packed_rhs;
+  const RhsMapType rhs;
+  const int start_col;
+  const int cols;
+};
+
+// Returns the width of the ranges that a RHS block of the given width
+// should be split into to be packed by at most max_ranges threads.
+// This is a multiple of the kernel width, so that no kernel run is
+// split across threads.
+template <typename PackedRhs>
+int RhsPackingRangeWidth(int cols, int max_ranges) {
+  static const int kKernelWidth = PackedRhs::KernelSideFormat::kWidth;
+  const int kernel_runs = CeilQuotient(cols, kKernelWidth);
+  return kKernelWidth *
+         CeilQuotient(kernel_runs, std::max(1, std::min(max_ranges,
+                                                        kernel_runs)));
+}
+
+// Packs a block of the RHS into dst, splitting the work into up to
+// max_tasks PackRhsTask's executed on the given workers pool.
+// dst's allocator must be committed.
+template <typename PackedRhs, typename RhsMapType, typename WorkersPoolType>
+void ParallelPackRhs(WorkersPoolType* workers_pool, PackedRhs* dst,
+                     const RhsMapType& src, int max_tasks) {
+  ScopedProfilingLabel label("ParallelPackRhs");
+  const int cols = src.cols();
+  const int range_width = RhsPackingRangeWidth<PackedRhs>(cols, max_tasks);
+  std::vector<Task*> tasks;
+  for (int c = 0; c < cols; c += range_width) {
+    tasks.push_back(new PackRhsTask<PackedRhs, RhsMapType>(
+        *dst, src, c, std::min(range_width, cols - c)));
+  }
+  workers_pool->Execute(tasks);
+}
+
+// A range [begin, end) of indices of tiles of the result for a given RHS
+// block, from which tiles can be taken at either end. It is the per-task
+// work queue of the tile scheduler of PackedRhsPipeline: the owning task
+// takes tiles at one end, while idle tasks may steal them at the other end.
+//
+// The whole state is a single 64-bit word, so that all operations are
+// lock-free compare-and-swaps. It is tagged with the RHS block that the
+// tiles belong to, so that a task lagging behind can never take a tile of
+// a later block reusing the same deque.
+class TileDeque {
+ public:
+  TileDeque() : state_(Pack(-1, 0, 0)) {}
+
+  // Only called when no other thread accesses tiles of the given block.
+  void Reset(int block, int begin, int end) {
+    assert(end - begin <= kMaxIndex);
+    state_.store(Pack(block, begin, end), std::memory_order_release);
+  }
+
+  // Takes a tile of the given block at the front or the back of the deque,
+  // returning false if there is none.
+  bool Take(int block, bool front, int* tile) {
+    std::uint64_t state = state_.load(std::memory_order_acquire);
+    while (true) {
+      if (Tag(state) != BlockTag(block)) {
+        return false;
+      }
+      const int begin = Begin(state);
+      const int end = End(state);
+      if (begin >= end) {
+        return false;
+      }
+      const std::uint64_t new_state =
+          front ? Pack(block, begin + 1, end) : Pack(block, begin, end - 1);
+      if (state_.compare_exchange_weak(state, new_state,
+                                       std::memory_order_acq_rel)) {
+        *tile = front ? begin : end - 1;
+        return true;
+      }
+    }
+  }
+
+ private:
+  static const int kIndexBits = 21;
+  static const int kMaxIndex = (1 << kIndexBits) - 1;
+  static const int kTagBits = 64 - 2 * kIndexBits;
+
+  static std::uint64_t BlockTag(int block) {
+    return static_cast<std::uint64_t>(block) & ((1ull << kTagBits) - 1);
+  }
+  static std::uint64_t Pack(int block, int begin, int end) {
+    return (BlockTag(block) << (2 * kIndexBits)) |
+           (static_cast<std::uint64_t>(begin) << kIndexBits) |
+           static_cast<std::uint64_t>(end);
+  }
+  static std::uint64_t Tag(std::uint64_t state) {
+    return state >> (2 * kIndexBits);
+  }
+  static int Begin(std::uint64_t state) {
+    return static_cast<int>((state >> kIndexBits) & kMaxIndex);
+  }
+  static int End(std::uint64_t state) {
+    return static_cast<int>(state & kMaxIndex);
+  }
+
+  std::atomic<std::uint64_t> state_;
+};
 
-  // The task to be worked on.
-  Task* task_;
+// How many tiles of the result to create per task in work-stealing mode.
+const int kWorkStealingTilesPerTask = 4;
 
-  // The condition variable and mutex guarding state changes.
-  pthread_cond_t state_cond_;
-  pthread_mutex_t state_mutex_;
+// The state shared by the tasks of a multi-threaded Gemm, allowing them
+// to hand packed L2 blocks of the RHS to each other, and to distribute
+// tiles of the result between them.
+//
+// Rather than having the master thread pack each RHS block while all
+// workers sit idle, then paying for a whole WorkersPool::Execute round-trip
+// per block, a single round of tasks walks over all RHS blocks, and the
+// packing of block c+1 is done by whichever tasks get to it first, while
+// the others are still computing against block c.
+//
+// Each block is split into ranges of columns (see RhsPackingRangeWidth)
+// that are handed out separately, so that several tasks can pack a block
+// together, as in ParallelPackRhs.
+//
+// The rows of the result are split into tiles of tile_rows rows, each of
+// which is computed against each RHS block. Tiles are evenly assigned to
+// tasks, through one TileDeque per task. In work-stealing mode, a task
+// that is done with its own tiles of a block steals tiles of that same
+// block from other tasks, so that a descheduled or throttled thread does
+// not hold everyone back. Each task takes its own tiles in alternating
+// order from one block to the next, so that the last tile of a block,
+// whose packed LHS it still has, is the first of the next block.
+//
+// Packed blocks live in a ring of up to kMaxBuffers buffers. Synchronization
+// is per buffer, and counts tiles rather than tasks: a block may only be
+// packed once all tiles of the block previously held in the same buffer have
+// been computed, and a tile may only be computed once all ranges of its
+// block have been packed. There is no pool-wide barrier, and tasks never
+// wait for each other to be done with a block: a task about to pack a block
+// first computes whatever tiles of the previous block held in the same
+// buffer are left, see ClaimLeftoverTile. So tasks only ever wait for work
+// claimed by tasks that are running, and a workers pool may run them on
+// fewer threads than there are tasks, or even one after another.
+template <typename tPackedRhs>
+class PackedRhsPipeline {
+ public:
+  typedef tPackedRhs PackedRhs;
+
+  // Double buffering: one block being consumed while the next one is packed.
+  static const int kMaxBuffers = 2;
+
+  // The pipeline hands out tiles of the rows [start_row, start_row + rows)
+  // of the result, to tasks_count tasks. Its buffers are reserved from the
+  // given allocator, and its tile deques allocated from the given arena.
+  PackedRhsPipeline(Allocator* allocator, ScratchArena* scratch_arena,
+                    const BlockParams& block_params, int start_row, int rows,
+                    int cols, int tasks_count, int tile_rows,
+                    bool work_stealing)
+      : start_row_(start_row),
+        rows_(rows),
+        cols_(cols),
+        block_cols_(block_params.l2_cols),
+        blocks_count_(CeilQuotient(cols, block_params.l2_cols)),
+        range_cols_(RhsPackingRangeWidth<PackedRhs>(block_cols_, tasks_count)),
+        ranges_per_block_(CeilQuotient(block_cols_, range_cols_)),
+        tasks_count_(tasks_count),
+        tile_rows_(tile_rows),
+        tiles_count_(CeilQuotient(rows, tile_rows)),
+        work_stealing_(work_stealing),
+        buffers_count_(std::min(+kMaxBuffers, blocks_count_)),
+        next_range_to_pack_(0) {
+    for (int i = 0; i < buffers_count_; i++) {
+      new (&buffers_storage_[i]) PackedRhs(Side::Rhs, allocator, block_params);
+      packed_block_[i].store(-1);
+      pending_ranges_[i] = ranges_per_block_;
+      pending_tiles_[i].store(0);
+      tile_deques_[i] = scratch_arena->Allocate<TileDeque>(tasks_count_);
+      for (int task = 0; task < tasks_count_; task++) {
+        new (&tile_deques_[i][task]) TileDeque;
+      }
+    }
+  }
 
-  // The state enum tells if we're currently working, waiting for work, etc.
-  State state_;
+  ~PackedRhsPipeline() {
+    for (int i = 0; i < buffers_count_; i++) {
+      buffer(i)->~PackedRhs();
+    }
+  }
 
-  // Each thread had a local allocator so they can allocate temporary
-  // buffers without blocking each other.
-  Allocator local_allocator_;
+  int blocks_count() const { return blocks_count_; }
 
-  // pointer to the master's thread BlockingCounter object, to notify the
-  // master thread of when this worker switches to the 'Ready' state.
-  BlockingCounter* const counter_to_decrement_when_ready_;
-};
+  // The block previously held in the buffer that the given block is packed
+  // into, or -1 if there is none.
+  int previous_block_in_buffer(int block) const {
+    return block >= buffers_count_ ? block - buffers_count_ : -1;
+  }
 
-// A very simple pool of workers, that only allows the very
-// specific parallelization pattern that we use here:
-// a fixed number of workers can be given work, and one then
-// waits for all of them to finish.
-//
-// See MultiThreadGemmContextBase for how other WorkersPool implementations can
-// be used. Note that in those implementations, StartWorker can be free to
-// ignore the <index> value; that is, the caller of WorkersPool does not rely on
-// <index> to order tasks with equal <index>.
-class WorkersPool {
- public:
-  WorkersPool() {}
+  // The columns of the RHS covered by the given block.
+  int block_start_col(int block) const { return block * block_cols_; }
+  int block_cols(int block) const {
+    return std::min(block_cols_, cols_ - block_start_col(block));
+  }
 
-  ~WorkersPool() {
-    for (auto w : workers_) {
-      delete w;
+  // The rows of the result covered by the given tile.
+  int tile_start_row(int tile) const { return start_row_ + tile * tile_rows_; }
+  int tile_rows(int tile) const {
+    return std::min(tile_rows_, rows_ - tile * tile_rows_);
+  }
+
+  // Claims a range of columns of some block for a task about to consume
+  // current_block to pack. Returns false if there is no such range.
+  // Otherwise, *start_col and *cols are relative to the block, and *cols
+  // may be zero for trailing ranges of the last, narrower block: the range
+  // must still be ended by EndPacking.
+  //
+  // Ranges are handed out in order, and never for blocks more than
+  // buffers_count_ - 1 blocks ahead of current_block, so that packing
+  // does not run away ahead of computation.
+  bool ClaimRangeToPack(int current_block, int* block, int* start_col,
+                        int* cols) {
+    int range = next_range_to_pack_.load(std::memory_order_relaxed);
+    while (true) {
+      *block = range / ranges_per_block_;
+      if (*block >= blocks_count_ ||
+          *block >= current_block + buffers_count_) {
+        return false;
+      }
+      if (next_range_to_pack_.compare_exchange_weak(
+              range, range + 1, std::memory_order_relaxed)) {
+        break;
+      }
     }
+    *start_col = (range % ranges_per_block_) * range_cols_;
+    *cols = std::max(0, std::min(range_cols_, block_cols(*block) - *start_col));
+    return true;
   }
 
-  void Execute(const std::vector<Task*>& tasks) {
-    assert(tasks.size() >= 1);
-    // One of the tasks will be run on the current thread.
-    std::size_t workers_count = tasks.size() - 1;
-    CreateWorkers(workers_count);
-    assert(workers_count <= workers_.size());
-    counter_to_decrement_when_ready_.Reset(workers_count);
-    int n = 0;
-    std::for_each(tasks.begin(), --tasks.end(),
-                  [this, &n](Task* task) { workers_[n++]->StartWork(task); });
-    // Execute the remaining workload immediately on the current thread.
-    Task* task = tasks.back();
-    task->local_allocator = &main_thread_task_allocator_;
-    task->Run();
-    // Wait for the workers submitted above to finish.
-    counter_to_decrement_when_ready_.Wait();
-    // Cleanup tasks (best to do this from the same thread that allocated
-    // the memory).
-    std::for_each(tasks.begin(), tasks.end(), [](Task* task) { delete task; });
+  // Waits until all tiles of the block previously held in the buffer for
+  // the given block have been computed, and returns a PackedRhs to pack a
+  // claimed range of it into. The returned object is a private copy, as
+  // packing mutates its current position.
+  PackedRhs BeginPacking(int block) {
+    ScopedProfilingLabel label("PackedRhsPipeline::BeginPacking");
+    const int i = block % buffers_count_;
+    int pending_tiles;
+    while ((pending_tiles = pending_tiles_[i].load()) != 0) {
+      pending_tiles_[i].WaitForChange(pending_tiles);
+    }
+    return *buffer(i);
   }
 
- private:
-  // Ensures that the pool has at least the given count of workers.
-  // If any new worker has to be created, this function waits for it to
-  // be ready.
-  void CreateWorkers(std::size_t workers_count) {
-    if (workers_.size() >= workers_count) {
+  // Signals that a range claimed by ClaimRangeToPack has been packed.
+  // The last range of a block to be packed publishes the block, handing
+  // out its tiles to the tasks.
+  void EndPacking(int block) {
+    const int i = block % buffers_count_;
+    if (pending_ranges_[i].fetch_sub(1, std::memory_order_acq_rel) != 1) {
       return;
     }
-    counter_to_decrement_when_ready_.Reset(workers_count - workers_.size());
-    while (workers_.size() < workers_count) {
-      workers_.push_back(new Worker(&counter_to_decrement_when_ready_));
+    pending_ranges_[i].store(ranges_per_block_, std::memory_order_relaxed);
+    for (int task = 0; task < tasks_count_; task++) {
+      tile_deques_[i][task].Reset(block, first_tile(task),
+                                  first_tile(task + 1));
     }
-    counter_to_decrement_when_ready_.Wait();
+    pending_tiles_[i].store(tiles_count_);
+    packed_block_[i].store(block);
   }
 
-  // copy construction disallowed
-  WorkersPool(const WorkersPool&) = delete;
+  // Waits until the given block has been packed (or even already fully
+  // consumed, in which case there will be no tile left to claim for it).
+  void WaitForBlock(int block) {
+    ScopedProfilingLabel label("PackedRhsPipeline::WaitForBlock");
+    const int i = block % buffers_count_;
+    int packed_block;
+    while ((packed_block = packed_block_[i].load()) < block) {
+      packed_block_[i].WaitForChange(packed_block);
+    }
+  }
 
-  // The workers in this pool. They are owned by the pool:
-  // the pool creates workers and destroys them in its destructor.
-  std::vector<Worker*> workers_;
+  // Claims a tile of the given block for the given task to compute,
+  // returning false if there is none left. WaitForBlock must have been
+  // called first.
+  //
+  // The task first takes its own tiles, in alternating order from one
+  // block to the next; then, in work-stealing mode, tiles of other tasks,
+  // at the other end of their deques.
+  bool ClaimTile(int task, int block, int* tile) {
+    return ClaimTile(task, block, work_stealing_, tile);
+  }
 
-  // The BlockingCounter used to wait for the workers.
-  BlockingCounter counter_to_decrement_when_ready_;
+  // Like ClaimTile in work-stealing mode, whether or not it is enabled.
+  // Called by a task about to pack a block, before BeginPacking, on the
+  // block given by previous_block_in_buffer, so that BeginPacking only
+  // waits for tiles that running tasks have claimed, rather than for tasks
+  // that may not run until this one is done.
+  bool ClaimLeftoverTile(int task, int block, int* tile) {
+    return ClaimTile(task, block, true, tile);
+  }
 
-  // For N-threaded operations, we will use only N-1 worker threads
-  // while the last task will be run directly on the main thread.
-  // It will then use this main_thread_task_allocator_; having a
-  // dedicated allocator for that (separate from the base allocator_)
-  // allows to use the same code for all tasks regardless of which
-  // thread they run on.
-  Allocator main_thread_task_allocator_;
+  // Returns a PackedRhs to consume the given block from, for a tile claimed
+  // by ClaimTile. Like in BeginPacking, the returned object is a private
+  // copy as reading it mutates its current position.
+  PackedRhs BeginConsuming(int block) { return *buffer(block % buffers_count_); }
+
+  // Signals that a tile claimed by ClaimTile has been computed.
+  void EndConsuming(int block) {
+    pending_tiles_[block % buffers_count_].fetch_sub(1);
+  }
+
+ private:
+  PackedRhs* buffer(int i) {
+    return reinterpret_cast<PackedRhs*>(&buffers_storage_[i]);
+  }
+
+  bool ClaimTile(int task, int block, bool steal, int* tile) {
+    const int i = block % buffers_count_;
+    const bool own_front = block % 2 == 0;
+    if (tile_deques_[i][task].Take(block, own_front, tile)) {
+      return true;
+    }
+    if (steal) {
+      for (int k = 1; k < tasks_count_; k++) {
+        const int victim = (task + k) % tasks_count_;
+        if (tile_deques_[i][victim].Take(block, !own_front, tile)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // The first of the tiles initially assigned to the given task.
+  int first_tile(int task) const { return tiles_count_ * task / tasks_count_; }
+
+  PackedRhsPipeline(const PackedRhsPipeline&) = delete;
+
+  const int start_row_;
+  const int rows_;
+  const int cols_;
+  const int block_cols_;
+  const int blocks_count_;
+  const int range_cols_;
+  const int ranges_per_block_;
+  const int tasks_count_;
+  const int tile_rows_;
+  const int tiles_count_;
+  const bool work_stealing_;
+  const int buffers_count_;
+
+  // The index, over all blocks, of the next range to be handed out by
+  // ClaimRangeToPack.
+  std::atomic<int> next_range_to_pack_;
+
+  // For each buffer, the index of the block that was last published into it,
+  // how many ranges of the block being packed into it are still pending,
+  // how many tiles of it still have to be computed, and the per-task deques
+  // of tiles left to claim.
+  WaitableAtomic<int> packed_block_[kMaxBuffers];
+  std::atomic<int> pending_ranges_[kMaxBuffers];
+  WaitableAtomic<int> pending_tiles_[kMaxBuffers];
+  TileDeque* tile_deques_[kMaxBuffers];
+
+  // Storage for the buffers_count_ buffers, constructed in place so as
+  // to only reserve allocator space for the buffers actually needed.
+  typename std::aligned_storage<sizeof(PackedRhs), alignof(PackedRhs)>::type
+      buffers_storage_[kMaxBuffers];
 };
 
-// The task we use to implement a multi-threaded Gemm: a block of the
-// RHS has been packed by the master thread; each worker thread
-// then has to pack a block of the LHS and accumulate the Gemm of these
-// packed LHS and RHS blocks.
+// The task we use to implement a multi-threaded Gemm. It walks over all the
+// L2 blocks of the RHS, helping to pack them through the PackedRhsPipeline,
+// and for each of them computes the tiles of the result that it claims from
+// the pipeline: it packs the LHS rows of the tile, unless it still has them
+// packed from the previous tile, and accumulates the Gemm of these packed
+// LHS and RHS blocks. Tasks that may yield stop at the yield points where
+// their context tells them to, see MultiThreadGemmContextBase::ShouldYield.
 template <typename KernelFormat, typename InputScalar, typename OutputScalar,
           typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
           MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
@@ -440,11 +1559,13 @@ template <typename KernelFormat, typename InputScalar, typename OutputScalar,
 struct GemmWithPackedRhsTask : Task {
   typedef PackedSideBlock<typename KernelFormat::Lhs> PackedLhs;
   typedef PackedSideBlock<typename KernelFormat::Rhs> PackedRhs;
+  typedef PackedRhsPipeline<PackedRhs> RhsPipeline;
   GemmWithPackedRhsTask(GemmContextType* _context, const KernelBase& _kernel,
                         const MatrixMap<const InputScalar, LhsOrder>& _lhs,
-                        const PackedRhs& _packed_rhs,
+                        const MatrixMap<const InputScalar, RhsOrder>& _rhs,
+                        RhsPipeline* _rhs_pipeline, int _task_index,
+                        bool _may_yield,
                         MatrixMap<OutputScalar, ResultOrder>* _result,
-                        const MatrixBlockBounds& _result_block,
                         const LhsOffset& _lhs_offset,
                         const RhsOffset& _rhs_offset,
                         const BlockParams& _block_params,
@@ -452,81 +1573,413 @@ struct GemmWithPackedRhsTask : Task {
       : context(_context),
         kernel(_kernel),
         lhs(_lhs),
-        packed_rhs(_packed_rhs),
+        rhs(_rhs),
+        rhs_pipeline(_rhs_pipeline),
+        task_index(_task_index),
+        may_yield(_may_yield),
         result(*_result),
-        result_block(_result_block),
         lhs_offset(_lhs_offset),
         rhs_offset(_rhs_offset),
         block_params(_block_params),
         output_pipeline(_output_pipeline) {}
 
-  void Run() override {
-    ScopedProfilingLabel label("GemmWithPackedRhsTask");
+  // Packs whichever ranges of RHS blocks the pipeline hands out to us
+  // before we consume the given block. Before packing a block, computes
+  // the tiles left of the block previously held in its buffer, see
+  // PackedRhsPipeline::ClaimLeftoverTile.
+  void PackRhsBlocksAhead(int block, PackedLhs* packed_lhs,
+                          PackedResult* packed_result, int* packed_lhs_tile) {
+    const int depth = lhs.cols();
+    int block_to_pack, start_col, cols;
+    while (rhs_pipeline->ClaimRangeToPack(block, &block_to_pack, &start_col,
+                                          &cols)) {
+      if (cols > 0) {
+        const int previous_block =
+            rhs_pipeline->previous_block_in_buffer(block_to_pack);
+        int tile;
+        while (previous_block >= 0 &&
+               rhs_pipeline->ClaimLeftoverTile(task_index, previous_block,
+                                               &tile)) {
+          ComputeTile(previous_block, tile, packed_lhs, packed_result,
+                      packed_lhs_tile);
+        }
+        PerfCounterSet* perf_counters = context->perf_counter_set();
+        std::uint64_t start_ns = PerfCounterSet::NowNanoseconds();
+        PackedRhs packed_rhs = rhs_pipeline->BeginPacking(block_to_pack);
+        perf_counters->AddPhaseSince(PerfPhase::PoolWait, start_ns);
+        ScopedPerfPhase phase(perf_counters, PerfPhase::PackRhs);
+        PackRhsWidthRange(
+            &packed_rhs,
+            rhs.block(0, rhs_pipeline->block_start_col(block_to_pack), depth,
+                      rhs_pipeline->block_cols(block_to_pack)),
+            start_col, cols);
+      }
+      rhs_pipeline->EndPacking(block_to_pack);
+    }
+  }
 
-    const int rows = result_block.rows;
-    const int cols = result_block.cols;
+  // Computes a tile of a block claimed from the pipeline, packing the LHS
+  // rows of the tile unless they are those of *packed_lhs_tile already.
+  void ComputeTile(int block, int tile, PackedLhs* packed_lhs,
+                   PackedResult* packed_result, int* packed_lhs_tile) {
     const int depth = lhs.cols();
+    PerfCounterSet* perf_counters = context->perf_counter_set();
+    const PackedRhs packed_rhs = rhs_pipeline->BeginConsuming(block);
+
+    const int r = rhs_pipeline->tile_start_row(tile);
+    const int rs = rhs_pipeline->tile_rows(tile);
+    const int c = rhs_pipeline->block_start_col(block);
+    const int cs = rhs_pipeline->block_cols(block);
+
+    if (tile != *packed_lhs_tile) {
+      ScopedPerfPhase phase(perf_counters, PerfPhase::PackLhs);
+      PackLhs(packed_lhs, lhs.block(r, 0, rs, depth));
+      *packed_lhs_tile = tile;
+    }
+
+    {
+      ScopedPerfPhase phase(perf_counters, PerfPhase::Compute);
+      Compute(kernel, block_params, packed_result, *packed_lhs, packed_rhs,
+              depth);
+    }
+
+    {
+      ScopedPerfPhase phase(perf_counters, PerfPhase::Unpack);
+      auto curr_result_block = MatrixBlockBounds(r, c, rs, cs);
+      UnpackResult<KernelFormat>(
+          &result, curr_result_block, *packed_result, depth,
+          packed_lhs->sums_of_each_slice(), packed_rhs.sums_of_each_slice(),
+          lhs_offset.block(curr_result_block.start_row, rs),
+          rhs_offset.block(curr_result_block.start_col, cs), output_pipeline);
+    }
+
+    rhs_pipeline->EndConsuming(block);
+  }
+
+  void Run() override {
+    ScopedProfilingLabel label(
+        "GemmWithPackedRhsTask",
+        TraceArgs(result.rows(), lhs.cols(), result.cols(), task_index));
 
     PackedLhs packed_lhs(Side::Lhs, local_allocator, block_params);
 
     PackedResult packed_result(local_allocator, block_params);
 
-    local_allocator->Commit();
+    PerfCounterSet* perf_counters = context->perf_counter_set();
+    perf_counters->CommitAllocator(local_allocator);
 
-    for (int c = 0; c < cols; c += block_params.l2_cols) {
-      int cs = std::min(block_params.l2_cols, cols - c);
+    // The tile whose LHS rows are currently in packed_lhs.
+    int packed_lhs_tile = -1;
+
+    bool yielded = false;
+    for (int block = 0; block < rhs_pipeline->blocks_count() && !yielded;
+         block++) {
+      if (may_yield && context->ShouldYield()) {
+        break;
+      }
 
-      for (int r = 0; r < rows; r += block_params.l2_rows) {
-        int rs = std::min(block_params.l2_rows, rows - r);
+      PackRhsBlocksAhead(block, &packed_lhs, &packed_result, &packed_lhs_tile);
 
-        PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
+      {
+        ScopedPerfPhase phase(perf_counters, PerfPhase::PoolWait);
+        rhs_pipeline->WaitForBlock(block);
+      }
 
-        Compute(kernel, block_params, &packed_result, packed_lhs, packed_rhs,
-                depth);
+      int tile;
+      while (rhs_pipeline->ClaimTile(task_index, block, &tile)) {
+        ComputeTile(block, tile, &packed_lhs, &packed_result,
+                    &packed_lhs_tile);
 
-        auto curr_result_block = MatrixBlockBounds(
-            result_block.start_row + r, result_block.start_col + c, rs, cs);
-        UnpackResult<KernelFormat>(
-            &result, curr_result_block, packed_result, depth,
-            packed_lhs.sums_of_each_slice(), packed_rhs.sums_of_each_slice(),
-            lhs_offset.block(curr_result_block.start_row, rs),
-            rhs_offset.block(curr_result_block.start_col, cs), output_pipeline);
+        if (may_yield && context->ShouldYield()) {
+          yielded = true;
+          break;
+        }
       }
     }
 
     local_allocator->Decommit();
+    if (end_ns) {
+      *end_ns = PerfCounterSet::NowNanoseconds();
+    }
   }
 
   const GemmContextType* context;
   const KernelBase& kernel;
   const MatrixMap<const InputScalar, LhsOrder> lhs;
-  const PackedRhs packed_rhs;
+  const MatrixMap<const InputScalar, RhsOrder> rhs;
+  RhsPipeline* const rhs_pipeline;
+  const int task_index;
+  const bool may_yield;
   MatrixMap<OutputScalar, ResultOrder> result;
-  const MatrixBlockBounds result_block;
   const LhsOffset& lhs_offset;
   const RhsOffset& rhs_offset;
   const BlockParams& block_params;
   const OutputPipelineType& output_pipeline;
+
+  // If not null, where to store the time at which Run returned, see
+  // PerfPhase::PoolWait.
+  std::uint64_t* end_ns = nullptr;
+};
+
+// The PackedRhsPipelines of a multi-threaded Gemm, committing the allocators
+// of their buffers for their lifetime. All their state lives in the scratch
+// arena of the context.
+//
+// Tasks are grouped by NUMA node: each node has its own pipeline, with its
+// own copy of the packed RHS, from its own allocator, and computes a range
+// of rows of the result proportional to its number of tasks. Without NUMA
+// awareness, there is a single node.
+template <typename KernelFormat>
+class RhsPipelines {
+ public:
+  typedef PackedRhsPipeline<PackedSideBlock<typename KernelFormat::Rhs>>
+      RhsPipeline;
+
+  template <typename GemmContextType>
+  RhsPipelines(GemmContextType* context, const BlockParams& block_params,
+               int rows, int cols, int task_count, bool work_stealing)
+      : nodes_count_(context->numa_nodes_count()) {
+    ScratchArena* scratch_arena = context->scratch_arena();
+    node_of_task_ = scratch_arena->Allocate<int>(task_count);
+    index_in_node_ = scratch_arena->Allocate<int>(task_count);
+    pipelines_ = scratch_arena->Allocate<RhsPipeline*>(nodes_count_);
+    allocators_ = scratch_arena->Allocate<Allocator*>(nodes_count_);
+    int* node_tasks_count = scratch_arena->Allocate<int>(nodes_count_);
+    std::fill(pipelines_, pipelines_ + nodes_count_, nullptr);
+    std::fill(node_tasks_count, node_tasks_count + nodes_count_, 0);
+    for (int n = 0; n < task_count; ++n) {
+      node_of_task_[n] = context->numa_node_of_task(n, task_count);
+      index_in_node_[n] = node_tasks_count[node_of_task_[n]]++;
+    }
+
+    // The result is split into tiles of rows, aligned on the kernel rows
+    // and fitting in an L2 block. Without work stealing, there is one tile
+    // per task when possible, as each task computes its own tiles anyway.
+    // With work stealing, finer tiles allow to balance the load between
+    // tasks.
+    const int tiles_per_task = work_stealing ? kWorkStealingTilesPerTask : 1;
+    int tasks_before_node = 0;
+    for (int node = 0; node < nodes_count_; ++node) {
+      const int node_tasks = node_tasks_count[node];
+      if (!node_tasks) {
+        continue;
+      }
+      const int start_row =
+          std::min(rows, RoundUp<KernelFormat::kRows>(
+                             rows * tasks_before_node / task_count));
+      tasks_before_node += node_tasks;
+      const int end_row =
+          std::min(rows, RoundUp<KernelFormat::kRows>(
+                             rows * tasks_before_node / task_count));
+      const int tile_rows =
+          std::min(block_params.l2_rows,
+                   RoundUp<KernelFormat::kRows>(std::max(
+                       1, CeilQuotient(end_row - start_row,
+                                       node_tasks * tiles_per_task))));
+      allocators_[node] = context->numa_node_allocator(node);
+      pipelines_[node] = new (scratch_arena->Allocate<RhsPipeline>(1))
+          RhsPipeline(allocators_[node], scratch_arena, block_params,
+                      start_row, end_row - start_row, cols, node_tasks,
+                      tile_rows, work_stealing);
+      context->perf_counter_set()->CommitAllocator(allocators_[node]);
+    }
+  }
+
+  ~RhsPipelines() {
+    for (int node = 0; node < nodes_count_; ++node) {
+      if (pipelines_[node]) {
+        pipelines_[node]->~RhsPipeline();
+        allocators_[node]->Decommit();
+      }
+    }
+  }
+
+  // The pipeline that the given task gets its tiles from, and the index
+  // of the task among those sharing that pipeline.
+  RhsPipeline* pipeline_of_task(int task) const {
+    return pipelines_[node_of_task_[task]];
+  }
+  int index_in_node(int task) const { return index_in_node_[task]; }
+
+  // The allocator of the buffers of the pipeline of the given task.
+  Allocator* allocator_of_task(int task) const {
+    return allocators_[node_of_task_[task]];
+  }
+
+ private:
+  RhsPipelines(const RhsPipelines&) = delete;
+
+  const int nodes_count_;
+  int* node_of_task_;
+  int* index_in_node_;
+  RhsPipeline** pipelines_;
+  Allocator** allocators_;
 };
 
 // This base class for multi-threading allows subclasses to implement their own
 // workers_pool() method.  See MultiThreadGemmContext below for an example;
 // any other implementation of workers_pool() must return an object with the
-// same public methods as WorkersPool.
+// same public methods as WorkersPool. Its Execute() may run the tasks that it
+// is given on any number of threads, or one after another.
 class MultiThreadGemmContextBase : public SingleThreadGemmContext {
  public:
   void set_max_num_threads(int n) { max_num_threads_ = n; }
 
   int max_num_threads() const { return max_num_threads_; }
 
+  // Sets the measured costs from which Gemms choose how many threads to
+  // use, see HowManyThreads. The default model is uncalibrated, which
+  // leaves that choice to a heuristic.
+  void set_thread_cost_model(const ThreadCostModel& thread_cost_model) {
+    thread_cost_model_ = thread_cost_model;
+  }
+  const ThreadCostModel& thread_cost_model() const {
+    return thread_cost_model_;
+  }
+
+  // Enables work stealing: the result is split into finer tiles, and
+  // threads done with their own tiles steal tiles from others, instead of
+  // waiting for stragglers. See PackedRhsPipeline.
+  void set_work_stealing(bool work_stealing) { work_stealing_ = work_stealing; }
+
+  bool work_stealing() const { return work_stealing_; }
+
+  // Called by MultiThreadGemm before running a Gemm that would use
+  // thread_count threads, to get how many it may actually use. All of
+  // them by default; see MultiThreadGemmContext for a context sharing
+  // threads with others.
+  int ReserveThreads(int thread_count) { return thread_count; }
+
+  // Yield points of MultiThreadGemm: whether a task run by a worker thread
+  // should stop at a tile, or L2 block, boundary and let the other tasks
+  // take over its remaining tiles. Never by default; see
+  // MultiThreadGemmContext::set_priority.
+  bool ShouldYield() const { return false; }
+
+  // Whether tasks may yield, which requires work stealing for the other
+  // tasks to take over.
+  bool preemptible() const { return false; }
+
+  // The number of NUMA nodes that threads are spread over, or 1 if not
+  // NUMA-aware. See MultiThreadGemmContext::set_affinity.
+  int numa_nodes_count() const {
+    return std::max<int>(1, numa_nodes_count_);
+  }
+
+  // The NUMA node that runs the given task out of tasks_count. Tasks are
+  // mapped to threads like in WorkersPool::Execute: the last one runs on
+  // the calling thread, whose node is that of the first thread slot, and
+  // task i on worker i, pinned to the thread slot (i+1).
+  int numa_node_of_task(int task, int tasks_count) const {
+    if (numa_node_of_slot_.empty()) {
+      return 0;
+    }
+    const int slot = task == tasks_count - 1
+                         ? 0
+                         : (task + 1) % numa_node_of_slot_.size();
+    return numa_node_of_slot_[slot];
+  }
+
+  // An allocator for the buffers shared by the threads of the given NUMA
+  // node. Since buffers are first written to, hence first touched, by the
+  // threads that use them, their pages end up local to that node.
+  Allocator* numa_node_allocator(int node) {
+    return node == 0 ? allocator() : &numa_node_allocators_[node - 1];
+  }
+
+  // Storage for the tasks and other objects of a multi-threaded Gemm,
+  // reused from one Gemm to the next, see ScratchArena.
+  ScratchArena* scratch_arena() { return &scratch_arena_; }
+
+  // Calls f on the allocators of the buffers shared by threads: the base
+  // allocator and those of NUMA nodes. See MultiThreadGemmContext for
+  // those of threads.
+  template <typename F>
+  void ForEachAllocator(F f) {
+    for (int node = 0; node < numa_nodes_count(); node++) {
+      f(numa_node_allocator(node));
+    }
+  }
+
+  // Backs large buffers with huge pages, see Allocator::set_use_huge_pages.
+  // Must not be called during a Gemm.
+  void set_use_huge_pages(bool use_huge_pages) {
+    use_huge_pages_ = use_huge_pages;
+    ForEachAllocator([this](Allocator* allocator) {
+      ConfigureAllocator(allocator);
+    });
+  }
+  bool use_huge_pages() const { return use_huge_pages_; }
+
+  // Takes the storage of buffers from the given provider, see
+  // Allocator::set_memory_provider. Must not be called during a Gemm.
+  void set_memory_provider(MemoryProvider* memory_provider) {
+    memory_provider_ = memory_provider;
+    ForEachAllocator([this](Allocator* allocator) {
+      ConfigureAllocator(allocator);
+    });
+  }
+  MemoryProvider* memory_provider() const { return memory_provider_; }
+
+  // Makes buffers shrink once they have been oversized for decay_commits
+  // Gemms in a row, see Allocator::set_decay_commits. Must not be called
+  // during a Gemm.
+  void set_decay_commits(int decay_commits) {
+    decay_commits_ = decay_commits;
+    ForEachAllocator([this](Allocator* allocator) {
+      ConfigureAllocator(allocator);
+    });
+  }
+  int decay_commits() const { return decay_commits_; }
+
+  // Frees the memory kept from earlier Gemms, which later ones allocate
+  // again as needed. Must not be called during a Gemm.
+  void TrimMemory() {
+    ForEachAllocator([](Allocator* allocator) { allocator->Trim(); });
+    scratch_arena_.Trim();
+  }
+
  protected:
+  // Sets the NUMA node of each thread slot, given by ids that need not be
+  // contiguous. An empty vector, or a single node, disables NUMA awareness.
+  // Must not be called during a Gemm.
+  void set_numa_node_of_slot(const std::vector<int>& node_of_slot) {
+    std::vector<int> node_ids;
+    numa_node_of_slot_.clear();
+    for (int node_id : node_of_slot) {
+      auto it = std::find(node_ids.begin(), node_ids.end(), node_id);
+      numa_node_of_slot_.push_back(it - node_ids.begin());
+      if (it == node_ids.end()) {
+        node_ids.push_back(node_id);
+      }
+    }
+    numa_nodes_count_ = static_cast<int>(node_ids.size());
+    if (numa_nodes_count_ < 2) {
+      numa_node_of_slot_.clear();
+      numa_nodes_count_ = 1;
+    }
+    numa_node_allocators_.reset(new Allocator[numa_nodes_count_ - 1]);
+    for (int node = 1; node < numa_nodes_count_; node++) {
+      ConfigureAllocator(numa_node_allocator(node));
+    }
+  }
+
+  void ConfigureAllocator(Allocator* allocator) {
+    allocator->set_use_huge_pages(use_huge_pages_);
+    allocator->set_memory_provider(memory_provider_);
+    allocator->set_decay_commits(decay_commits_);
+  }
+
+
   // The maximum number of worker threads to use (including
   // the master thread).
   // The default value 1 means single-threading. That is the default
   // because gemmlowp's primary target is mobile hardware, where thermal
   // constraints usually mean that it may not be realistic to use more
   // than 1 CPU core even if multiple cores are present.
-  // The special value 0 means try to detect the number of hardware threads.
+  // The special value 0 means try to detect the number of CPUs that this
+  // process may use, which accounts for its affinity mask and for cgroup
+  // CPU quotas, e.g. in containers, see GetAvailableCpus.
   // Note: this assumes that all CPU cores are equivalent. That assumption
   // is defeated on big.LITTLE ARM devices, where we have no API to query
   // the number of big cores (which is typically what we would want to use,
@@ -535,17 +1988,267 @@ class MultiThreadGemmContextBase : public SingleThreadGemmContext {
   // so users who want multi-threading have to make the decision of how many
   // threads to use by themselves.
   int max_num_threads_ = 1;
+
+  // The cost model for thread counts, see set_thread_cost_model.
+  ThreadCostModel thread_cost_model_;
+
+  // Whether to use work stealing. Off by default, as it only pays off when
+  // threads may be descheduled or throttled, e.g. on shared hosts, while
+  // finer tiles add some per-tile overhead.
+  bool work_stealing_ = false;
+
+  // The NUMA node of each thread slot, see set_numa_node_of_slot, the
+  // number of distinct nodes, and the allocators of nodes other than the
+  // first one, which uses the base allocator.
+  std::vector<int> numa_node_of_slot_;
+  int numa_nodes_count_ = 1;
+  std::unique_ptr<Allocator[]> numa_node_allocators_;
+
+  ScratchArena scratch_arena_;
+
+  // How allocators get and release their storage, see set_use_huge_pages,
+  // set_memory_provider and set_decay_commits.
+  bool use_huge_pages_ = false;
+  MemoryProvider* memory_provider_ = nullptr;
+  int decay_commits_ = 0;
 };
 
 class MultiThreadGemmContext : public MultiThreadGemmContextBase {
  public:
   WorkersPool* workers_pool() { return &workers_pool_; }
 
+  // Sets how worker threads are placed on CPUs, see AffinityPolicy and
+  // WorkersPool::set_affinity. cpu_set is only used by
+  // AffinityPolicy::CpuSet.
+  //
+  // Under a pinning policy, the special max_num_threads value 0 means one
+  // thread per CPU set of the placement, e.g. one per physical core, rather
+  // than one per hardware thread. This also sets l2_bytes_to_use to the L2
+  // cache size available to each thread under that placement, when it can
+  // be detected; call set_l2_bytes_to_use afterwards to override that.
+  //
+  // If the placement spans several NUMA nodes, Gemms become NUMA-aware:
+  // the threads of each node compute their own range of rows of the
+  // result, from their own copy of the packed RHS in node-local memory.
+  // Threads only steal work from threads of the same node, so that each
+  // part of the result is written, and first touched, by its node.
+  void set_affinity(AffinityPolicy policy,
+                    const std::vector<int>& cpu_set = std::vector<int>()) {
+    workers_pool_.set_affinity(policy, cpu_set, cpu_topology_);
+    const auto& placement = workers_pool_.placement();
+    const int l2_bytes_per_thread =
+        GetL2BytesPerThread(cpu_topology_, placement);
+    if (l2_bytes_per_thread > 0) {
+      set_l2_bytes_to_use(l2_bytes_per_thread);
+    }
+    std::vector<int> node_of_slot;
+    if (cpu_topology_.numa_nodes.size() > 1) {
+      for (const auto& cpus : placement) {
+        node_of_slot.push_back(GetNumaNodeOfCpu(cpu_topology_, cpus[0]));
+      }
+    }
+    set_numa_node_of_slot(node_of_slot);
+  }
+
+  // Overrides the detected CPU topology used by subsequent set_affinity
+  // calls, e.g. to simulate a NUMA system in tests.
+  void set_cpu_topology(const CpuTopology& topology) {
+    cpu_topology_ = topology;
+  }
+
+  // Makes Gemms on this context share the workers of the given pool with
+  // other contexts, instead of using threads of their own, e.g. when many
+  // threads each have a context. The pool must outlive its use by this
+  // context; nullptr reverts to the context's own threads.
+  void set_shared_workers_pool(SharedWorkersPool* shared_workers_pool) {
+    workers_pool_.set_shared_workers_pool(shared_workers_pool);
+  }
+  SharedWorkersPool* shared_workers_pool() const {
+    return workers_pool_.shared_workers_pool();
+  }
+
+  // Hides MultiThreadGemmContextBase::max_num_threads() to account for the
+  // placement of threads, see set_affinity, and for shared workers, where
+  // the special value 0 means all the shared workers and this thread.
+  int max_num_threads() const {
+    if (max_num_threads_ == 0 && workers_pool_.shared_workers_pool()) {
+      return workers_pool_.shared_workers_pool()->workers_count() + 1;
+    }
+    if (max_num_threads_ == 0 && !workers_pool_.placement().empty()) {
+      return std::min(static_cast<int>(workers_pool_.placement().size()),
+                      GetAvailableCpus());
+    }
+    return max_num_threads_;
+  }
+
+  // Hides MultiThreadGemmContextBase::ReserveThreads(): with shared
+  // workers, only the workers that can be leased right now are used.
+  int ReserveThreads(int thread_count) {
+    return 1 + workers_pool_.ReserveWorkers(thread_count - 1);
+  }
+
+  // Sets the priority of Gemms on this context over those of other
+  // contexts sharing workers with it, see SharedWorkersPool. Gemms of
+  // lower than High priority always use work stealing, so that workers
+  // can be taken away from them.
+  void set_priority(Priority priority) { workers_pool_.set_priority(priority); }
+  Priority priority() const { return workers_pool_.priority(); }
+
+  // Hide the MultiThreadGemmContextBase methods to enable yield points.
+  bool ShouldYield() const { return workers_pool_.ShouldYield(); }
+  bool preemptible() const {
+    return workers_pool_.shared_workers_pool() &&
+           workers_pool_.priority() != Priority::High;
+  }
+
+  // Sets how worker threads trade off latency against power when waiting
+  // for work, see SpinMode.
+  void set_spin_mode(SpinMode mode) { workers_pool_.set_spin_mode(mode); }
+  SpinMode spin_mode() const { return workers_pool_.spin_mode(); }
+
+  // How often worker threads waiting for work got it while busy-waiting.
+  SpinStats spin_stats() const { return workers_pool_.spin_stats(); }
+
+  // Histograms of the timings of the tasks of multi-threaded Gemms on this
+  // context, see PoolTelemetry, since it was created or since the last
+  // call to ResetPoolTelemetry. Must not be called concurrently with Gemms
+  // on this context. Asynchronous Gemms are not included: they run on
+  // contexts of their own, see async_gemm.h.
+  const PoolTelemetry& pool_telemetry() const {
+    return workers_pool_.telemetry();
+  }
+  void ResetPoolTelemetry() { workers_pool_.ResetTelemetry(); }
+
+  // Hides MultiThreadGemmContextBase::ForEachAllocator() to include the
+  // allocators of the tasks run by the workers pool.
+  template <typename F>
+  void ForEachAllocator(F f) {
+    MultiThreadGemmContextBase::ForEachAllocator(f);
+    workers_pool_.ForEachAllocator(f);
+  }
+
+  // Hide the MultiThreadGemmContextBase methods to also apply to the
+  // allocators of the workers pool.
+  void set_use_huge_pages(bool use_huge_pages) {
+    MultiThreadGemmContextBase::set_use_huge_pages(use_huge_pages);
+    workers_pool_.set_use_huge_pages(use_huge_pages);
+  }
+  void set_memory_provider(MemoryProvider* memory_provider) {
+    MultiThreadGemmContextBase::set_memory_provider(memory_provider);
+    workers_pool_.set_memory_provider(memory_provider);
+  }
+  void set_decay_commits(int decay_commits) {
+    MultiThreadGemmContextBase::set_decay_commits(decay_commits);
+    workers_pool_.set_decay_commits(decay_commits);
+  }
+  void TrimMemory() {
+    MultiThreadGemmContextBase::TrimMemory();
+    workers_pool_.ForEachAllocator(
+        [](Allocator* allocator) { allocator->Trim(); });
+  }
+
+  // The scratch memory currently held by the allocators given by
+  // ForEachAllocator, and the sum of the most that each of them has held.
+  std::size_t scratch_bytes() {
+    std::size_t result = 0;
+    ForEachAllocator([&result](Allocator* allocator) {
+      result += allocator->storage_size();
+    });
+    return result;
+  }
+  std::size_t high_water_scratch_bytes() {
+    std::size_t result = 0;
+    ForEachAllocator([&result](Allocator* allocator) {
+      result += allocator->high_water_storage_size();
+    });
+    return result;
+  }
+
+  // What the buffers of the last Gemms got: the least of what the
+  // allocators given by ForEachAllocator holding at least a huge page got,
+  // or HugePages::None if none does.
+  HugePages huge_pages() {
+    bool any = false;
+    HugePages result = HugePages::Explicit;
+    ForEachAllocator([&any, &result](Allocator* allocator) {
+      if (allocator->storage_size() >= Allocator::kHugePageSize) {
+        any = true;
+        result = std::min(result, allocator->huge_pages());
+      }
+    });
+    return any ? result : HugePages::None;
+  }
+
  private:
   // The workers pool used by MultiThreadGemm. Making
   // this part of the context allows it to be persistent,
   // avoiding recreating threads on every Gemm.
   WorkersPool workers_pool_;
+
+  // The CPU topology that threads are placed on.
+  CpuTopology cpu_topology_ = GetCpuTopology();
+};
+
+// The settings of a MultiThreadGemmContext, except for affinity settings,
+// to set up other contexts like it, e.g. later or on other threads.
+struct MultiThreadGemmSettings {
+  explicit MultiThreadGemmSettings(const MultiThreadGemmContext& context)
+      : max_num_threads(context.max_num_threads()),
+        thread_cost_model(context.thread_cost_model()),
+        l1_bytes_to_use(context.l1_bytes_to_use()),
+        l2_bytes_to_use(context.l2_bytes_to_use()),
+        llc_bytes_to_use(context.llc_bytes_to_use()),
+        l2_rhs_factor(context.l2_rhs_factor()),
+        work_stealing(context.work_stealing()),
+        spin_mode(context.spin_mode()),
+        use_huge_pages(context.use_huge_pages()),
+        memory_provider(context.memory_provider()),
+        max_scratch_bytes(context.max_scratch_bytes()),
+        decay_commits(context.decay_commits()),
+        tuning_table(context.tuning_table()),
+        perf_counter_set(context.perf_counter_set()),
+        gemm_recorder(context.gemm_recorder()),
+        shared_workers_pool(context.shared_workers_pool()),
+        priority(context.priority()) {}
+
+  // Must not be called during a Gemm on the given context.
+  void ApplyTo(MultiThreadGemmContext* context) const {
+    context->set_max_num_threads(max_num_threads);
+    context->set_thread_cost_model(thread_cost_model);
+    context->set_l1_bytes_to_use(l1_bytes_to_use);
+    context->set_l2_bytes_to_use(l2_bytes_to_use);
+    context->set_llc_bytes_to_use(llc_bytes_to_use);
+    context->set_l2_rhs_factor(l2_rhs_factor);
+    context->set_work_stealing(work_stealing);
+    context->set_spin_mode(spin_mode);
+    context->set_use_huge_pages(use_huge_pages);
+    context->set_memory_provider(memory_provider);
+    context->set_max_scratch_bytes(max_scratch_bytes);
+    context->set_decay_commits(decay_commits);
+    context->set_tuning_table(tuning_table);
+    context->set_perf_counter_set(perf_counter_set);
+    context->set_gemm_recorder(gemm_recorder);
+    context->set_shared_workers_pool(shared_workers_pool);
+    context->set_priority(priority);
+  }
+
+  int max_num_threads;
+  ThreadCostModel thread_cost_model;
+  int l1_bytes_to_use;
+  int l2_bytes_to_use;
+  int llc_bytes_to_use;
+  float l2_rhs_factor;
+  bool work_stealing;
+  SpinMode spin_mode;
+  bool use_huge_pages;
+  MemoryProvider* memory_provider;
+  std::size_t max_scratch_bytes;
+  int decay_commits;
+  const TuningTable* tuning_table;
+  PerfCounterSet* perf_counter_set;
+  GemmRecorder* gemm_recorder;
+  SharedWorkersPool* shared_workers_pool;
+  Priority priority;
 };
 
 // Needed by chrome native builds
@@ -553,6 +2256,54 @@ class MultiThreadGemmContext : public MultiThreadGemmContextBase {
 #define _SC_NPROCESSORS_CONF _SC_NPROCESSORS_ONLN
 #endif
 
+// Runs, then destroys, tasks_count tasks constructed in scratch storage,
+// see ScratchArena. WorkersPool runs them in place. Other implementations
+// of workers pools take ownership of the tasks given to Execute, so they
+// are given heap-allocated copies.
+template <typename TaskType>
+void ExecuteScratchTasks(WorkersPool* workers_pool, TaskType* tasks,
+                         int tasks_count) {
+  workers_pool->ExecuteUnowned(tasks, tasks_count);
+  for (int n = 0; n < tasks_count; ++n) {
+    tasks[n].~TaskType();
+  }
+}
+
+template <typename WorkersPoolType, typename TaskType>
+void ExecuteScratchTasks(WorkersPoolType* workers_pool, TaskType* tasks,
+                         int tasks_count) {
+  std::vector<Task*> heap_tasks;
+  for (int n = 0; n < tasks_count; ++n) {
+    heap_tasks.push_back(new TaskType(tasks[n]));
+    tasks[n].~TaskType();
+  }
+  workers_pool->Execute(heap_tasks);
+}
+
+// Initializes the BlockParams of a MultiThreadGemm with the given count of
+// tasks, keeping its scratch memory within the budget of the context: the
+// storage that the allocators of tasks, and those of the RHS pipelines of
+// NUMA nodes, grow to.
+template <typename KernelFormat, typename GemmContextType>
+void InitMultiThreadGemmBlockParams(GemmContextType* context, int rows,
+                                    int cols, int depth, int task_count,
+                                    BlockParams* block_params) {
+  typedef PackedRhsPipeline<PackedSideBlock<typename KernelFormat::Rhs>>
+      RhsPipeline;
+  const int nodes_count = std::min(task_count, context->numa_nodes_count());
+  const TunedParams tuned = context->tuned_params(rows, depth, cols);
+  block_params->Init<KernelFormat>(
+      rows, cols, depth, task_count, tuned.l1_bytes_to_use,
+      tuned.l2_bytes_to_use, tuned.llc_bytes_to_use, tuned.l2_rhs_factor,
+      context->max_scratch_bytes(),
+      [task_count, nodes_count](const BlockParams& params) {
+        return task_count * RoundUpToPowerOfTwo(PackedLhsBytes(params) +
+                                                PackedResultBytes(params)) +
+               nodes_count * RoundUpToPowerOfTwo(RhsPipeline::kMaxBuffers *
+                                                 PackedRhsBytes(params));
+      });
+}
+
 // Determines how many threads should be used for a given Gemm
 // operation.
 template <int KernelRows>
@@ -563,7 +2314,7 @@ inline int HowManyThreads(int max_num_threads, int rows, int cols, int depth) {
   }
 
   // Determine the maximum number of threads.
-  int max_count = GetHardwareConcurrency(max_num_threads);
+  int max_count = GetAvailableConcurrency(max_num_threads);
 
   // Basic calculation: take into account max pool size, and
   // how many rows we have to feed our kernel.
@@ -603,11 +2354,53 @@ inline int HowManyThreads(int max_num_threads, int rows, int cols, int depth) {
   return thread_count;
 }
 
+// Like the above, but chooses the count of threads for which a calibrated
+// cost model predicts the shortest time, giving each thread at least the
+// rows of one kernel. Falls back to the above with an uncalibrated model.
+// Rows are always what is split between threads, see MultiThreadGemm.
+template <int KernelRows>
+inline int HowManyThreads(const ThreadCostModel& cost_model,
+                          int max_num_threads, int rows, int cols, int depth) {
+  if (max_num_threads == 1 || !cost_model.calibrated()) {
+    return HowManyThreads<KernelRows>(max_num_threads, rows, cols, depth);
+  }
+  const int max_count = std::min(GetAvailableConcurrency(max_num_threads),
+                                 CeilQuotient(rows, KernelRows));
+  int thread_count = 1;
+  double best_seconds =
+      cost_model.PredictSeconds(rows, cols, depth, 1, KernelRows);
+  for (int threads = 2; threads <= max_count; threads++) {
+    const double seconds =
+        cost_model.PredictSeconds(rows, cols, depth, threads, KernelRows);
+    if (seconds < best_seconds) {
+      thread_count = threads;
+      best_seconds = seconds;
+    }
+  }
+  return thread_count;
+}
+
+// Returns the most threads to use for a Gemm of the given shape, that is
+// the limit of the context, further limited by its tuning table if any.
+template <typename GemmContextType>
+int MaxNumThreadsForShape(const GemmContextType* context, int rows, int depth,
+                          int cols) {
+  const int max_num_threads = context->max_num_threads();
+  const int tuned_max_num_threads =
+      context->tuned_params(rows, depth, cols).max_num_threads;
+  if (tuned_max_num_threads == 0) {
+    return max_num_threads;
+  }
+  return std::min(GetAvailableConcurrency(max_num_threads),
+                  tuned_max_num_threads);
+}
+
 // The main multi-threaded Gemm function.
 // To understand it, first read the code of SingleThreadGemm().
-// The parallelization scheme used here is to have this master function
-// pack a block of RHS and then start worker threads to pack a block of LHS
-// each, and accumulate the corresponding products.
+// The parallelization scheme used here is to start one task per thread,
+// each computing tiles of rows of the result. The tasks pack the blocks of
+// the RHS cooperatively, through a PackedRhsPipeline, which also hands out
+// the tiles of each block to them, optionally with work stealing.
 template <typename KernelFormat, typename InputScalar, typename OutputScalar,
           typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
           MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
@@ -618,7 +2411,9 @@ void MultiThreadGemm(GemmContextType* context, const KernelBase& kernel,
                      MatrixMap<OutputScalar, ResultOrder>* result,
                      const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
                      const OutputPipelineType& output_pipeline) {
-  ScopedProfilingLabel label("gemmlowp::MultiThreadGemm");
+  ScopedProfilingLabel label(
+      "gemmlowp::MultiThreadGemm",
+      TraceArgs(result->rows(), lhs.cols(), result->cols()));
 
   assert(lhs.cols() == rhs.rows());
 
@@ -634,8 +2429,11 @@ void MultiThreadGemm(GemmContextType* context, const KernelBase& kernel,
   // The case of rows<cols should have been caught earlier and transposed.
   assert(rows >= cols);
 
-  const int thread_count = HowManyThreads<KernelFormat::kRows>(
-      context->max_num_threads(), rows, cols, depth);
+  const int thread_count =
+      context->ReserveThreads(HowManyThreads<KernelFormat::kRows>(
+          context->thread_cost_model(),
+          MaxNumThreadsForShape(context, rows, depth, cols), rows, cols,
+          depth));
   if (thread_count == 1) {
     return SingleThreadGemm<KernelFormat, InputScalar, OutputScalar,
                             BitDepthParams>(context, kernel, lhs, rhs, result,
@@ -643,56 +2441,195 @@ void MultiThreadGemm(GemmContextType* context, const KernelBase& kernel,
                                             output_pipeline);
   }
   assert(thread_count > 1);
+  context->perf_counter_set()->AddGemm(rows, depth, cols, thread_count);
 
   // Simple 1:1 mapping of tasks to physical cores, which is very important
   // to getting good multithreaded performance, specially for not-very-large
   // GEMMs, and especially on Android.
   const int task_count = thread_count;
 
-  Allocator* allocator = context->allocator();
   auto* workers_pool = context->workers_pool();
 
   BlockParams block_params;
-  block_params.Init<KernelFormat>(
-      rows, cols, depth, task_count, context->l1_bytes_to_use(),
-      context->l2_bytes_to_use(), context->l2_rhs_factor());
+  InitMultiThreadGemmBlockParams<KernelFormat>(context, rows, cols, depth,
+                                               task_count, &block_params);
+
+  // Tasks that may yield need work stealing for others to take over.
+  const bool work_stealing =
+      context->work_stealing() || context->preemptible();
+
+  // All the objects of this Gemm are constructed in the scratch arena of
+  // the context, so that steady-state Gemms don't allocate heap memory.
+  ScratchArena* scratch_arena = context->scratch_arena();
+  scratch_arena->Reset();
+
+  // The RHS is packed cooperatively by the tasks of each node, one L2
+  // block at a time.
+  RhsPipelines<KernelFormat> rhs_pipelines(context, block_params, rows, cols,
+                                           task_count, work_stealing);
+
+  // Give work to each worker: the tiles of the result are handed out to
+  // them by the pipeline of their node. Tasks run by workers may yield to
+  // other Gemms, but not the last one, run by this thread, which takes
+  // over the tiles they leave.
+  typedef GemmWithPackedRhsTask<KernelFormat, InputScalar, OutputScalar,
+                                BitDepthParams, LhsOrder, RhsOrder,
+                                ResultOrder, LhsOffset, RhsOffset,
+                                OutputPipelineType, GemmContextType>
+      TaskType;
+  TaskType* tasks = scratch_arena->Allocate<TaskType>(task_count);
+  for (int n = 0; n < task_count; ++n) {
+    new (&tasks[n]) TaskType(
+        context, kernel, lhs, rhs, rhs_pipelines.pipeline_of_task(n),
+        rhs_pipelines.index_in_node(n), n < task_count - 1, result,
+        lhs_offset, rhs_offset, block_params, output_pipeline);
+  }
+  // The last task runs on this thread, which then waits for the workers.
+  std::uint64_t last_task_end_ns = 0;
+  tasks[task_count - 1].end_ns = &last_task_end_ns;
+  // Execute the work on the workers (and partially on this thread).
+  ExecuteScratchTasks(workers_pool, tasks, task_count);
+  context->perf_counter_set()->AddPhaseSince(PerfPhase::PoolWait,
+                                             last_task_end_ns);
+}
 
-  PackedSideBlock<typename KernelFormat::Rhs> packed_rhs(Side::Rhs, allocator,
-                                                         block_params);
-  allocator->Commit();
+// The task we use to prewarm a multi-threaded Gemm, see
+// PrewarmMultiThreadGemm: it allocates the buffers that a
+// GemmWithPackedRhsTask would allocate from its local allocator, and
+// optionally prefaults them, and the given shared allocator if any.
+template <typename KernelFormat>
+struct PrewarmTask : Task {
+  PrewarmTask(const BlockParams& _block_params, bool _prefault,
+              Allocator* _shared_allocator_to_prefault)
+      : block_params(_block_params),
+        prefault(_prefault),
+        shared_allocator_to_prefault(_shared_allocator_to_prefault) {}
 
-  // We loop over large blocks of the RHS.
-  for (int c = 0; c < cols; c += block_params.l2_cols) {
-    int cs = std::min(block_params.l2_cols, cols - c);
+  void Run() override {
+    ScopedProfilingLabel label("PrewarmTask");
+    PackedSideBlock<typename KernelFormat::Lhs> packed_lhs(
+        Side::Lhs, local_allocator, block_params);
+    PackedResult packed_result(local_allocator, block_params);
+    local_allocator->Commit();
+    if (prefault) {
+      local_allocator->Prefault();
+    }
+    if (shared_allocator_to_prefault) {
+      shared_allocator_to_prefault->Prefault();
+    }
+    local_allocator->Decommit();
+  }
 
-    // Pack a large block of the RHS.
-    PackRhs(&packed_rhs, rhs.block(0, c, depth, cs));
+  const BlockParams& block_params;
+  const bool prefault;
+  Allocator* const shared_allocator_to_prefault;
+};
 
-    // Give work to each worker.
-    std::vector<Task*> tasks;
-    int next_start_row = 0;
-    for (int n = 0; n < task_count; ++n) {
-      int start_row = next_start_row;
-      next_start_row = std::min(
-          rows, RoundUp<KernelFormat::kRows>(rows * (n + 1) / task_count));
-
-      int block_rows = next_start_row - start_row;
-      auto lhs_block = lhs.block(start_row, 0, block_rows, depth);
-      typedef GemmWithPackedRhsTask<KernelFormat, InputScalar, OutputScalar,
-                                    BitDepthParams, LhsOrder, RhsOrder,
-                                    ResultOrder, LhsOffset, RhsOffset,
-                                    OutputPipelineType, GemmContextType>
-          TaskType;
-      tasks.push_back(
-          new TaskType(context, kernel, lhs_block, packed_rhs, result,
-                       MatrixBlockBounds(start_row, c, block_rows, cs),
-                       lhs_offset, rhs_offset, block_params, output_pipeline));
-    }
-    // Execute the work on the workers (and partially on this thread).
-    workers_pool->Execute(tasks);
-  }
-
-  allocator->Decommit();
+// Prepares the context for Gemms of up to the given size, so that the
+// first one runs at steady-state speed: creates the worker threads that it
+// would use, and grows all its buffers to their size for that Gemm,
+// optionally prefaulting them. Buffers shared by tasks are prefaulted by
+// one of these tasks, so that their pages are local to them.
+template <typename KernelFormat, typename GemmContextType>
+void PrewarmMultiThreadGemm(GemmContextType* context, int rows, int depth,
+                            int cols, bool prefault) {
+  ScopedProfilingLabel label("gemmlowp::PrewarmMultiThreadGemm");
+
+  // The buffers of SingleThreadGemm.
+  {
+    Allocator* allocator = context->allocator();
+    const TunedParams tuned = context->tuned_params(rows, depth, cols);
+    BlockParams block_params;
+    block_params.Init<KernelFormat>(
+        rows, cols, depth, 1, tuned.l1_bytes_to_use, tuned.l2_bytes_to_use,
+        tuned.llc_bytes_to_use, tuned.l2_rhs_factor,
+        context->max_scratch_bytes(), SingleThreadGemmScratchBytes);
+    PackedSideBlock<typename KernelFormat::Lhs> packed_lhs(
+        Side::Lhs, allocator, block_params);
+    PackedSideBlock<typename KernelFormat::Rhs> packed_rhs(
+        Side::Rhs, allocator, block_params);
+    PackedResult packed_result(allocator, block_params);
+    allocator->Commit();
+    if (prefault) {
+      allocator->Prefault();
+    }
+    allocator->Decommit();
+  }
+
+  const int thread_count =
+      context->ReserveThreads(HowManyThreads<KernelFormat::kRows>(
+          context->thread_cost_model(),
+          MaxNumThreadsForShape(context, rows, depth, cols), rows, cols,
+          depth));
+  if (thread_count == 1) {
+    return;
+  }
+
+  // The buffers of MultiThreadGemm.
+  const int task_count = thread_count;
+  BlockParams block_params;
+  InitMultiThreadGemmBlockParams<KernelFormat>(context, rows, cols, depth,
+                                               task_count, &block_params);
+  ScratchArena* scratch_arena = context->scratch_arena();
+  scratch_arena->Reset();
+  RhsPipelines<KernelFormat> rhs_pipelines(
+      context, block_params, rows, cols, task_count,
+      context->work_stealing() || context->preemptible());
+  typedef PrewarmTask<KernelFormat> TaskType;
+  TaskType* tasks = scratch_arena->Allocate<TaskType>(task_count);
+  for (int n = 0; n < task_count; ++n) {
+    Allocator* shared_allocator_to_prefault =
+        prefault && rhs_pipelines.index_in_node(n) == 0
+            ? rhs_pipelines.allocator_of_task(n)
+            : nullptr;
+    new (&tasks[n])
+        TaskType(block_params, prefault, shared_allocator_to_prefault);
+  }
+  ExecuteScratchTasks(context->workers_pool(), tasks, task_count);
+}
+
+// A task doing nothing, see MeasureDispatchSeconds.
+struct NopTask : Task {
+  void Run() override {}
+};
+
+// Measures the time that it takes to start a task on one more thread of a
+// context and to wait for it, as ThreadCostModel::dispatch_seconds_per_thread,
+// by running tasks doing nothing on up to the given count of threads. Returns
+// 0 if fewer than two threads can be used.
+template <typename GemmContextType>
+double MeasureDispatchSeconds(GemmContextType* context, int threads) {
+  ScopedProfilingLabel label("gemmlowp::MeasureDispatchSeconds");
+  const int kRuns = 64;
+  ScratchArena* scratch_arena = context->scratch_arena();
+  double seconds[2] = {0, 0};
+  int thread_counts[2] = {1, threads};
+  for (int i = 0; i < 2; i++) {
+    // Keep the fastest of several batches of runs, not to count
+    // preemptions.
+    for (int batch = 0; batch < 4; batch++) {
+      const double time_start = real_time_in_seconds();
+      for (int run = 0; run < kRuns; run++) {
+        const int task_count = context->ReserveThreads(thread_counts[i]);
+        if (i == 1) {
+          thread_counts[i] = task_count;
+        }
+        scratch_arena->Reset();
+        NopTask* tasks = scratch_arena->Allocate<NopTask>(task_count);
+        for (int n = 0; n < task_count; ++n) {
+          new (&tasks[n]) NopTask;
+        }
+        ExecuteScratchTasks(context->workers_pool(), tasks, task_count);
+      }
+      const double batch_seconds =
+          (real_time_in_seconds() - time_start) / kRuns;
+      seconds[i] = batch ? std::min(seconds[i], batch_seconds) : batch_seconds;
+    }
+  }
+  if (thread_counts[1] < 2) {
+    return 0;
+  }
+  return std::max(0., seconds[1] - seconds[0]) / (thread_counts[1] - 1);
 }
 
 }  // namespace gemmlowp
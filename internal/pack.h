@@ -314,15 +314,40 @@ class PackSideBlockImpl {
   void PackL2() {
     memset(packed_side_block_->sums_of_each_slice(), 0,
            sizeof(std::int32_t) * packed_side_block_->params().l2_width);
+    PackL2Loops(0, src_map_.width());
+  }
+
+  // The public entry point to pack only the range
+  // [start_width, start_width + width) of the width dimension of a block.
+  // start_width must be a multiple of kKernelWidth.
+  //
+  // Distinct ranges of the same block may be packed concurrently, each
+  // through its own copy of the PackedSideBlock, since they write to
+  // disjoint parts of the packed data and of the sums_of_each_slice vector.
+  void PackL2WidthRange(int start_width, int width) {
+    assert(start_width % kKernelWidth == 0);
+    assert(start_width + width <= src_map_.width());
+    const int sums_count =
+        std::min(RoundUp<kKernelWidth>(width),
+                 packed_side_block_->params().l2_width - start_width);
+    memset(packed_side_block_->sums_of_each_slice() + start_width, 0,
+           sizeof(std::int32_t) * sums_count);
+    PackL2Loops(start_width, width);
+  }
+
+ protected:
+  // The outer loops, over L1 blocks within the given range of the width
+  // dimension.
+  void PackL2Loops(int start_width, int width) {
     for (int d = 0; d < src_map_.depth();
          d += packed_side_block_->params().l1_depth) {
       int ds = std::min<int>(packed_side_block_->params().l1_depth,
                              src_map_.depth() - d);
 
-      for (int w = 0; w < src_map_.width();
+      for (int w = start_width; w < start_width + width;
            w += packed_side_block_->params().l1_width) {
         int ws = std::min<int>(packed_side_block_->params().l1_width,
-                               src_map_.width() - w);
+                               start_width + width - w);
 
         PrefetchL1(w, ws, d, ds);
         PackL1(w, ws, d, ds);
@@ -330,7 +355,6 @@ class PackSideBlockImpl {
     }
   }
 
- protected:
   // The intermediate-level loops, between PackL2 and PackRun.
   void PackL1(int start_width, int width, int start_depth, int depth) {
     for (int w = 0; w < width; w += kKernelWidth) {
@@ -424,6 +448,25 @@ void PackRhs(PackedSideBlock* dst, const MatrixMapType& src) {
   impl.PackL2();
 }
 
+// Packs only the columns [start_col, start_col + cols) of a block of the
+// input RHS matrix, into a PackedSideBlock. src is the whole block, and
+// start_col must be a multiple of the kernel width. This allows several
+// threads to pack one RHS block together, see PackRhsTask.
+template <typename PackedSideBlock, typename MatrixMapType>
+void PackRhsWidthRange(PackedSideBlock* dst, const MatrixMapType& src,
+                       int start_col, int cols) {
+  ScopedProfilingLabel label("pack RHS (width range)");
+  static const SideMapOrder kSideMapOrder =
+      MatrixMapType::kOrder == MapOrder::ColMajor ? SideMapOrder::WidthMajor
+                                                  : SideMapOrder::DepthMajor;
+  typedef typename MatrixMapType::Scalar Scalar;
+  typedef SideMap<Scalar, kSideMapOrder> SideMapType;
+  SideMapType src_side_map(src.data(), src.cols(), src.rows(), src.stride());
+  typedef PackSideBlockImpl<SideMapType, PackedSideBlock> ImplType;
+  ImplType impl(dst, src_side_map);
+  impl.PackL2WidthRange(start_col, cols);
+}
+
 }  // namespace gemmlowp
 
 #ifdef GEMMLOWP_NEON
@@ -0,0 +1,357 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// perf_counters.h: counters of the work done by the Gemms of a context and
+// of the time spent in each of their phases, see
+// SingleThreadGemmContext::perf_counters. Unlike the profiler, they are
+// always available, and cheap enough for production use: a few relaxed
+// atomic additions and monotonic clock reads per L2 block. Defining
+// GEMMLOWP_NO_PERF_COUNTERS removes them entirely, leaving counters that
+// stay at zero.
+//
+// This also defines the histograms of the timings of the workers pools of
+// multi-threaded Gemms, see PoolTelemetry.
+
+#ifndef GEMMLOWP_INTERNAL_PERF_COUNTERS_H_
+#define GEMMLOWP_INTERNAL_PERF_COUNTERS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "allocator.h"
+
+namespace gemmlowp {
+
+// The phases of a Gemm that are timed separately.
+enum class PerfPhase {
+  PackLhs,
+  PackRhs,
+  Compute,
+  Unpack,
+  // Threads of a multi-threaded Gemm waiting for each other: for the RHS
+  // blocks that others pack, and for the workers to finish.
+  PoolWait,
+  Count
+};
+
+// Observes the starts and ends of the phases of Gemms that ScopedPerfPhase
+// delimits, on the threads that run them, e.g. to read hardware counters at
+// phase boundaries as test/benchmark.cc does. It is called concurrently by
+// the threads of Gemms. Of the PoolWait phase, it only sees the waits for
+// packed RHS blocks, not those for blocks to pack or for workers to finish.
+class PerfPhaseListener {
+ public:
+  virtual ~PerfPhaseListener() {}
+  virtual void PhaseBegin(PerfPhase phase) = 0;
+  virtual void PhaseEnd(PerfPhase phase) = 0;
+};
+
+// A snapshot of the counters of a context. Times are summed over the
+// threads of each Gemm, so they may add up to more than the time that
+// Gemms took.
+struct PerfCounters {
+  std::uint64_t gemms = 0;
+  std::uint64_t macs = 0;
+  double pack_lhs_seconds = 0;
+  double pack_rhs_seconds = 0;
+  double compute_seconds = 0;
+  double unpack_seconds = 0;
+  double pool_wait_seconds = 0;
+  // The sum over Gemms of the threads they ran on, and the most that one
+  // of them ran on.
+  std::uint64_t threads_used = 0;
+  int max_threads_used = 0;
+  // The count of commits of scratch allocators that had to grow their
+  // storage, see Allocator::growths.
+  std::uint64_t allocator_growths = 0;
+};
+
+// The counters of a context, updated concurrently by the threads of its
+// Gemms.
+class PerfCounterSet {
+ public:
+#ifndef GEMMLOWP_NO_PERF_COUNTERS
+  PerfCounterSet() { Reset(); }
+
+  // A monotonic time, for the durations of phases.
+  static std::uint64_t NowNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void AddGemm(int rows, int depth, int cols, int threads) {
+    gemms_.fetch_add(1, std::memory_order_relaxed);
+    macs_.fetch_add(static_cast<std::uint64_t>(rows) * depth * cols,
+                    std::memory_order_relaxed);
+    threads_used_.fetch_add(threads, std::memory_order_relaxed);
+    int max_threads = max_threads_used_.load(std::memory_order_relaxed);
+    while (threads > max_threads &&
+           !max_threads_used_.compare_exchange_weak(
+               max_threads, threads, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Adds the time from the given start time to now to a phase.
+  void AddPhaseSince(PerfPhase phase, std::uint64_t start_ns) {
+    phase_ns_[static_cast<int>(phase)].fetch_add(NowNanoseconds() - start_ns,
+                                                 std::memory_order_relaxed);
+  }
+
+  // Commits the allocator, counting whether its storage had to grow.
+  void CommitAllocator(Allocator* allocator) {
+    const std::size_t growths = allocator->growths();
+    allocator->Commit();
+    if (allocator->growths() != growths) {
+      allocator_growths_.fetch_add(allocator->growths() - growths,
+                                   std::memory_order_relaxed);
+    }
+  }
+
+  // Returns the counters. Counters updated while this is called may be
+  // read either before or after the update, independently of each other.
+  PerfCounters Snapshot() const {
+    PerfCounters counters;
+    counters.gemms = gemms_.load(std::memory_order_relaxed);
+    counters.macs = macs_.load(std::memory_order_relaxed);
+    counters.pack_lhs_seconds = PhaseSeconds(PerfPhase::PackLhs);
+    counters.pack_rhs_seconds = PhaseSeconds(PerfPhase::PackRhs);
+    counters.compute_seconds = PhaseSeconds(PerfPhase::Compute);
+    counters.unpack_seconds = PhaseSeconds(PerfPhase::Unpack);
+    counters.pool_wait_seconds = PhaseSeconds(PerfPhase::PoolWait);
+    counters.threads_used = threads_used_.load(std::memory_order_relaxed);
+    counters.max_threads_used =
+        max_threads_used_.load(std::memory_order_relaxed);
+    counters.allocator_growths =
+        allocator_growths_.load(std::memory_order_relaxed);
+    return counters;
+  }
+
+  // Sets the listener to the phases of Gemms updating these counters. It
+  // is not owned, and must only be changed while no such Gemm runs. The
+  // default value nullptr means no listener.
+  void set_phase_listener(PerfPhaseListener* listener) {
+    phase_listener_ = listener;
+  }
+  PerfPhaseListener* phase_listener() const { return phase_listener_; }
+
+  void Reset() {
+    gemms_.store(0, std::memory_order_relaxed);
+    macs_.store(0, std::memory_order_relaxed);
+    for (auto& ns : phase_ns_) {
+      ns.store(0, std::memory_order_relaxed);
+    }
+    threads_used_.store(0, std::memory_order_relaxed);
+    max_threads_used_.store(0, std::memory_order_relaxed);
+    allocator_growths_.store(0, std::memory_order_relaxed);
+  }
+
+ private:
+  double PhaseSeconds(PerfPhase phase) const {
+    return 1e-9 *
+           phase_ns_[static_cast<int>(phase)].load(std::memory_order_relaxed);
+  }
+
+  std::atomic<std::uint64_t> gemms_;
+  std::atomic<std::uint64_t> macs_;
+  std::atomic<std::uint64_t> phase_ns_[static_cast<int>(PerfPhase::Count)];
+  std::atomic<std::uint64_t> threads_used_;
+  std::atomic<int> max_threads_used_;
+  std::atomic<std::uint64_t> allocator_growths_;
+  PerfPhaseListener* phase_listener_ = nullptr;
+#else
+  static std::uint64_t NowNanoseconds() { return 0; }
+  void AddGemm(int, int, int, int) {}
+  void AddPhaseSince(PerfPhase, std::uint64_t) {}
+  void CommitAllocator(Allocator* allocator) { allocator->Commit(); }
+  PerfCounters Snapshot() const { return PerfCounters(); }
+  void Reset() {}
+  void set_phase_listener(PerfPhaseListener*) {}
+  PerfPhaseListener* phase_listener() const { return nullptr; }
+#endif
+};
+
+// Adds the time spent in its scope to a phase.
+class ScopedPerfPhase {
+ public:
+  // The listener, if any, is called outside of the timed scope.
+  ScopedPerfPhase(PerfCounterSet* counters, PerfPhase phase)
+      : counters_(counters),
+        phase_(phase),
+        listener_(counters->phase_listener()) {
+    if (listener_) {
+      listener_->PhaseBegin(phase_);
+    }
+    start_ns_ = PerfCounterSet::NowNanoseconds();
+  }
+  ~ScopedPerfPhase() {
+    counters_->AddPhaseSince(phase_, start_ns_);
+    if (listener_) {
+      listener_->PhaseEnd(phase_);
+    }
+  }
+
+ private:
+  ScopedPerfPhase(const ScopedPerfPhase&) = delete;
+
+  PerfCounterSet* const counters_;
+  const PerfPhase phase_;
+  PerfPhaseListener* const listener_;
+  std::uint64_t start_ns_;
+};
+
+// A histogram of non-negative integer values, with buckets of bounded
+// relative width: values below kSubBuckets have buckets of their own, and
+// each further power of two is split into kSubBuckets buckets of equal
+// width, so that bucket bounds are within 25% of the values they hold.
+class Histogram {
+ public:
+  static const int kSubBucketBits = 2;
+  static const int kSubBuckets = 1 << kSubBucketBits;
+  static const int kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  Histogram() { Reset(); }
+
+  static int BucketOf(std::uint64_t value) {
+    if (value < kSubBuckets) {
+      return static_cast<int>(value);
+    }
+    int exponent = 0;
+    for (std::uint64_t v = value; v > 1; v >>= 1) {
+      exponent++;
+    }
+    const int shift = exponent - kSubBucketBits;
+    return (shift + 1) * kSubBuckets +
+           static_cast<int>((value >> shift) & (kSubBuckets - 1));
+  }
+
+  // The least value of the given bucket.
+  static std::uint64_t BucketLowerBound(int bucket) {
+    if (bucket < kSubBuckets) {
+      return bucket;
+    }
+    const int shift = bucket / kSubBuckets - 1;
+    return static_cast<std::uint64_t>(kSubBuckets + bucket % kSubBuckets)
+           << shift;
+  }
+
+  void Add(std::uint64_t value) {
+    counts_[BucketOf(value)]++;
+    count_++;
+    sum_ += value;
+    max_ = std::max(max_, value);
+  }
+
+  void Reset() {
+    std::fill(counts_, counts_ + kBuckets, 0);
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+  }
+
+  std::uint64_t count() const { return count_; }
+  std::uint64_t bucket_count(int bucket) const { return counts_[bucket]; }
+  std::uint64_t max() const { return max_; }
+  double mean() const {
+    return count_ ? static_cast<double>(sum_) / count_ : 0;
+  }
+
+  // Returns the lower bound of the bucket holding the value below which
+  // the given fraction of values fall, or 0 if the histogram is empty.
+  std::uint64_t Percentile(double fraction) const {
+    const double rank = fraction * count_;
+    std::uint64_t cumulative = 0;
+    for (int bucket = 0; bucket < kBuckets; bucket++) {
+      cumulative += counts_[bucket];
+      if (cumulative && cumulative >= rank) {
+        return BucketLowerBound(bucket);
+      }
+    }
+    return 0;
+  }
+
+  // A line of the count, mean, max and main percentiles, followed by a
+  // line "lower_bound count" per non-empty bucket.
+  std::string Serialize() const {
+    char line[256];
+    snprintf(line, sizeof(line),
+             "count %llu mean %.1f max %llu p50 %llu p90 %llu p99 %llu\n",
+             static_cast<unsigned long long>(count_), mean(),
+             static_cast<unsigned long long>(max_),
+             static_cast<unsigned long long>(Percentile(0.5)),
+             static_cast<unsigned long long>(Percentile(0.9)),
+             static_cast<unsigned long long>(Percentile(0.99)));
+    std::string text = line;
+    for (int bucket = 0; bucket < kBuckets; bucket++) {
+      if (counts_[bucket]) {
+        snprintf(line, sizeof(line), "%llu %llu\n",
+                 static_cast<unsigned long long>(BucketLowerBound(bucket)),
+                 static_cast<unsigned long long>(counts_[bucket]));
+        text += line;
+      }
+    }
+    return text;
+  }
+
+ private:
+  std::uint64_t counts_[kBuckets];
+  std::uint64_t count_;
+  std::uint64_t sum_;
+  std::uint64_t max_;
+};
+
+// Histograms of the timings of the dispatches of tasks to a workers pool,
+// that is, of its Execute calls: to tell load imbalance between tasks
+// from slow wake-ups of workers, e.g. when their CPUs are busy with other
+// processes.
+struct PoolTelemetry {
+  std::uint64_t dispatches = 0;
+  // Nanoseconds from a worker being given a task to its starting to run
+  // it, once per worker of a dispatch. The dispatching thread, which runs
+  // its tasks right away, has none.
+  Histogram wake_latency_ns;
+  // Nanoseconds that tasks ran for, once per task.
+  Histogram task_time_ns;
+  // Nanoseconds that the threads of a dispatch were idle, once per thread,
+  // the dispatching thread included: from the end of their last task to
+  // the end of the dispatch, when all tasks are done.
+  Histogram idle_time_ns;
+  // For dispatches on several threads, the ratio of the longest time that
+  // a thread was busy running its tasks to the mean one, in percent.
+  Histogram imbalance_percent;
+
+  void Reset() {
+    dispatches = 0;
+    wake_latency_ns.Reset();
+    task_time_ns.Reset();
+    idle_time_ns.Reset();
+    imbalance_percent.Reset();
+  }
+
+  std::string Serialize() const {
+    return "dispatches " + std::to_string(dispatches) +
+           "\nwake_latency_ns " + wake_latency_ns.Serialize() +
+           "task_time_ns " + task_time_ns.Serialize() + "idle_time_ns " +
+           idle_time_ns.Serialize() + "imbalance_percent " +
+           imbalance_percent.Serialize();
+  }
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_PERF_COUNTERS_H_
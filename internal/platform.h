@@ -25,6 +25,22 @@
 #endif
 #include <malloc.h>
 
+#include <atomic>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// On Linux, threads waiting for an atomic variable to change block on it
+// directly with the futex syscall, see FutexWait below.
+#if defined(__linux__) && !defined(GEMMLOWP_NO_FUTEX)
+#define GEMMLOWP_USE_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <climits>
+#endif
+
 #if defined ANDROID || defined __ANDROID__
 #include <android/api-level.h>
 // The 18 here should be 16, but has to be 18 for now due
@@ -105,6 +121,55 @@ inline double real_time_in_seconds() {
 #endif
 }
 
+#endif
+
+// Restricts the calling thread to run on the given CPUs.
+// Returns false if that is not supported or failed.
+inline bool SetCurrentThreadAffinity(const std::vector<int> &cpus) {
+#ifdef __linux__
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &cpu_set);
+  }
+  return sched_setaffinity(0, sizeof(cpu_set), &cpu_set) == 0;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+// Returns the number of CPUs that the calling thread may run on, or 0 if
+// that is not supported or failed.
+inline int GetCurrentThreadAffinityCount() {
+#ifdef __linux__
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+    return 0;
+  }
+  return CPU_COUNT(&cpu_set);
+#else
+  return 0;
+#endif
+}
+
+#ifdef GEMMLOWP_USE_FUTEX
+static_assert(sizeof(std::atomic<int>) == sizeof(int),
+              "futexes need std::atomic<int> to be a plain int");
+
+// Blocks the calling thread as long as *addr == expected_value, until woken
+// by FutexWakeAll. May return spuriously, so callers must re-check *addr.
+inline void FutexWait(std::atomic<int> *addr, int expected_value) {
+  syscall(SYS_futex, reinterpret_cast<int *>(addr), FUTEX_WAIT_PRIVATE,
+          expected_value, nullptr, nullptr, 0);
+}
+
+// Wakes all the threads blocked in FutexWait on addr.
+inline void FutexWakeAll(std::atomic<int> *addr) {
+  syscall(SYS_futex, reinterpret_cast<int *>(addr), FUTEX_WAKE_PRIVATE,
+          INT_MAX, nullptr, nullptr, 0);
+}
 #endif
 } // namespace gemmlowp
 #endif  // GEMMLOWP_INTERNAL_PLATFORM_H_
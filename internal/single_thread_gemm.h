@@ -24,8 +24,12 @@
 #include "../public/map.h"
 #include "allocator.h"
 #include "compute.h"
+#include "cpu_topology.h"
+#include "gemm_recorder.h"
 #include "kernel.h"
 #include "pack.h"
+#include "perf_counters.h"
+#include "tuning_table.h"
 #include "unpack.h"
 
 #ifdef GEMMLOWP_PROFILING_SIZES
@@ -50,15 +54,99 @@ class SingleThreadGemmContext {
   int l2_bytes_to_use() const { return l2_bytes_to_use_; }
   float l2_rhs_factor() const { return l2_rhs_factor_; }
 
+  // Sets the share of the last-level cache, above a private L2 cache, that
+  // each thread can use, see BlockParams::FindL2BlockSizes. The value 0
+  // treats the L2 cache as the last level. The default comes from the
+  // detected caches, like those of the L1 and L2 budgets, see
+  // DefaultLlcBytesToUse.
+  void set_llc_bytes_to_use(int n) { llc_bytes_to_use_ = n; }
+  int llc_bytes_to_use() const { return llc_bytes_to_use_; }
+
+  // Caps the scratch memory that each Gemm grows allocators to, across all
+  // threads, by using smaller L2 blocks, see BlockParams::Init. Storage
+  // kept from earlier Gemms is not counted. The default value 0 means no
+  // cap.
+  void set_max_scratch_bytes(std::size_t n) { max_scratch_bytes_ = n; }
+  std::size_t max_scratch_bytes() const { return max_scratch_bytes_; }
+
+  // Sets a table of settings tuned per Gemm shape, see tuning_table.h,
+  // which take precedence over the settings above for the shapes that it
+  // covers. The table is not owned, and must outlive its use by the
+  // context. The default value nullptr means no table.
+  void set_tuning_table(const TuningTable* table) { tuning_table_ = table; }
+  const TuningTable* tuning_table() const { return tuning_table_; }
+
+  // Returns the settings to use for a Gemm of the given shape: those of the
+  // tuning table if it has an entry for that shape, else those of the
+  // context, with no additional limit on threads.
+  TunedParams tuned_params(int rows, int depth, int cols) const {
+    if (tuning_table_) {
+      if (const TunedParams* params =
+              tuning_table_->Find(rows, depth, cols)) {
+        return *params;
+      }
+    }
+    TunedParams params;
+    params.l1_bytes_to_use = l1_bytes_to_use_;
+    params.l2_bytes_to_use = l2_bytes_to_use_;
+    params.l2_rhs_factor = l2_rhs_factor_;
+    params.max_num_threads = 0;
+    params.llc_bytes_to_use = llc_bytes_to_use_;
+    return params;
+  }
+
+  // Returns the counters of the Gemms run on this context since it was
+  // created or since the last call to ResetPerfCounters, see
+  // perf_counters.h.
+  PerfCounters perf_counters() const { return perf_counter_set_->Snapshot(); }
+  void ResetPerfCounters() { perf_counter_set_->Reset(); }
+
+  // The counters that Gemms run on this context update: its own, unless
+  // set to other ones, as asynchronous Gemms update those of the context
+  // that issued them. The value nullptr reverts to the context's own.
+  void set_perf_counter_set(PerfCounterSet* counters) {
+    perf_counter_set_ = counters ? counters : &own_perf_counter_set_;
+  }
+  PerfCounterSet* perf_counter_set() const { return perf_counter_set_; }
+
+  // Sets a recorder of the Gemms run on this context, see gemm_recorder.h.
+  // The recorder is not owned, and must outlive its use by the context.
+  // The default value nullptr records nothing.
+  void set_gemm_recorder(GemmRecorder* recorder) { gemm_recorder_ = recorder; }
+  GemmRecorder* gemm_recorder() const { return gemm_recorder_; }
+
  protected:
   Allocator allocator_;
 
   // The cache configurationt to use.
-  int l1_bytes_to_use_ = kDefaultL1CacheSize;
-  int l2_bytes_to_use_ = kDefaultL2CacheSize;
+  int l1_bytes_to_use_ = DefaultL1BytesToUse();
+  int l2_bytes_to_use_ = DefaultL2BytesToUse();
+  int llc_bytes_to_use_ = DefaultLlcBytesToUse();
   float l2_rhs_factor_ = kDefaultL2RhsFactor;
+
+  // The cap on scratch memory, see set_max_scratch_bytes.
+  std::size_t max_scratch_bytes_ = 0;
+
+  // The tuning table, see set_tuning_table.
+  const TuningTable* tuning_table_ = nullptr;
+
+  // See set_perf_counter_set.
+  PerfCounterSet own_perf_counter_set_;
+  PerfCounterSet* perf_counter_set_ = &own_perf_counter_set_;
+
+  // See set_gemm_recorder.
+  GemmRecorder* gemm_recorder_ = nullptr;
 };
 
+// The scratch memory that SingleThreadGemm needs with the given
+// BlockParams, that is, the storage that its allocator grows to.
+inline std::size_t SingleThreadGemmScratchBytes(
+    const BlockParams& block_params) {
+  return RoundUpToPowerOfTwo(PackedLhsBytes(block_params) +
+                             PackedRhsBytes(block_params) +
+                             PackedResultBytes(block_params));
+}
+
 template <typename KernelFormat, typename InputScalar, typename OutputScalar,
           typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
           MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
@@ -70,7 +158,9 @@ void SingleThreadGemm(SingleThreadGemmContext* context,
                       MatrixMap<OutputScalar, ResultOrder>* result,
                       const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
                       const OutputPipelineType& output_pipeline) {
-  ScopedProfilingLabel label("gemmlowp::SingleThreadGemm");
+  ScopedProfilingLabel label(
+      "gemmlowp::SingleThreadGemm",
+      TraceArgs(result->rows(), lhs.cols(), result->cols()));
 
   assert(lhs.cols() == rhs.rows());
 
@@ -87,30 +177,43 @@ void SingleThreadGemm(SingleThreadGemmContext* context,
   assert(rows >= cols);
 
   Allocator* allocator = context->allocator();
+  PerfCounterSet* perf_counters = context->perf_counter_set();
+  perf_counters->AddGemm(rows, depth, cols, 1);
 
+  const TunedParams tuned = context->tuned_params(rows, depth, cols);
   BlockParams block_params;
-  block_params.Init<KernelFormat>(rows, cols, depth, 1,
-                                  context->l1_bytes_to_use(),
-                                  context->l2_bytes_to_use(),
-                                  context->l2_rhs_factor());
+  block_params.Init<KernelFormat>(
+      rows, cols, depth, 1, tuned.l1_bytes_to_use, tuned.l2_bytes_to_use,
+      tuned.llc_bytes_to_use, tuned.l2_rhs_factor,
+      context->max_scratch_bytes(), SingleThreadGemmScratchBytes);
 
 #ifdef GEMMLOWP_PROFILING_SIZES
-  // Using a static map of label strings. Not reentrant at all!
+  // A static map of label strings, shared by all threads. Labels are never
+  // removed, and unordered_map never moves its elements, so their strings
+  // can be used after the lock is released.
+  static Mutex labels_mutex;
   static std::unordered_map<std::uint64_t, std::string> labels_map;
   std::uint64_t sizes_hash = static_cast<std::uint64_t>(rows) ^
                              (static_cast<std::uint64_t>(depth) << 16) ^
                              (static_cast<std::uint64_t>(cols) << 32);
-  if (!labels_map.count(sizes_hash)) {
-    char label[256];
-    snprintf(label, sizeof(label),
-             "(rows = %d, depth = %d, cols = %d, l2_rows = %d, l2_depth = %d, "
-             "l2_cols = %d, l1_rows = %d, l1_depth = %d, l1_cols = %d)",
-             rows, depth, cols, block_params.l2_rows, block_params.l2_depth,
-             block_params.l2_cols, block_params.l1_rows, block_params.l1_depth,
-             block_params.l1_cols);
-    labels_map[sizes_hash] = label;
+  const char* size_label_str;
+  {
+    ScopedLock sl(&labels_mutex);
+    std::string& size_label_entry = labels_map[sizes_hash];
+    if (size_label_entry.empty()) {
+      char label[256];
+      snprintf(label, sizeof(label),
+               "(rows = %d, depth = %d, cols = %d, l2_rows = %d, "
+               "l2_depth = %d, l2_cols = %d, l1_rows = %d, l1_depth = %d, "
+               "l1_cols = %d)",
+               rows, depth, cols, block_params.l2_rows, block_params.l2_depth,
+               block_params.l2_cols, block_params.l1_rows,
+               block_params.l1_depth, block_params.l1_cols);
+      size_label_entry = label;
+    }
+    size_label_str = size_label_entry.c_str();
   }
-  ScopedProfilingLabel size_label(labels_map[sizes_hash].c_str());
+  ScopedProfilingLabel size_label(size_label_str);
 #endif
 
   PackedSideBlock<typename KernelFormat::Lhs> packed_lhs(Side::Lhs, allocator,
@@ -120,29 +223,38 @@ void SingleThreadGemm(SingleThreadGemmContext* context,
 
   PackedResult packed_result(allocator, block_params);
 
-  allocator->Commit();
+  perf_counters->CommitAllocator(allocator);
 
   const bool pack_rhs_once = block_params.l2_cols >= cols;
 
   if (pack_rhs_once) {
+    ScopedPerfPhase phase(perf_counters, PerfPhase::PackRhs);
     PackRhs(&packed_rhs, rhs);
   }
 
   for (int r = 0; r < rows; r += block_params.l2_rows) {
     int rs = std::min(block_params.l2_rows, rows - r);
 
-    PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
+    {
+      ScopedPerfPhase phase(perf_counters, PerfPhase::PackLhs);
+      PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
+    }
 
     for (int c = 0; c < cols; c += block_params.l2_cols) {
       int cs = std::min(block_params.l2_cols, cols - c);
 
       if (!pack_rhs_once) {
+        ScopedPerfPhase phase(perf_counters, PerfPhase::PackRhs);
         PackRhs(&packed_rhs, rhs.block(0, c, depth, cs));
       }
 
-      Compute(kernel, block_params, &packed_result, packed_lhs, packed_rhs,
-              depth);
+      {
+        ScopedPerfPhase phase(perf_counters, PerfPhase::Compute);
+        Compute(kernel, block_params, &packed_result, packed_lhs, packed_rhs,
+                depth);
+      }
 
+      ScopedPerfPhase phase(perf_counters, PerfPhase::Unpack);
       UnpackResult<KernelFormat>(
           result, MatrixBlockBounds(r, c, rs, cs), packed_result, depth,
           packed_lhs.sums_of_each_slice(), packed_rhs.sums_of_each_slice(),
@@ -0,0 +1,178 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// tuning_table.h: tables of cache budgets and thread counts measured to
+// work best for Gemm shapes on a given machine, as produced offline by
+// test/autotune.cc. A context given such a table (see
+// SingleThreadGemmContext::set_tuning_table) uses its entries instead of
+// its own settings, for the shapes that the table covers.
+//
+// Shapes are grouped into buckets by the power of two below each of their
+// dimensions, so that a table of modest size covers all shapes.
+
+#ifndef GEMMLOWP_INTERNAL_TUNING_TABLE_H_
+#define GEMMLOWP_INTERNAL_TUNING_TABLE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <string>
+
+namespace gemmlowp {
+
+// The settings used for a Gemm, see SingleThreadGemmContext.
+struct TunedParams {
+  int l1_bytes_to_use;
+  int l2_bytes_to_use;
+  float l2_rhs_factor;
+  // The most threads to use, in addition to the limit of the context. The
+  // value 0 means no additional limit.
+  int max_num_threads;
+  // The share of last-level cache of each thread, see
+  // SingleThreadGemmContext::set_llc_bytes_to_use. This is not part of
+  // tables: their entries are tuned with only L2 budgets, and have it at 0.
+  int llc_bytes_to_use;
+};
+
+class TuningTable {
+ public:
+  // The first line of table files, followed by a line per bucket made of
+  // the buckets of rows, depth and cols and of the fields of TunedParams.
+  static const char* header() { return "gemmlowp_tuning_table 1"; }
+
+  // Returns the bucket of a dimension, that is the floor of its base-2
+  // logarithm.
+  static int Bucket(int size) {
+    int bucket = 0;
+    while (size > 1) {
+      size >>= 1;
+      bucket++;
+    }
+    return bucket;
+  }
+
+  // Sets the entry for the bucket of the given shape.
+  void Set(int rows, int depth, int cols, const TunedParams& params) {
+    entries_[Key(Bucket(rows), Bucket(depth), Bucket(cols))] = params;
+  }
+
+  // Returns the entry for the bucket of the given shape, or nullptr if
+  // there is none.
+  const TunedParams* Find(int rows, int depth, int cols) const {
+    const auto it =
+        entries_.find(Key(Bucket(rows), Bucket(depth), Bucket(cols)));
+    return it == entries_.end() ? nullptr : &it->second;
+  }
+
+  std::size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+  void clear() { entries_.clear(); }
+
+  std::string Serialize() const {
+    std::string text = header();
+    text += '\n';
+    for (const auto& entry : entries_) {
+      const TunedParams& params = entry.second;
+      char line[128];
+      snprintf(line, sizeof(line), "%d %d %d %d %d %g %d\n",
+               static_cast<int>(entry.first >> 16),
+               static_cast<int>((entry.first >> 8) & 0xff),
+               static_cast<int>(entry.first & 0xff), params.l1_bytes_to_use,
+               params.l2_bytes_to_use, params.l2_rhs_factor,
+               params.max_num_threads);
+      text += line;
+    }
+    return text;
+  }
+
+  // Replaces the entries with those of a serialized table. Returns false,
+  // leaving the table empty, if the text is malformed.
+  bool Parse(const std::string& text) {
+    clear();
+    std::istringstream stream(text);
+    std::string line;
+    if (!std::getline(stream, line) || line != header()) {
+      return false;
+    }
+    while (std::getline(stream, line)) {
+      if (line.empty()) {
+        continue;
+      }
+      std::istringstream fields(line);
+      int rows_bucket, depth_bucket, cols_bucket;
+      TunedParams params;
+      params.llc_bytes_to_use = 0;
+      std::string extra;
+      if (!(fields >> rows_bucket >> depth_bucket >> cols_bucket >>
+            params.l1_bytes_to_use >> params.l2_bytes_to_use >>
+            params.l2_rhs_factor >> params.max_num_threads) ||
+          (fields >> extra) || !ValidBucket(rows_bucket) ||
+          !ValidBucket(depth_bucket) || !ValidBucket(cols_bucket) ||
+          params.l1_bytes_to_use <= 0 || params.l2_bytes_to_use <= 0 ||
+          !(params.l2_rhs_factor > 0 && params.l2_rhs_factor <= 1) ||
+          params.max_num_threads < 0) {
+        clear();
+        return false;
+      }
+      entries_[Key(rows_bucket, depth_bucket, cols_bucket)] = params;
+    }
+    return true;
+  }
+
+  // Writes the table to a file. Returns false on failure.
+  bool Save(const std::string& path) const {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+      return false;
+    }
+    const std::string text = Serialize();
+    bool success = fwrite(text.data(), 1, text.size(), file) == text.size();
+    success = fclose(file) == 0 && success;
+    return success;
+  }
+
+  // Reads the table from a file, see Parse. Returns false on failure.
+  bool Load(const std::string& path) {
+    clear();
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+      return false;
+    }
+    std::string text;
+    char buf[4096];
+    std::size_t count;
+    while ((count = fread(buf, 1, sizeof(buf), file)) > 0) {
+      text.append(buf, count);
+    }
+    fclose(file);
+    return Parse(text);
+  }
+
+ private:
+  static bool ValidBucket(int bucket) { return bucket >= 0 && bucket < 32; }
+
+  static std::uint32_t Key(int rows_bucket, int depth_bucket,
+                           int cols_bucket) {
+    return (static_cast<std::uint32_t>(rows_bucket) << 16) |
+           (static_cast<std::uint32_t>(depth_bucket) << 8) |
+           static_cast<std::uint32_t>(cols_bucket);
+  }
+
+  std::map<std::uint32_t, TunedParams> entries_;
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_TUNING_TABLE_H_
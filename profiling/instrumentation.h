@@ -17,7 +17,7 @@
 //   ScopedProfilingLabel, RegisterCurrentThreadForProfiling.
 //
 // profiler.h is only needed to drive the profiler:
-//   StartProfiling, FinishProfiling.
+//   StartProfiling, FinishProfiling, StartTracing, FinishTracing.
 //
 // See the usage example in profiler.h.
 
@@ -47,8 +47,11 @@ using ::uintptr_t;
 #include <cstdlib>
 
 #ifdef GEMMLOWP_PROFILING
+#include <atomic>
 #include <cstring>
+#include <ctime>
 #include <set>
+#include <vector>
 #endif
 
 namespace gemmlowp {
@@ -97,6 +100,24 @@ struct ScopedLock {
   Mutex* _m;
 };
 
+// The arguments of the trace events of a label, see StartTracing in
+// profiler.h. Negative values are arguments that don't apply to the label.
+struct TraceArgs {
+  TraceArgs() : rows(-1), depth(-1), cols(-1), task_index(-1) {}
+  TraceArgs(int _rows, int _depth, int _cols, int _task_index = -1)
+      : rows(_rows), depth(_depth), cols(_cols), task_index(_task_index) {}
+
+  int rows;
+  int depth;
+  int cols;
+  int task_index;
+};
+
+// Passed to ScopedProfilingLabel for labels that are sampled but not traced:
+// those around code running for too short a time to be worth a trace event
+// each, like kernel runs.
+struct NotTraced {};
+
 // Profiling definitions. Two paths: when profiling is enabled,
 // and when profiling is disabled.
 #ifdef GEMMLOWP_PROFILING
@@ -147,6 +168,87 @@ static_assert(
     !(sizeof(ProfilingStack) & (sizeof(ProfilingStack) - 1)),
     "ProfilingStack should have power-of-two size to fit in cache lines");
 
+// Whether trace events are being recorded, see StartTracing in profiler.h.
+inline std::atomic<bool>& IsTracing() {
+  static std::atomic<bool> b(false);
+  return b;
+}
+
+inline std::uint64_t TraceTimestampNanoseconds() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return static_cast<std::uint64_t>(t.tv_sec) * 1000000000u + t.tv_nsec;
+}
+
+// The time span of a label on a thread.
+struct TraceEvent {
+  const char* label;
+  std::uint64_t start_ns;
+  std::uint64_t end_ns;
+  TraceArgs args;
+};
+
+// The trace events of a thread, in a ring buffer: only that thread writes
+// to it, without locking, overwriting its oldest events once it is full.
+class TraceBuffer {
+ public:
+  static const std::size_t kCapacity = 1 << 14;
+
+  explicit TraceBuffer(int thread_index)
+      : thread_index_(thread_index),
+        thread_exited_(false),
+        count_(0),
+        events_(kCapacity) {}
+
+  // The index of the thread, in order of their first trace event.
+  int thread_index() const { return thread_index_; }
+
+  bool thread_exited() const { return thread_exited_.load(); }
+  void set_thread_exited() { thread_exited_.store(true); }
+
+  // Called only by the thread owning this buffer.
+  void Record(const TraceEvent& event) {
+    const std::size_t count = count_.load(std::memory_order_relaxed);
+    events_[count & (kCapacity - 1)] = event;
+    count_.store(count + 1, std::memory_order_release);
+  }
+
+  // Appends the events still in the buffer to dst, oldest first. May be
+  // called from any thread: events that the owning thread overwrites while
+  // they are being copied are dropped.
+  void ReadEvents(std::vector<TraceEvent>* dst) const {
+    const std::size_t count = count_.load(std::memory_order_acquire);
+    const std::size_t first = count > kCapacity ? count - kCapacity : 0;
+    const std::size_t dst_size = dst->size();
+    for (std::size_t i = first; i < count; i++) {
+      dst->push_back(events_[i & (kCapacity - 1)]);
+    }
+    // The event at index count_after may be being written, over the one
+    // at index count_after - kCapacity.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const std::size_t count_after = count_.load(std::memory_order_relaxed);
+    if (count_after + 1 > first + kCapacity) {
+      const std::size_t overwritten =
+          std::min(count_after + 1 - kCapacity - first, count - first);
+      dst->erase(dst->begin() + dst_size,
+                 dst->begin() + dst_size + overwritten);
+    }
+  }
+
+ private:
+  const int thread_index_;
+  std::atomic<bool> thread_exited_;
+  std::atomic<std::size_t> count_;
+  std::vector<TraceEvent> events_;
+};
+
+// The trace buffers of all threads that recorded trace events, including
+// threads that exited since. Guarded by GlobalMutexes::Profiler().
+inline std::vector<TraceBuffer*>& TraceBuffers() {
+  static std::vector<TraceBuffer*> v;
+  return v;
+}
+
 struct ThreadInfo;
 
 // The global set of threads being profiled.
@@ -159,18 +261,35 @@ struct ThreadInfo {
   pthread_key_t key;  // used only to get a callback at thread exit.
   ProfilingStack stack;
 
-  ThreadInfo() {
+  // Created on the first trace event of the thread. Owned by
+  // TraceBuffers(), so that events outlive the thread.
+  TraceBuffer* trace_buffer;
+
+  ThreadInfo() : trace_buffer(nullptr) {
     pthread_key_create(&key, ThreadExitCallback);
     pthread_setspecific(key, this);
     stack.lock = new Mutex();
   }
 
+  TraceBuffer* GetTraceBuffer() {
+    if (!trace_buffer) {
+      ScopedLock sl(GlobalMutexes::Profiler());
+      static int threads_count = 0;
+      trace_buffer = new TraceBuffer(threads_count++);
+      TraceBuffers().push_back(trace_buffer);
+    }
+    return trace_buffer;
+  }
+
   static void ThreadExitCallback(void* ptr) {
     ScopedLock sl(GlobalMutexes::Profiler());
     ThreadInfo* self = static_cast<ThreadInfo*>(ptr);
     ThreadsUnderProfiling().erase(self);
     pthread_key_delete(self->key);
     delete self->stack.lock;
+    if (self->trace_buffer) {
+      self->trace_buffer->set_thread_exited();
+    }
   }
 };
 
@@ -199,18 +318,67 @@ inline ThreadInfo& ThreadLocalThreadInfo() {
 // samples will then be annotated with this label, while it is in scope
 // (whence the name --- also known as RAII).
 // See the example in profiler.h.
+//
+// While tracing, each label also records a trace event with the given
+// arguments, unless constructed with NotTraced.
 class ScopedProfilingLabel {
-  ProfilingStack* profiling_stack_;
+  ThreadInfo* thread_info_;
+  const char* label_;
+  TraceArgs trace_args_;
+  bool traced_;
+  std::uint64_t trace_start_ns_;
+
+  void StartTraceEvent() {
+    trace_start_ns_ = traced_ && IsTracing().load(std::memory_order_relaxed)
+                          ? TraceTimestampNanoseconds()
+                          : 0;
+  }
+
+  void EndTraceEvent() {
+    if (trace_start_ns_) {
+      TraceEvent event;
+      event.label = label_;
+      event.start_ns = trace_start_ns_;
+      event.end_ns = TraceTimestampNanoseconds();
+      event.args = trace_args_;
+      thread_info_->GetTraceBuffer()->Record(event);
+    }
+  }
 
  public:
   explicit ScopedProfilingLabel(const char* label)
-      : profiling_stack_(&ThreadLocalThreadInfo().stack) {
-    profiling_stack_->Push(label);
+      : ScopedProfilingLabel(label, TraceArgs()) {}
+
+  ScopedProfilingLabel(const char* label, const TraceArgs& trace_args)
+      : thread_info_(&ThreadLocalThreadInfo()),
+        label_(label),
+        trace_args_(trace_args),
+        traced_(true) {
+    thread_info_->stack.Push(label);
+    StartTraceEvent();
   }
 
-  ~ScopedProfilingLabel() { profiling_stack_->Pop(); }
+  ScopedProfilingLabel(const char* label, NotTraced)
+      : thread_info_(&ThreadLocalThreadInfo()),
+        label_(label),
+        traced_(false),
+        trace_start_ns_(0) {
+    thread_info_->stack.Push(label);
+  }
 
-  void Update(const char* new_label) { profiling_stack_->UpdateTop(new_label); }
+  ~ScopedProfilingLabel() {
+    EndTraceEvent();
+    thread_info_->stack.Pop();
+  }
+
+  // Ends the trace event of the previous label, if any, and starts one for
+  // the new label.
+  void Update(const char* new_label) {
+    thread_info_->stack.UpdateTop(new_label);
+    EndTraceEvent();
+    label_ = new_label;
+    StartTraceEvent();
+  }
 };
 
 // To be called once on each thread to be profiled.
@@ -226,6 +394,8 @@ inline void RegisterCurrentThreadForProfiling() {
 // it has zero runtime overhead when profiling is disabled.
 struct ScopedProfilingLabel {
   explicit ScopedProfilingLabel(const char*) {}
+  ScopedProfilingLabel(const char*, const TraceArgs&) {}
+  ScopedProfilingLabel(const char*, NotTraced) {}
   void Update(const char*) {}
 };
 
@@ -139,6 +139,28 @@
 //
 // 80% WorkerFunc
 // 20% MainFunc
+//
+// Tracing
+// =======
+//
+// Samples show where time goes on average, but not how it is spread over
+// time and threads: stragglers, idle gaps, and how tasks interleave. For
+// that, StartTracing() and FinishTracing() record a trace event for each
+// ScopedProfilingLabel that ends in between, on every thread, registered or
+// not. Each event holds the start and end times of the label, and the Gemm
+// shape and task index given to the label, if any. WriteChromeTrace() then
+// writes them in the JSON format of chrome://tracing and of Perfetto
+// (https://ui.perfetto.dev):
+/*
+    StartTracing();
+    Foo();
+    FinishTracing();
+    SaveChromeTrace("/tmp/foo.json");
+*/
+// Threads record events into ring buffers of their own, without locking,
+// which keep the last TraceBuffer::kCapacity events of each thread. Labels
+// around code too short to trace at low overhead, like kernel runs, are
+// constructed with NotTraced. Tracing may be used with or without sampling.
 
 #ifndef GEMMLOWP_PROFILING_PROFILER_H_
 #define GEMMLOWP_PROFILING_PROFILER_H_
@@ -147,6 +169,8 @@
 #error Profiling is not enabled!
 #endif
 
+#include <cstdio>
+#include <string>
 #include <vector>
 
 #include "instrumentation.h"
@@ -368,6 +392,123 @@ inline void FinishProfiling() {
   IsProfiling() = false;  // yikes, this should be guarded by the lock!
 }
 
+// The time at which tracing started, see StartTracing.
+inline std::uint64_t& TracingStartNanoseconds() {
+  static std::uint64_t t;
+  return t;
+}
+
+// Starts recording trace events, dropping those of earlier traces.
+inline void StartTracing() {
+  ScopedLock sl(GlobalMutexes::Profiler());
+  ReleaseBuildAssertion(!IsTracing().load(), "We're already tracing!");
+  // Events of earlier traces are not erased from the buffers, which only
+  // their threads write to, but are told apart by their start times. The
+  // buffers of threads that exited are no longer needed.
+  std::vector<TraceBuffer*>& buffers = TraceBuffers();
+  std::vector<TraceBuffer*> live_buffers;
+  for (auto buffer : buffers) {
+    if (buffer->thread_exited()) {
+      delete buffer;
+    } else {
+      live_buffers.push_back(buffer);
+    }
+  }
+  buffers.swap(live_buffers);
+  TracingStartNanoseconds() = TraceTimestampNanoseconds();
+  IsTracing().store(true);
+}
+
+// Stops recording trace events. Labels that were entered while tracing
+// still record their events when they end.
+inline void FinishTracing() {
+  ScopedLock sl(GlobalMutexes::Profiler());
+  ReleaseBuildAssertion(IsTracing().load(), "We weren't tracing!");
+  IsTracing().store(false);
+}
+
+// Writes a string as a JSON string literal.
+inline void WriteJsonString(FILE* file, const char* str) {
+  fputc('"', file);
+  for (const char* c = str; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(file, "\\%c", *c);
+    } else if (static_cast<unsigned char>(*c) < 0x20) {
+      fprintf(file, "\\u%04x", *c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+// Writes the events of the last trace as a Chrome trace: a JSON array of
+// complete ("X") events, with times in microseconds since StartTracing,
+// and of thread name metadata events. Should be called after
+// FinishTracing, once the traced code has returned.
+inline void WriteChromeTrace(FILE* file) {
+  ScopedLock sl(GlobalMutexes::Profiler());
+  const std::uint64_t start_ns = TracingStartNanoseconds();
+  const char* separator = "";
+  fprintf(file, "[");
+  std::vector<TraceEvent> events;
+  for (auto buffer : TraceBuffers()) {
+    events.clear();
+    buffer->ReadEvents(&events);
+    bool any_events = false;
+    for (const TraceEvent& event : events) {
+      if (event.start_ns < start_ns) {
+        continue;
+      }
+      any_events = true;
+      fprintf(file, "%s\n{\"name\":", separator);
+      separator = ",";
+      WriteJsonString(file, event.label);
+      fprintf(file,
+              ",\"cat\":\"gemmlowp\",\"ph\":\"X\",\"ts\":%.3f,"
+              "\"dur\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{"
+              "\"thread\":%d",
+              (event.start_ns - start_ns) * 1e-3,
+              (event.end_ns - event.start_ns) * 1e-3, buffer->thread_index(),
+              buffer->thread_index());
+      const TraceArgs& args = event.args;
+      if (args.rows >= 0) {
+        fprintf(file, ",\"rows\":%d", args.rows);
+      }
+      if (args.depth >= 0) {
+        fprintf(file, ",\"depth\":%d", args.depth);
+      }
+      if (args.cols >= 0) {
+        fprintf(file, ",\"cols\":%d", args.cols);
+      }
+      if (args.task_index >= 0) {
+        fprintf(file, ",\"task\":%d", args.task_index);
+      }
+      fprintf(file, "}}");
+    }
+    if (any_events) {
+      fprintf(file,
+              "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+              "\"tid\":%d,\"args\":{\"name\":\"gemmlowp thread %d\"}}",
+              separator, buffer->thread_index(), buffer->thread_index());
+      separator = ",";
+    }
+  }
+  fprintf(file, "\n]\n");
+}
+
+// Writes the events of the last trace to a file, see WriteChromeTrace.
+// Returns false on failure.
+inline bool SaveChromeTrace(const std::string& path) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (!file) {
+    return false;
+  }
+  WriteChromeTrace(file);
+  const bool success = !ferror(file);
+  return fclose(file) == 0 && success;
+}
+
 }  // namespace gemmlowp
 
 #endif  // GEMMLOWP_PROFILING_PROFILER_H_
@@ -16,6 +16,10 @@
 
 #ifndef GEMMLOWP_PUBLIC_GEMMLOWP_H_
 #define GEMMLOWP_PUBLIC_GEMMLOWP_H_
+#include <tuple>
+#include <vector>
+
+#include "../internal/async_gemm.h"
 #include "../internal/dispatch_gemm_shape.h"
 #include "bit_depth.h"
 #include "map.h"
@@ -23,7 +27,134 @@
 
 namespace gemmlowp {
 
-class GemmContext : public MultiThreadGemmContext {};
+class GemmContext : public MultiThreadGemmContext {
+ public:
+  // Prepares this context for Gemms of up to the given size with the
+  // given bit depths, so that the first one runs as fast as later ones:
+  // creates the worker threads that they would use, and allocates their
+  // buffers, writing to them if prefault is true so that the OS maps their
+  // pages now. Call this after changing the threading and cache settings.
+  template <typename BitDepthParams = DefaultL8R8BitDepthParams>
+  void Prewarm(int max_rows, int max_depth, int max_cols,
+               bool prefault = true) {
+    if (max_rows <= 0 || max_depth <= 0 || max_cols <= 0) {
+      return;
+    }
+    // Like DispatchGemmShape, which transposes Gemms with fewer rows than
+    // columns.
+    if (max_rows < max_cols) {
+      std::swap(max_rows, max_cols);
+    }
+    typedef typename DefaultKernel<BitDepthParams>::Format KernelFormat;
+    PrewarmMultiThreadGemm<KernelFormat>(this, max_rows, max_depth, max_cols,
+                                         prefault);
+  }
+
+  // Measures the costs from which Gemms choose how many threads to use (see
+  // set_thread_cost_model) with the threads and the cache settings of this
+  // context, and sets them. This takes a fraction of a second, so it is
+  // meant to be done once at startup; the model may also be saved, and
+  // loaded on later starts, see ThreadCostModel. Returns false, leaving the
+  // model unchanged, if the measurements are inconsistent, e.g. on a busy
+  // machine.
+  //
+  // The measurements run on a scratch context set up like this one, so
+  // they show in neither the counters nor the telemetry of this context,
+  // nor in its Gemm recorder.
+  template <typename BitDepthParams = DefaultL8R8BitDepthParams>
+  bool CalibrateCostModel() {
+    MultiThreadGemmContext scratch_context;
+    MultiThreadGemmSettings(*this).ApplyTo(&scratch_context);
+    scratch_context.set_perf_counter_set(nullptr);
+    scratch_context.set_gemm_recorder(nullptr);
+    scratch_context.workers_pool()->set_placement(
+        workers_pool()->placement());
+
+    ThreadCostModel model;
+    model.dispatch_seconds_per_thread = MeasureDispatchSeconds(
+        &scratch_context,
+        std::max(2, GetAvailableConcurrency(max_num_threads())));
+
+    // A cubic Gemm, mostly computing, and a matrix*vector one, mostly
+    // packing its LHS, on one thread and regardless of the tuning table.
+    scratch_context.set_max_num_threads(1);
+    scratch_context.set_tuning_table(nullptr);
+    const int kCubicSize = 256;
+    const int kVectorSize = 1024;
+    const double cubic_seconds = MeasureGemmSeconds<BitDepthParams>(
+        &scratch_context, kCubicSize, kCubicSize, kCubicSize);
+    const double vector_seconds = MeasureGemmSeconds<BitDepthParams>(
+        &scratch_context, kVectorSize, kVectorSize, 1);
+
+    const double cubic_macs = 1. * kCubicSize * kCubicSize * kCubicSize;
+    const double cubic_pack_bytes = 2. * kCubicSize * kCubicSize;
+    const double vector_macs = 1. * kVectorSize * kVectorSize;
+    const double vector_pack_bytes = vector_macs + kVectorSize;
+    if (!model.FitRates(cubic_macs, cubic_pack_bytes, cubic_seconds,
+                        vector_macs, vector_pack_bytes, vector_seconds) ||
+        !model.calibrated()) {
+      return false;
+    }
+    set_thread_cost_model(model);
+    return true;
+  }
+
+  // Hides MultiThreadGemmContext::TrimMemory() to also stop the idle
+  // asynchronous Gemm lanes, freeing their memory, see
+  // AsyncGemmLanes::TrimMemory.
+  void TrimMemory() {
+    MultiThreadGemmContext::TrimMemory();
+    async_gemm_lanes_.TrimMemory();
+  }
+
+  // The lanes running asynchronous Gemms started on this context, see
+  // GemmAsync.
+  AsyncGemmLanes* async_gemm_lanes() { return &async_gemm_lanes_; }
+
+ private:
+  // Returns the fastest time of a Gemm of the given shape with raw int32
+  // results on the given context, over a few measurements, see
+  // CalibrateCostModel.
+  template <typename BitDepthParams>
+  static double MeasureGemmSeconds(MultiThreadGemmContext* context, int rows,
+                                   int depth, int cols) {
+    std::vector<std::uint8_t> lhs_data(rows * depth, 128);
+    std::vector<std::uint8_t> rhs_data(depth * cols, 128);
+    std::vector<std::int32_t> result_data(rows * cols);
+    const MatrixMap<const std::uint8_t, MapOrder::RowMajor> lhs(
+        lhs_data.data(), rows, depth);
+    const MatrixMap<const std::uint8_t, MapOrder::ColMajor> rhs(
+        rhs_data.data(), depth, cols);
+    MatrixMap<std::int32_t, MapOrder::ColMajor> result(result_data.data(),
+                                                       rows, cols);
+    const VectorDup<const std::int32_t, VectorShape::Col> lhs_offset(-128,
+                                                                     rows);
+    const VectorDup<const std::int32_t, VectorShape::Row> rhs_offset(-128,
+                                                                     cols);
+    auto gemm = [&]() {
+      DispatchGemmShape<std::uint8_t, std::int32_t, BitDepthParams>(
+          context, lhs, rhs, &result, lhs_offset, rhs_offset, std::tuple<>());
+    };
+    gemm();
+    const double kMeasurementSecs = 0.01;
+    double best = 0;
+    for (int pass = 0; pass < 3; pass++) {
+      const double time_start = real_time_in_seconds();
+      double t = time_start;
+      int iters = 0;
+      while (t - time_start < kMeasurementSecs) {
+        gemm();
+        iters++;
+        t = real_time_in_seconds();
+      }
+      const double seconds = (t - time_start) / iters;
+      best = pass ? std::min(best, seconds) : seconds;
+    }
+    return best;
+  }
+
+  AsyncGemmLanes async_gemm_lanes_;
+};
 
 // Computes a general matrix product ("GEMM").
 // This is a version that supports per channel quantization.
@@ -82,6 +213,61 @@ void Gemm(GemmContextType* context,
       MakeStandardOutputPipeline(result_offset, result_mult_int, result_shift));
 }
 
+// Starts computing a general matrix product ("GEMM") like
+// GemmWithOutputPipeline, on another thread, and returns a handle to poll
+// or wait for its completion. If given, the callback is called on that
+// thread once the result is written, before the handle reports completion.
+//
+// lhs, rhs and result are only views: the matrices they map must stay
+// valid, and the operands unchanged, until completion. The output pipeline
+// is copied.
+//
+// Several asynchronous Gemms may be in flight on one context. Each runs on
+// a lane thread, as the master thread of the Gemm, with the settings that
+// the context had when it was started, except for affinity settings.
+// Lanes are reused from one Gemm to the next; beyond a maximum number of
+// them, Gemms wait for a lane in the order they were started, see
+// AsyncGemmLanes::set_max_lanes. Unless the context has a
+// SharedWorkersPool, the lanes share one of their own, so that Gemms in
+// flight together don't oversubscribe the CPUs. Like synchronous Gemms,
+// asynchronous Gemms must be started from a single thread at a time.
+// Destroying the context waits for those in flight, queued ones included.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename OutputPipelineType>
+GemmHandle GemmWithOutputPipelineAsync(
+    GemmContext* context, const MatrixMap<const InputScalar, LhsOrder>& lhs,
+    const MatrixMap<const InputScalar, RhsOrder>& rhs,
+    MatrixMap<OutputScalar, ResultOrder>* result, int lhs_offset,
+    int rhs_offset, const OutputPipelineType& output_pipeline,
+    const std::function<void()>& callback = nullptr) {
+  std::shared_ptr<AsyncGemmState> state(new AsyncGemmState);
+  state->callback = callback;
+  context->async_gemm_lanes()->Start(
+      new AsyncGemmTask<InputScalar, OutputScalar, BitDepthParams, LhsOrder,
+                        RhsOrder, ResultOrder, OutputPipelineType>(
+          MultiThreadGemmSettings(*context), lhs, rhs, *result, lhs_offset,
+          rhs_offset, output_pipeline, state));
+  return GemmHandle(state);
+}
+
+// Starts computing a general matrix product ("GEMM") like Gemm, on another
+// thread. See GemmWithOutputPipelineAsync.
+template <typename Scalar, typename BitDepthParams, MapOrder LhsOrder,
+          MapOrder RhsOrder, MapOrder ResultOrder>
+GemmHandle GemmAsync(GemmContext* context,
+                     const MatrixMap<const Scalar, LhsOrder>& lhs,
+                     const MatrixMap<const Scalar, RhsOrder>& rhs,
+                     MatrixMap<Scalar, ResultOrder>* result, int lhs_offset,
+                     int rhs_offset, int result_offset, int result_mult_int,
+                     int result_shift,
+                     const std::function<void()>& callback = nullptr) {
+  return GemmWithOutputPipelineAsync<Scalar, Scalar, BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset, rhs_offset,
+      MakeStandardOutputPipeline(result_offset, result_mult_int, result_shift),
+      callback);
+}
+
 }  // namespace gemmlowp
 
 #endif  // GEMMLOWP_PUBLIC_GEMMLOWP_H_
@@ -0,0 +1,259 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// autotune.cc: measures the cache budgets and thread counts that work best
+// for a corpus of Gemm shapes on the current machine, and writes them as a
+// tuning table (see internal/tuning_table.h) for contexts to load.
+//
+// Usage: autotune output_table [shapes_file]
+//
+// The shapes file has a line "rows depth cols" per shape. Without it, an
+// assortment of cubic and flat shapes is used. Shapes in the same bucket of
+// the table are tuned together, on the sum of their latencies.
+//
+// Settings are tuned one at a time, in the order threads, L2 budget, RHS
+// factor, L1 budget, each time keeping the best value found so far for the
+// others. Buckets where the tuned settings are not measurably faster than
+// the defaults get no entry, so that the table stays small.
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "../internal/tuning_table.h"
+#include "test.h"
+
+namespace gemmlowp {
+
+// Minimum duration of each measurement.
+const double kMeasurementSecs = 0.05;
+
+// Number of measurements of each setting, keeping the fastest.
+const int kPasses = 3;
+
+// How much faster than the defaults tuned settings must be to be recorded.
+const double kMinSpeedup = 1.03;
+
+struct Shape {
+  int rows, depth, cols;
+};
+
+// The operands and result of a Gemm of a given shape.
+struct Operands {
+  explicit Operands(const Shape& shape)
+      : lhs(shape.rows, shape.depth),
+        rhs(shape.depth, shape.cols),
+        result(shape.rows, shape.cols) {
+    MakeConstant(&lhs, 128);
+    MakeConstant(&rhs, 128);
+  }
+
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs;
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs;
+  Matrix<std::uint8_t, MapOrder::ColMajor> result;
+};
+
+// Returns the latency, in seconds, of a Gemm with the given settings.
+double Measure(GemmContext* context, Operands* operands,
+               const TunedParams& params) {
+  context->set_max_num_threads(params.max_num_threads);
+  context->set_l1_bytes_to_use(params.l1_bytes_to_use);
+  context->set_l2_bytes_to_use(params.l2_bytes_to_use);
+  context->set_l2_rhs_factor(params.l2_rhs_factor);
+  context->set_llc_bytes_to_use(params.llc_bytes_to_use);
+  auto gemm = [context, operands]() {
+    Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+        context, operands->lhs.const_map(), operands->rhs.const_map(),
+        &operands->result.map(), -128, -128, 128, 1, 16);
+  };
+  gemm();
+  double best = 0;
+  for (int pass = 0; pass < kPasses; pass++) {
+    const double time_start = real_time_in_seconds();
+    double t = time_start;
+    int iters = 0;
+    int iters_at_a_time = 1;
+    while (t - time_start < kMeasurementSecs) {
+      for (int i = 0; i < iters_at_a_time; i++) {
+        gemm();
+        iters++;
+      }
+      iters_at_a_time *= 2;
+      t = real_time_in_seconds();
+    }
+    const double latency = (t - time_start) / iters;
+    best = pass ? std::min(best, latency) : latency;
+  }
+  return best;
+}
+
+// Returns the sum of the latencies of the shapes of a bucket.
+double MeasureBucket(GemmContext* context,
+                     std::vector<std::unique_ptr<Operands>>* bucket,
+                     const TunedParams& params) {
+  double latency = 0;
+  for (auto& operands : *bucket) {
+    latency += Measure(context, operands.get(), params);
+  }
+  return latency;
+}
+
+// Tunes one setting of params, trying each of the given values.
+template <typename ValueType>
+void TuneSetting(GemmContext* context,
+                 std::vector<std::unique_ptr<Operands>>* bucket,
+                 ValueType TunedParams::*setting,
+                 const std::vector<ValueType>& values, TunedParams* params,
+                 double* latency) {
+  for (ValueType value : values) {
+    if (value == (*params).*setting) {
+      continue;
+    }
+    TunedParams candidate = *params;
+    candidate.*setting = value;
+    const double candidate_latency = MeasureBucket(context, bucket, candidate);
+    if (candidate_latency < *latency) {
+      *params = candidate;
+      *latency = candidate_latency;
+    }
+  }
+}
+
+std::vector<Shape> DefaultShapes() {
+  std::vector<Shape> shapes;
+  for (int size = 16; size <= 1024; size *= 2) {
+    shapes.push_back(Shape{size, size, size});
+  }
+  // Flat shapes, typical of fully-connected layers and of convolutions.
+  for (int cols = 1; cols <= 16; cols *= 4) {
+    shapes.push_back(Shape{1024, 1024, cols});
+    shapes.push_back(Shape{256, 2048, cols});
+  }
+  shapes.push_back(Shape{64, 576, 3136});
+  shapes.push_back(Shape{128, 1152, 784});
+  shapes.push_back(Shape{256, 2304, 196});
+  return shapes;
+}
+
+bool ReadShapes(const char* path, std::vector<Shape>* shapes) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return false;
+  }
+  Shape shape;
+  while (fscanf(file, "%d %d %d", &shape.rows, &shape.depth, &shape.cols) ==
+         3) {
+    if (shape.rows > 0 && shape.depth > 0 && shape.cols > 0) {
+      shapes->push_back(shape);
+    }
+  }
+  fclose(file);
+  return !shapes->empty();
+}
+
+int autotune(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s output_table [shapes_file]\n", argv[0]);
+    return 1;
+  }
+  std::vector<Shape> shapes;
+  if (argc > 2) {
+    if (!ReadShapes(argv[2], &shapes)) {
+      fprintf(stderr, "Failed to read shapes from %s\n", argv[2]);
+      return 1;
+    }
+  } else {
+    shapes = DefaultShapes();
+  }
+
+  // Group the shapes by bucket. Gemms are run with rows >= cols (see
+  // DispatchGemmShape), so that is how shapes are looked up in the table.
+  std::map<std::vector<int>, std::vector<Shape>> buckets;
+  for (Shape shape : shapes) {
+    if (shape.rows < shape.cols) {
+      std::swap(shape.rows, shape.cols);
+    }
+    buckets[{TuningTable::Bucket(shape.rows), TuningTable::Bucket(shape.depth),
+             TuningTable::Bucket(shape.cols)}]
+        .push_back(shape);
+  }
+
+  std::vector<int> threads;
+  const int available_cpus = GetAvailableCpus();
+  for (int n = 1; n < available_cpus; n *= 2) {
+    threads.push_back(n);
+  }
+  threads.push_back(available_cpus);
+  const std::vector<int> l2_sizes = {128 * 1024,  256 * 1024,  512 * 1024,
+                                     1024 * 1024, 2048 * 1024, 4096 * 1024};
+  const std::vector<float> rhs_factors = {0.5f, 0.75f, 0.9f};
+  const std::vector<int> l1_sizes = {16 * 1024, 32 * 1024, 64 * 1024};
+
+  GemmContext context;
+  TuningTable table;
+  for (const auto& entry : buckets) {
+    const Shape& first = entry.second[0];
+    std::vector<std::unique_ptr<Operands>> bucket;
+    for (const Shape& shape : entry.second) {
+      bucket.emplace_back(new Operands(shape));
+    }
+
+    TunedParams params;
+    params.l1_bytes_to_use = DefaultL1BytesToUse();
+    params.l2_bytes_to_use = DefaultL2BytesToUse();
+    params.l2_rhs_factor = kDefaultL2RhsFactor;
+    params.max_num_threads = available_cpus;
+    params.llc_bytes_to_use = DefaultLlcBytesToUse();
+    const double default_latency = MeasureBucket(&context, &bucket, params);
+    // Entries are tuned with only L2 budgets, see TunedParams.
+    params.llc_bytes_to_use = 0;
+    double latency = default_latency;
+    TuneSetting(&context, &bucket, &TunedParams::max_num_threads, threads,
+                &params, &latency);
+    TuneSetting(&context, &bucket, &TunedParams::l2_bytes_to_use, l2_sizes,
+                &params, &latency);
+    TuneSetting(&context, &bucket, &TunedParams::l2_rhs_factor, rhs_factors,
+                &params, &latency);
+    TuneSetting(&context, &bucket, &TunedParams::l1_bytes_to_use, l1_sizes,
+                &params, &latency);
+
+    const double speedup = default_latency / latency;
+    fprintf(stderr,
+            "rows=%d depth=%d cols=%d (%d shapes): threads=%d l1=%d l2=%d "
+            "rhs_factor=%g, speedup %.3f\n",
+            first.rows, first.depth, first.cols,
+            static_cast<int>(bucket.size()), params.max_num_threads,
+            params.l1_bytes_to_use, params.l2_bytes_to_use,
+            params.l2_rhs_factor, speedup);
+    if (speedup >= kMinSpeedup) {
+      if (params.max_num_threads == available_cpus) {
+        params.max_num_threads = 0;
+      }
+      table.Set(first.rows, first.depth, first.cols, params);
+    }
+  }
+
+  if (!table.Save(argv[1])) {
+    fprintf(stderr, "Failed to write %s\n", argv[1]);
+    return 1;
+  }
+  printf("Wrote %d entries to %s\n", static_cast<int>(table.size()), argv[1]);
+  return 0;
+}
+
+}  // end namespace gemmlowp
+
+int main(int argc, char* argv[]) { return gemmlowp::autotune(argc, argv); }
@@ -21,6 +21,7 @@
 #include <ctime>
 #include <iostream>
 #include <map>
+#include <string>
 #include <vector>
 #ifdef __APPLE__
 #include <TargetConditionals.h>
@@ -28,6 +29,18 @@
 
 #include "test.h"
 
+#ifdef GEMMLOWP_TEST_PERF_EVENTS
+#ifndef __linux__
+#error GEMMLOWP_TEST_PERF_EVENTS requires Linux
+#endif
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#endif
+
 #ifndef GEMMLOWP_TEST_BIT_DEPTH_PARAMS
 #define GEMMLOWP_TEST_BIT_DEPTH_PARAMS DefaultL8R8BitDepthParams
 #endif
@@ -138,9 +151,194 @@ double gflops_for_gemms(GemmContext* context,
   return 1e-9 * ops / time_per_iter;
 }
 
-void benchmark(GemmContext* context) {
-  std::map<gemm_t, std::vector<double>> benchmark_results;
+#ifdef GEMMLOWP_TEST_PERF_EVENTS
+// Hardware performance counters, read around each phase of Gemms on the
+// threads running them, see PerfPhaseListener. Only user-space events are
+// counted, which perf_event_paranoid allows unprivileged processes to count
+// when it is at most 2.
+
+struct perf_event_t {
+  const char* name;
+  std::uint32_t type;
+  std::uint64_t config;
+};
+
+const std::uint64_t perf_cache_read_miss =
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+const perf_event_t perf_events[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1D misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | perf_cache_read_miss},
+    {"LLC misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_LL | perf_cache_read_miss},
+    {"dTLB misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_DTLB | perf_cache_read_miss},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+const int num_perf_events = sizeof(perf_events) / sizeof(perf_events[0]);
+
+// Opens a counter of the calling thread, returning -1 on failure.
+int open_perf_event(const perf_event_t& event) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// The counters of a thread, opened on first use. Events that the CPU does
+// not support stay closed, and count nothing.
+struct thread_perf_events_t {
+  thread_perf_events_t() {
+    for (int e = 0; e < num_perf_events; e++) {
+      fds[e] = open_perf_event(perf_events[e]);
+    }
+  }
+  ~thread_perf_events_t() {
+    for (int e = 0; e < num_perf_events; e++) {
+      if (fds[e] >= 0) {
+        close(fds[e]);
+      }
+    }
+  }
+
+  // Reads the counters, scaled up to make up for the time they were not
+  // running because the CPU had more events to count than counters.
+  void read_counts(double* counts) const {
+    for (int e = 0; e < num_perf_events; e++) {
+      std::uint64_t values[3] = {0, 0, 0};
+      counts[e] = 0;
+      if (fds[e] >= 0 && read(fds[e], values, sizeof(values)) ==
+                             static_cast<ssize_t>(sizeof(values)) &&
+          values[2] > 0) {
+        counts[e] = static_cast<double>(values[0]) * values[1] / values[2];
+      }
+    }
+  }
+
+  int fds[num_perf_events];
+  double phase_start_counts[num_perf_events];
+};
 
+thread_perf_events_t* thread_perf_events() {
+  static thread_local thread_perf_events_t events;
+  return &events;
+}
+
+// Accumulates the counts of each phase over all threads.
+class perf_events_listener : public PerfPhaseListener {
+ public:
+  static const int num_phases = static_cast<int>(PerfPhase::Count);
+
+  perf_events_listener() {
+    for (auto& phase_counts : counts_) {
+      for (auto& count : phase_counts) {
+        count.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void PhaseBegin(PerfPhase) override {
+    thread_perf_events_t* events = thread_perf_events();
+    events->read_counts(events->phase_start_counts);
+  }
+
+  void PhaseEnd(PerfPhase phase) override {
+    thread_perf_events_t* events = thread_perf_events();
+    double end_counts[num_perf_events];
+    events->read_counts(end_counts);
+    for (int e = 0; e < num_perf_events; e++) {
+      const double delta = end_counts[e] - events->phase_start_counts[e];
+      if (delta > 0) {
+        counts_[static_cast<int>(phase)][e].fetch_add(
+            static_cast<std::uint64_t>(delta), std::memory_order_relaxed);
+      }
+    }
+  }
+
+  double count(int phase, int event) const {
+    return counts_[phase][event].load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<std::uint64_t> counts_[num_phases][num_perf_events];
+};
+
+// Returns whether this process can count the cycles of its threads.
+bool perf_events_available() {
+  const int fd = open_perf_event(perf_events[0]);
+  if (fd < 0) {
+    std::cout << "Hardware performance counters unavailable: "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+void print_perf_event_counts(const char* phase_name, const double* counts,
+                             double macs) {
+  printf("  %-10s %14.0f %14.0f %6.2f", phase_name, counts[0], counts[1],
+         counts[0] > 0 ? counts[1] / counts[0] : 0.);
+  for (int e = 2; e < num_perf_events; e++) {
+    printf(" %17.3e", counts[e] / macs);
+  }
+  printf("\n");
+}
+
+// Runs the Gemms of the given shape as time_for_gemms does, counting
+// hardware events in each phase, and prints the counts, the instructions
+// per cycle, and the misses per multiply-accumulate.
+void print_perf_events_for_gemm(GemmContext* context, const gemm_t& gemm) {
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+
+  perf_events_listener listener;
+  PerfCounterSet* perf_counters = context->perf_counter_set();
+  const std::uint64_t macs_before = perf_counters->Snapshot().macs;
+  perf_counters->set_phase_listener(&listener);
+  time_for_gemms<LhsType, RhsType, ResultType>(context,
+                                               std::vector<gemm_t>(1, gemm));
+  perf_counters->set_phase_listener(nullptr);
+  const double macs = perf_counters->Snapshot().macs - macs_before;
+  if (macs == 0) {
+    return;
+  }
+
+  const char* phase_names[] = {"pack LHS", "pack RHS", "compute", "unpack",
+                               "pool wait"};
+  printf("%dx%dx%d, per phase over all threads:\n", gemm.rows, gemm.depth,
+         gemm.cols);
+  printf("  %-10s %14s %14s %6s", "phase", perf_events[0].name,
+         perf_events[1].name, "IPC");
+  for (int e = 2; e < num_perf_events; e++) {
+    printf(" %17s", (std::string(perf_events[e].name) + "/MAC").c_str());
+  }
+  printf("\n");
+  double total_counts[num_perf_events] = {};
+  for (int p = 0; p < perf_events_listener::num_phases; p++) {
+    double counts[num_perf_events];
+    for (int e = 0; e < num_perf_events; e++) {
+      counts[e] = listener.count(p, e);
+      total_counts[e] += counts[e];
+    }
+    print_perf_event_counts(phase_names[p], counts, macs);
+  }
+  print_perf_event_counts("total", total_counts, macs);
+}
+#endif
+
+// The shapes that benchmark() measures.
+std::vector<gemm_t> standard_benchmark_gemms() {
   std::vector<gemm_t> benchmark_gemms;
   benchmark_gemms.emplace_back(10, 10, 10);
   benchmark_gemms.emplace_back(20, 20, 20);
@@ -156,6 +354,13 @@ void benchmark(GemmContext* context) {
   benchmark_gemms.emplace_back(1000, 1000, 10);
   benchmark_gemms.emplace_back(1000, 1000, 100);
   benchmark_gemms.emplace_back(1000, 1000, 1000);
+  return benchmark_gemms;
+}
+
+void benchmark(GemmContext* context) {
+  std::map<gemm_t, std::vector<double>> benchmark_results;
+
+  const std::vector<gemm_t> benchmark_gemms = standard_benchmark_gemms();
 
   const int repeat = 2;
 
@@ -199,6 +404,118 @@ void benchmark(GemmContext* context) {
               << " : " << b.second.back() << " GFlops/s" << std::endl;
   }
   std::cout << std::endl;
+
+#ifdef GEMMLOWP_TEST_PERF_EVENTS
+  if (perf_events_available()) {
+    for (auto gemm : benchmark_gemms) {
+      print_perf_events_for_gemm(context, gemm);
+    }
+    std::cout << std::endl;
+  }
+#endif
+}
+
+// Latency distributions: the latency of each call is recorded, rather than
+// the mean latency of many calls, to show tail latencies.
+
+// Each latency distribution comes from at least this many calls, taking at
+// least min_accurate_duration in total, unless recording it takes longer
+// than max_latency_duration, including cache flushes.
+const int min_latency_calls = 100;
+const double max_latency_duration = 2.0;
+
+// Writing this much memory evicts operands from the caches of the calling
+// thread's core and from the last-level cache. Other cores keep whatever
+// their private caches hold.
+const std::size_t cache_flush_size = 64 * 1024 * 1024;
+
+void flush_caches() {
+  static std::vector<std::uint8_t> flush_buffer(cache_flush_size);
+  for (std::size_t i = 0; i < flush_buffer.size(); i += 64) {
+    flush_buffer[i]++;
+  }
+}
+
+std::uint64_t nanoseconds_since(double starttime) {
+  return static_cast<std::uint64_t>(1e9 *
+                                    (real_time_in_seconds() - starttime));
+}
+
+// Records the latencies of calls to a Gemm of the given shape, always on
+// the same operands. With cold_cache, caches are flushed before each call.
+void record_latencies(GemmContext* context, const gemm_t& gemm,
+                      bool cold_cache, Histogram* latencies_ns) {
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(gemm.rows, gemm.depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(gemm.depth, gemm.cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> result(gemm.rows, gemm.cols);
+  MakeConstant(&lhs, 0);
+  MakeConstant(&rhs, 0);
+
+  // Warm-up, not recorded.
+  Gemm<std::uint8_t, GEMMLOWP_TEST_BIT_DEPTH_PARAMS>(
+      context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+      74980, 123, 20);
+
+  const double recording_starttime = real_time_in_seconds();
+  double total_duration = 0;
+  while ((latencies_ns->count() < min_latency_calls ||
+          total_duration < min_accurate_duration) &&
+         real_time_in_seconds() - recording_starttime < max_latency_duration) {
+    if (cold_cache) {
+      flush_caches();
+    }
+    const double starttime = real_time_in_seconds();
+    Gemm<std::uint8_t, GEMMLOWP_TEST_BIT_DEPTH_PARAMS>(
+        context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+        74980, 123, 20);
+    const std::uint64_t latency_ns = nanoseconds_since(starttime);
+    latencies_ns->Add(latency_ns);
+    total_duration += 1e-9 * latency_ns;
+  }
+}
+
+void print_latencies(const char* name, const Histogram& latencies_ns) {
+  printf("  %-12s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+         static_cast<unsigned long long>(latencies_ns.count()),
+         1e-3 * latencies_ns.mean(), 1e-3 * latencies_ns.Percentile(0.5),
+         1e-3 * latencies_ns.Percentile(0.9),
+         1e-3 * latencies_ns.Percentile(0.99), 1e-3 * latencies_ns.max());
+}
+
+// Prints, for each shape, the latency of the first call on a new context,
+// which includes starting worker threads and allocating scratch memory,
+// and the distributions of the latencies of later calls with cold and warm
+// caches. Percentiles are the lower bounds of histogram buckets, which are
+// within 25% of the latencies they hold, see Histogram.
+void benchmark_latency(int max_num_threads) {
+  for (auto gemm : standard_benchmark_gemms()) {
+    Matrix<std::uint8_t, MapOrder::RowMajor> lhs(gemm.rows, gemm.depth);
+    Matrix<std::uint8_t, MapOrder::ColMajor> rhs(gemm.depth, gemm.cols);
+    Matrix<std::uint8_t, MapOrder::ColMajor> result(gemm.rows, gemm.cols);
+    MakeConstant(&lhs, 0);
+    MakeConstant(&rhs, 0);
+
+    GemmContext context;
+    context.set_max_num_threads(max_num_threads);
+    const double starttime = real_time_in_seconds();
+    Gemm<std::uint8_t, GEMMLOWP_TEST_BIT_DEPTH_PARAMS>(
+        &context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+        74980, 123, 20);
+    const std::uint64_t first_call_ns = nanoseconds_since(starttime);
+
+    Histogram cold_cache_ns;
+    record_latencies(&context, gemm, true, &cold_cache_ns);
+    Histogram warm_cache_ns;
+    record_latencies(&context, gemm, false, &warm_cache_ns);
+
+    printf("%dx%dx%d latency (us):\n", gemm.rows, gemm.depth, gemm.cols);
+    printf("  %-12s %8s %10s %10s %10s %10s %10s\n", "", "calls", "mean",
+           "p50", "p90", "p99", "max");
+    printf("  %-12s %8d %10.1f\n", "first call", 1, 1e-3 * first_call_ns);
+    print_latencies("cold cache", cold_cache_ns);
+    print_latencies("warm cache", warm_cache_ns);
+  }
+  std::cout << std::endl;
 }
 
 void benchmark_gemm_sizes(GemmContext* context,
@@ -326,6 +643,14 @@ void benchmark_small_model(GemmContext* context) {
 }
 
 void benchmark_all() {
+#ifdef GEMMLOWP_TEST_LATENCY
+  std::cout << "Benchmarking multi-threaded latency..." << std::endl;
+  gemmlowp::benchmark_latency(0);
+  std::cout << "Benchmarking single-threaded latency..." << std::endl;
+  gemmlowp::benchmark_latency(1);
+  return;
+#endif
+
   {
     gemmlowp::GemmContext context;
     std::cout << "Benchmarking small model GEMMs..." << std::endl;
@@ -0,0 +1,242 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// benchmark_replay.cc: replays the Gemms recorded by an application (see
+// internal/gemm_recorder.h), in the order they were recorded, to benchmark
+// gemmlowp on the actual mix of Gemms of that application rather than on
+// synthetic shapes.
+//
+// Usage: benchmark_replay records_file [iterations] [threads]
+//
+// All records are replayed once to warm up, then the given number of times
+// (default 10), with at most the given number of threads (default 1, and 0
+// for as many as there are CPUs). The output compares, per distinct Gemm,
+// the mean latency that was recorded to the mean latency of the replays.
+//
+// Operands are random, one set per distinct Gemm, reused across its
+// replays. Gemms with uint8 operands are replayed with their recorded
+// orders and bit depths. Output pipelines are not recorded beyond their
+// length: Gemms with uint8 results are replayed with the standard output
+// pipeline, and Gemms with int32 results with the empty one. Other Gemms
+// are skipped.
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include "test.h"
+
+namespace gemmlowp {
+
+// What distinguishes the Gemms of a record file that are replayed alike.
+typedef std::tuple<int, int, int, MapOrder, MapOrder, MapOrder, int, TypeId>
+    ReplayKey;
+
+ReplayKey KeyOf(const GemmRecord& record) {
+  return ReplayKey(record.rows, record.depth, record.cols, record.lhs_order,
+                   record.rhs_order, record.result_order, record.lhs_min,
+                   record.output_type);
+}
+
+bool IsReplayable(const GemmRecord& record) {
+  return record.input_type == TypeId::Uint8 &&
+         (record.output_type == TypeId::Uint8 ||
+          record.output_type == TypeId::Int32) &&
+         (record.lhs_min == 0 || record.lhs_min == 1) &&
+         record.lhs_max == 255 && record.rhs_min == 0 &&
+         record.rhs_max == 255;
+}
+
+// The operands of a distinct Gemm, and its timings.
+struct ReplayedGemm {
+  explicit ReplayedGemm(const GemmRecord& record)
+      : lhs(record.rows * record.depth),
+        rhs(record.depth * record.cols),
+        uint8_result(record.rows * record.cols),
+        int32_result(record.rows * record.cols) {
+    for (auto& x : lhs) {
+      x = 1 + Random() % 255;
+    }
+    for (auto& x : rhs) {
+      x = Random() % 256;
+    }
+  }
+
+  std::vector<std::uint8_t> lhs;
+  std::vector<std::uint8_t> rhs;
+  std::vector<std::uint8_t> uint8_result;
+  std::vector<std::int32_t> int32_result;
+
+  int recorded_count = 0;
+  double recorded_seconds = 0;
+  int replayed_count = 0;
+  double replayed_seconds = 0;
+};
+
+template <typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
+          MapOrder ResultOrder>
+void ReplayWithParams(GemmContext* context, const GemmRecord& record,
+                      ReplayedGemm* gemm) {
+  const int rows = record.rows;
+  const int depth = record.depth;
+  const int cols = record.cols;
+  MatrixMap<const std::uint8_t, LhsOrder> lhs(gemm->lhs.data(), rows, depth);
+  MatrixMap<const std::uint8_t, RhsOrder> rhs(gemm->rhs.data(), depth, cols);
+  if (record.output_type == TypeId::Uint8) {
+    MatrixMap<std::uint8_t, ResultOrder> result(gemm->uint8_result.data(),
+                                                rows, cols);
+    Gemm<std::uint8_t, BitDepthParams>(context, lhs, rhs, &result, -128, -128,
+                                       128, 1, 16);
+  } else {
+    MatrixMap<std::int32_t, ResultOrder> result(gemm->int32_result.data(),
+                                                rows, cols);
+    GemmWithOutputPipeline<std::uint8_t, std::int32_t, BitDepthParams>(
+        context, lhs, rhs, &result, -128, -128, std::make_tuple());
+  }
+}
+
+template <MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder>
+void ReplayWithOrders(GemmContext* context, const GemmRecord& record,
+                      ReplayedGemm* gemm) {
+  if (record.lhs_min == 1) {
+    ReplayWithParams<L8R8WithLhsNonzeroBitDepthParams, LhsOrder, RhsOrder,
+                     ResultOrder>(context, record, gemm);
+  } else {
+    ReplayWithParams<DefaultL8R8BitDepthParams, LhsOrder, RhsOrder,
+                     ResultOrder>(context, record, gemm);
+  }
+}
+
+template <MapOrder LhsOrder, MapOrder RhsOrder>
+void ReplayWithOperandOrders(GemmContext* context, const GemmRecord& record,
+                             ReplayedGemm* gemm) {
+  if (record.result_order == MapOrder::RowMajor) {
+    ReplayWithOrders<LhsOrder, RhsOrder, MapOrder::RowMajor>(context, record,
+                                                             gemm);
+  } else {
+    ReplayWithOrders<LhsOrder, RhsOrder, MapOrder::ColMajor>(context, record,
+                                                             gemm);
+  }
+}
+
+template <MapOrder LhsOrder>
+void ReplayWithLhsOrder(GemmContext* context, const GemmRecord& record,
+                        ReplayedGemm* gemm) {
+  if (record.rhs_order == MapOrder::RowMajor) {
+    ReplayWithOperandOrders<LhsOrder, MapOrder::RowMajor>(context, record,
+                                                          gemm);
+  } else {
+    ReplayWithOperandOrders<LhsOrder, MapOrder::ColMajor>(context, record,
+                                                          gemm);
+  }
+}
+
+// Runs the Gemm of a record, returning its latency in seconds.
+double Replay(GemmContext* context, const GemmRecord& record,
+              ReplayedGemm* gemm) {
+  const double start = GemmRecorder::NowSeconds();
+  if (record.lhs_order == MapOrder::RowMajor) {
+    ReplayWithLhsOrder<MapOrder::RowMajor>(context, record, gemm);
+  } else {
+    ReplayWithLhsOrder<MapOrder::ColMajor>(context, record, gemm);
+  }
+  return GemmRecorder::NowSeconds() - start;
+}
+
+const char* OrderName(MapOrder order) {
+  return order == MapOrder::RowMajor ? "R" : "C";
+}
+
+void benchmark_replay(const char* records_path, int iterations, int threads) {
+  std::vector<GemmRecord> records;
+  if (!GemmRecorder::Load(records_path, &records)) {
+    fprintf(stderr, "Could not read records from %s\n", records_path);
+    exit(1);
+  }
+
+  std::map<ReplayKey, std::unique_ptr<ReplayedGemm>> gemms;
+  std::vector<std::pair<const GemmRecord*, ReplayedGemm*>> replays;
+  int skipped = 0;
+  for (const GemmRecord& record : records) {
+    if (!IsReplayable(record)) {
+      skipped++;
+      continue;
+    }
+    std::unique_ptr<ReplayedGemm>& gemm = gemms[KeyOf(record)];
+    if (!gemm) {
+      gemm.reset(new ReplayedGemm(record));
+    }
+    gemm->recorded_count++;
+    gemm->recorded_seconds += record.seconds;
+    replays.emplace_back(&record, gemm.get());
+  }
+  printf("%d Gemms recorded, %d distinct, %d skipped as not replayable.\n",
+         static_cast<int>(records.size()), static_cast<int>(gemms.size()),
+         skipped);
+
+  GemmContext context;
+  context.set_max_num_threads(threads);
+  for (const auto& replay : replays) {
+    Replay(&context, *replay.first, replay.second);
+  }
+  for (int i = 0; i < iterations; i++) {
+    for (const auto& replay : replays) {
+      replay.second->replayed_count++;
+      replay.second->replayed_seconds +=
+          Replay(&context, *replay.first, replay.second);
+    }
+  }
+
+  printf("\n%6s %6s %6s %6s %5s %6s %8s %12s %12s\n", "rows", "depth", "cols",
+         "orders", "lhs", "output", "count", "recorded ms", "replayed ms");
+  double recorded_total = 0;
+  double replayed_total = 0;
+  for (const auto& entry : gemms) {
+    const ReplayKey& key = entry.first;
+    const ReplayedGemm& gemm = *entry.second;
+    printf("%6d %6d %6d %2s%2s%2s %5s %6s %8d %12.4f %12.4f\n",
+           std::get<0>(key), std::get<1>(key), std::get<2>(key),
+           OrderName(std::get<3>(key)), OrderName(std::get<4>(key)),
+           OrderName(std::get<5>(key)), std::get<6>(key) ? "1..255" : "0..255",
+           std::get<7>(key) == TypeId::Uint8 ? "u8" : "i32",
+           gemm.recorded_count,
+           1e3 * gemm.recorded_seconds / gemm.recorded_count,
+           1e3 * gemm.replayed_seconds / gemm.replayed_count);
+    recorded_total += gemm.recorded_seconds;
+    replayed_total += gemm.replayed_seconds / iterations;
+  }
+  printf("\nTotal per pass over the records: recorded %.4f ms, "
+         "replayed %.4f ms\n",
+         1e3 * recorded_total, 1e3 * replayed_total);
+}
+
+}  // end namespace gemmlowp
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 4) {
+    fprintf(stderr, "Usage: %s records_file [iterations] [threads]\n",
+            argv[0]);
+    return 1;
+  }
+  const int iterations = argc > 2 ? atoi(argv[2]) : 10;
+  const int threads = argc > 3 ? atoi(argv[3]) : 1;
+  if (iterations <= 0) {
+    fprintf(stderr, "iterations must be positive\n");
+    return 1;
+  }
+  gemmlowp::benchmark_replay(argv[1], iterations, threads);
+}
@@ -15,6 +15,7 @@
 #include "test.h"
 
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
 #include <ctime>
@@ -1105,6 +1106,967 @@ void TestMultithreadedPerChannelQuantization() {
   Check(good);
 }
 
+// Checks that packing a RHS block in parallel over several threads,
+// as done by ParallelPackRhs, yields exactly the same packed data and
+// sums of slices as packing it on a single thread.
+void TestParallelRhsPacking(int depth, int cols, int num_tasks) {
+  typedef KernelFormat<KernelSideFormat<CellFormat<4, 2>, 1>,
+                       KernelSideFormat<CellFormat<4, 2>, 2>>
+      Format;
+  typedef PackedSideBlock<Format::Rhs> PackedRhs;
+
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+
+  BlockParams block_params;
+  block_params.Init<Format>(4, cols, depth, 1, 256, 4096, 1.0f);
+
+  Allocator allocator;
+  PackedRhs serial_packed(Side::Rhs, &allocator, block_params);
+  PackedRhs parallel_packed(Side::Rhs, &allocator, block_params);
+  allocator.Commit();
+
+  const int l2_width = serial_packed.params().l2_width;
+  const int data_size = l2_width * serial_packed.params().l2_depth;
+  memset(serial_packed.current_data(), 0, data_size);
+  memset(parallel_packed.current_data(), 0, data_size);
+  memset(parallel_packed.sums_of_each_slice(), 0,
+         l2_width * sizeof(std::int32_t));
+
+  const int l2_cols = std::min(cols, block_params.l2_cols);
+  const int l2_depth = std::min(depth, block_params.l2_depth);
+  const auto rhs_block = rhs.const_map().block(0, 0, l2_depth, l2_cols);
+  PackRhs(&serial_packed, rhs_block);
+
+  MultiThreadGemmContext context;
+  ParallelPackRhs(context.workers_pool(), &parallel_packed, rhs_block,
+                  num_tasks);
+
+  // Packing advances the current position of the destination block.
+  serial_packed.seek_run(0, 0);
+  parallel_packed.seek_run(0, 0);
+  Check(!memcmp(serial_packed.current_data(), parallel_packed.current_data(),
+                data_size));
+  Check(!memcmp(serial_packed.sums_of_each_slice(),
+                parallel_packed.sums_of_each_slice(),
+                l2_width * sizeof(std::int32_t)));
+
+  allocator.Decommit();
+}
+
+void TestParallelRhsPacking() {
+  TestParallelRhsPacking(16, 8, 2);
+  TestParallelRhsPacking(37, 13, 2);
+  TestParallelRhsPacking(64, 100, 3);
+  TestParallelRhsPacking(100, 61, 4);
+  TestParallelRhsPacking(33, 7, 8);
+  printf("TestParallelRhsPacking: PASS\n");
+}
+
+// Checks that with a last-level cache modeled separately from a private L2
+// cache, RHS blocks are sized for the former, shared by the threads, and
+// LHS blocks for the latter.
+void TestLastLevelCacheBlocking() {
+  typedef KernelFormat<KernelSideFormat<CellFormat<4, 2>, 1>,
+                       KernelSideFormat<CellFormat<4, 2>, 2>>
+      Format;
+  const int rows = 1024;
+  const int depth = 1024;
+  const int cols = 1024;
+  const int threads = 4;
+  const int l2_bytes = 256 * 1024;
+  const int llc_bytes = 1024 * 1024;
+  auto no_budget = [](const BlockParams&) { return std::size_t(0); };
+  BlockParams l2_only;
+  l2_only.Init<Format>(rows, cols, depth, threads, 32 * 1024, l2_bytes, 0,
+                       0.75f, 0, no_budget);
+  BlockParams with_llc;
+  with_llc.Init<Format>(rows, cols, depth, threads, 32 * 1024, l2_bytes,
+                        llc_bytes, 0.75f, 0, no_budget);
+  Check(with_llc.l2_depth * with_llc.l2_cols <= 0.75f * threads * llc_bytes);
+  Check(with_llc.l2_cols > l2_only.l2_cols);
+  const int lhs_and_result_bytes_per_row =
+      with_llc.l2_depth + 4 * with_llc.l2_cols;
+  Check((with_llc.l2_rows - Format::kRows) * lhs_and_result_bytes_per_row <
+        l2_bytes);
+  printf("TestLastLevelCacheBlocking: PASS\n");
+}
+
+// Checks that multi-threaded Gemm's, with and without work stealing, give
+// the same raw int32 accumulators as single-threaded ones, across shapes
+// making for many RHS blocks and many tiles of the result.
+void TestMultithreadedTileScheduling(int rows, int depth, int cols,
+                                     int num_threads, bool work_stealing,
+                                     int numa_nodes = 1) {
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  Matrix<std::int32_t, MapOrder::ColMajor> expected(rows, cols);
+  Matrix<std::int32_t, MapOrder::ColMajor> actual(rows, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  const int lhs_offset = -12;
+  const int rhs_offset = 34;
+  auto empty_pipeline = std::make_tuple();
+
+  GemmContext single_thread_context;
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t, DefaultL8R8BitDepthParams>(
+      &single_thread_context, lhs.const_map(), rhs.const_map(), &expected,
+      lhs_offset, rhs_offset, empty_pipeline);
+
+  GemmContext context;
+  context.set_max_num_threads(num_threads);
+  context.set_work_stealing(work_stealing);
+  if (numa_nodes > 1) {
+    // Simulate a NUMA system with one core per thread, the successive
+    // cores being spread evenly over the nodes. Pinning threads to these
+    // CPUs may fail on this machine, which is harmless.
+    CpuTopology topology;
+    topology.numa_nodes.resize(numa_nodes);
+    for (int cpu = 0; cpu < num_threads; cpu++) {
+      topology.cpus.push_back(cpu);
+      topology.cores.push_back(std::vector<int>(1, cpu));
+      topology.numa_nodes[cpu * numa_nodes / num_threads].push_back(cpu);
+    }
+    context.set_cpu_topology(topology);
+    context.set_affinity(AffinityPolicy::AvoidSmtSiblings);
+    Check(context.numa_nodes_count() == numa_nodes);
+  }
+  // Small L2 blocks, so as to have many RHS blocks.
+  context.set_l2_bytes_to_use(16 * 1024);
+  context.set_llc_bytes_to_use(0);
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t, DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &actual, lhs_offset,
+      rhs_offset, empty_pipeline);
+
+  Check(actual == expected);
+}
+
+void TestMultithreadedTileScheduling() {
+  for (bool work_stealing : {false, true}) {
+    TestMultithreadedTileScheduling(100, 50, 30, 2, work_stealing);
+    TestMultithreadedTileScheduling(256, 200, 250, 3, work_stealing);
+    TestMultithreadedTileScheduling(500, 100, 300, 4, work_stealing);
+    TestMultithreadedTileScheduling(333, 333, 77, 8, work_stealing);
+    // NUMA-aware, on simulated topologies.
+    TestMultithreadedTileScheduling(100, 50, 30, 2, work_stealing, 2);
+    TestMultithreadedTileScheduling(256, 200, 250, 3, work_stealing, 2);
+    TestMultithreadedTileScheduling(500, 100, 300, 8, work_stealing, 4);
+    TestMultithreadedTileScheduling(64, 300, 64, 4, work_stealing, 2);
+    // Fewer threads used than placed, leaving some nodes without tasks.
+    TestMultithreadedTileScheduling(32, 500, 32, 8, work_stealing, 4);
+  }
+  printf("TestMultithreadedTileScheduling: PASS\n");
+}
+
+// The operands of a Gemm and its result on a default, single-threaded
+// context, to check the results of the same Gemm on other contexts.
+struct ReferenceGemm {
+  ReferenceGemm(int rows, int depth, int cols)
+      : lhs(rows, depth),
+        rhs(depth, cols),
+        expected(rows, cols),
+        actual(rows, cols) {
+    MakeRandom<OperandRange<0, 255>>(&lhs);
+    MakeRandom<OperandRange<0, 255>>(&rhs);
+    GemmContext reference_context;
+    Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+        &reference_context, lhs.const_map(), rhs.const_map(), &expected.map(),
+        -75, -91, 74980, 123, 20);
+  }
+
+  // Runs the Gemm on the given context, into actual, and returns whether
+  // it gives the reference result.
+  template <typename GemmContextType>
+  bool RunOn(GemmContextType* context) {
+    Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+        context, lhs.const_map(), rhs.const_map(), &actual.map(), -75, -91,
+        74980, 123, 20);
+    return actual == expected;
+  }
+
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs;
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs;
+  Matrix<std::uint8_t, MapOrder::ColMajor> expected;
+  Matrix<std::uint8_t, MapOrder::ColMajor> actual;
+};
+
+// A workers pool running the tasks given to Execute one after another on
+// the calling thread, as any implementation of workers_pool() may.
+class SequentialWorkersPool {
+ public:
+  void Execute(const std::vector<Task*>& tasks) {
+    for (Task* task : tasks) {
+      task->local_allocator = &allocator_;
+      task->Run();
+      delete task;
+    }
+  }
+
+ private:
+  Allocator allocator_;
+};
+
+class SequentialGemmContext : public MultiThreadGemmContextBase {
+ public:
+  SequentialWorkersPool* workers_pool() { return &workers_pool_; }
+
+ private:
+  SequentialWorkersPool workers_pool_;
+};
+
+// Checks that multi-threaded Gemms, whose tasks pack the RHS for each
+// other, still complete and give the right results when the workers pool
+// runs their tasks one at a time.
+void TestSequentialWorkersPool() {
+  ReferenceGemm gemm(256, 200, 250);
+  for (bool work_stealing : {false, true}) {
+    SequentialGemmContext context;
+    context.set_max_num_threads(4);
+    context.set_work_stealing(work_stealing);
+    // Small L2 blocks, so as to have more RHS blocks than buffers.
+    context.set_l2_bytes_to_use(16 * 1024);
+    context.set_llc_bytes_to_use(0);
+    Check(gemm.RunOn(&context));
+  }
+  printf("TestSequentialWorkersPool: PASS\n");
+}
+
+// A thread running Gemms on its own context, using shared workers, and
+// checking them against precomputed results.
+struct SharedWorkersPoolCaller {
+  static const int kRows = 300;
+  static const int kDepth = 100;
+  static const int kCols = 200;
+  static const int kGemms = 5;
+
+  SharedWorkersPoolCaller()
+      : shared_workers_pool(nullptr),
+        priority(Priority::Normal),
+        gemm(kRows, kDepth, kCols),
+        ok(true) {}
+
+  static void* Run(void* arg) {
+    auto* caller = static_cast<SharedWorkersPoolCaller*>(arg);
+    GemmContext context;
+    context.set_shared_workers_pool(caller->shared_workers_pool);
+    context.set_priority(caller->priority);
+    context.set_max_num_threads(0);
+    for (int i = 0; i < kGemms; i++) {
+      caller->ok = caller->gemm.RunOn(&context) && caller->ok;
+    }
+    return nullptr;
+  }
+
+  SharedWorkersPool* shared_workers_pool;
+  Priority priority;
+  ReferenceGemm gemm;
+  bool ok;
+};
+
+// Runs Gemms of various priorities from more threads than there are shared
+// workers.
+void TestSharedWorkersPool() {
+  SharedWorkersPool shared_workers_pool(3);
+  const int kCallers = 4;
+  const Priority priorities[kCallers] = {Priority::Low, Priority::Normal,
+                                         Priority::High, Priority::Normal};
+  SharedWorkersPoolCaller callers[kCallers];
+  pthread_t threads[kCallers];
+  for (int i = 0; i < kCallers; i++) {
+    callers[i].shared_workers_pool = &shared_workers_pool;
+    callers[i].priority = priorities[i];
+    pthread_create(&threads[i], nullptr, SharedWorkersPoolCaller::Run,
+                   &callers[i]);
+  }
+  for (int i = 0; i < kCallers; i++) {
+    pthread_join(threads[i], nullptr);
+    Check(callers[i].ok);
+  }
+  const int kGemms = SharedWorkersPoolCaller::kGemms;
+  Check(shared_workers_pool.priority_stats(Priority::Low).leases == kGemms);
+  Check(shared_workers_pool.priority_stats(Priority::Normal).leases ==
+        2 * kGemms);
+  Check(shared_workers_pool.priority_stats(Priority::High).leases == kGemms);
+  printf("TestSharedWorkersPool: PASS\n");
+}
+
+// Checks that the workers of a shared pool can all be leased again as soon
+// as the Execute call that leased them returns.
+void TestSharedWorkersPoolReuse() {
+  const int kWorkers = 3;
+  SharedWorkersPool shared_workers_pool(kWorkers);
+  WorkersPool workers_pool;
+  workers_pool.set_shared_workers_pool(&shared_workers_pool);
+  std::vector<NopTask> tasks(kWorkers + 1);
+  for (int i = 0; i < 1000; i++) {
+    Check(workers_pool.ReserveWorkers(kWorkers) == kWorkers);
+    workers_pool.ExecuteUnowned(tasks.data(), kWorkers + 1);
+  }
+  printf("TestSharedWorkersPoolReuse: PASS\n");
+}
+
+// Runs Low priority Gemms of a single L2 block in a loop, until stopped.
+struct LowPriorityLoop {
+  explicit LowPriorityLoop(SharedWorkersPool* _shared_workers_pool)
+      : shared_workers_pool(_shared_workers_pool),
+        gemm(3000, 200, 16),
+        stop(false),
+        ok(true) {}
+
+  static void* Run(void* arg) {
+    auto* loop = static_cast<LowPriorityLoop*>(arg);
+    GemmContext context;
+    context.set_shared_workers_pool(loop->shared_workers_pool);
+    context.set_priority(Priority::Low);
+    context.set_max_num_threads(3);
+    while (!loop->stop.load()) {
+      loop->ok = loop->gemm.RunOn(&context) && loop->ok;
+    }
+    return nullptr;
+  }
+
+  SharedWorkersPool* shared_workers_pool;
+  ReferenceGemm gemm;
+  std::atomic<bool> stop;
+  bool ok;
+};
+
+// Checks that a Normal priority Gemm gets workers lent to a Low priority
+// Gemm of a single L2 block, without waiting for it to finish.
+void TestSharedWorkersPoolYield() {
+  SharedWorkersPool shared_workers_pool(2);
+  LowPriorityLoop loop(&shared_workers_pool);
+  pthread_t thread;
+  pthread_create(&thread, nullptr, LowPriorityLoop::Run, &loop);
+  while (shared_workers_pool.priority_stats(Priority::Low).leases == 0) {
+    sched_yield();
+  }
+
+  ReferenceGemm gemm(300, 100, 200);
+  GemmContext context;
+  context.set_shared_workers_pool(&shared_workers_pool);
+  context.set_max_num_threads(3);
+  for (int i = 0;
+       i < 100 && shared_workers_pool.priority_stats(Priority::Low).yields == 0;
+       i++) {
+    Check(gemm.RunOn(&context));
+  }
+  loop.stop = true;
+  pthread_join(thread, nullptr);
+  Check(loop.ok);
+  Check(shared_workers_pool.priority_stats(Priority::Low).yields > 0);
+  Check(shared_workers_pool.priority_stats(Priority::Normal).workers_granted >
+        0);
+  printf("TestSharedWorkersPoolYield: PASS\n");
+}
+
+// Runs several asynchronous Gemms at once on one context, more than it has
+// lanes for, and checks them against synchronous ones.
+void TestGemmAsync() {
+  const int kGemms = 3;
+  const int rows = 200;
+  const int depth = 150;
+  const int cols = 100;
+  std::vector<Matrix<std::uint8_t, MapOrder::RowMajor>> lhs;
+  std::vector<Matrix<std::uint8_t, MapOrder::ColMajor>> rhs;
+  std::vector<Matrix<std::uint8_t, MapOrder::ColMajor>> expected;
+  std::vector<Matrix<std::uint8_t, MapOrder::ColMajor>> actual;
+  GemmContext context;
+  context.set_max_num_threads(2);
+  for (int i = 0; i < kGemms; i++) {
+    lhs.emplace_back(rows, depth);
+    rhs.emplace_back(depth, cols);
+    expected.emplace_back(rows, cols);
+    actual.emplace_back(rows, cols);
+    MakeRandom<OperandRange<0, 255>>(&lhs[i]);
+    MakeRandom<OperandRange<0, 255>>(&rhs[i]);
+    Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+        &context, lhs[i].const_map(), rhs[i].const_map(), &expected[i].map(),
+        -75, -91, 74980, 123, 20);
+  }
+
+  std::atomic<int> callbacks(0);
+  std::vector<GemmHandle> handles;
+  context.async_gemm_lanes()->set_max_lanes(kGemms - 1);
+  for (int i = 0; i < kGemms; i++) {
+    handles.push_back(GemmAsync<std::uint8_t, DefaultL8R8BitDepthParams>(
+        &context, lhs[i].const_map(), rhs[i].const_map(), &actual[i].map(),
+        -75, -91, 74980, 123, 20, [&callbacks]() { callbacks++; }));
+  }
+  for (int i = 0; i < kGemms; i++) {
+    handles[i].Wait();
+    Check(handles[i].Poll());
+    Check(actual[i] == expected[i]);
+  }
+  Check(callbacks.load() == kGemms);
+  Check(context.async_gemm_lanes()->lanes_count() <= kGemms - 1);
+
+  // Idle lanes are stopped by TrimMemory, and started again as needed.
+  context.TrimMemory();
+  Check(context.async_gemm_lanes()->lanes_count() == 0);
+  GemmHandle handle = GemmAsync<std::uint8_t, DefaultL8R8BitDepthParams>(
+      &context, lhs[0].const_map(), rhs[0].const_map(), &actual[1].map(), -75,
+      -91, 74980, 123, 20);
+  handle.Wait();
+  Check(actual[1] == expected[0]);
+  Check(GemmHandle().Poll());
+
+  printf("TestGemmAsync: PASS\n");
+}
+
+// Checks that Gemms on a prewarmed context, up to and beyond the prewarmed
+// size, still give the right results.
+void TestPrewarm() {
+  for (bool prefault : {false, true}) {
+    GemmContext context;
+    context.set_max_num_threads(3);
+    context.Prewarm(300, 200, 250, prefault);
+    for (int size : {50, 300, 400}) {
+      ReferenceGemm gemm(size, 200, size);
+      Check(gemm.RunOn(&context));
+    }
+  }
+  printf("TestPrewarm: PASS\n");
+}
+
+// Checks that the storage of the given allocator, if backed by huge pages,
+// spans at least one and is aligned on them, as in test_allocator.cc.
+void CheckHugePagesStorage(Allocator* allocator) {
+  if (allocator->huge_pages() == HugePages::None) {
+    return;
+  }
+  Check(allocator->storage_size() >= Allocator::kHugePageSize);
+  auto handle = allocator->Reserve<std::uint8_t>(1);
+  allocator->Commit();
+  Check(!(reinterpret_cast<std::uintptr_t>(
+              allocator->GetPointer<std::uint8_t>(handle)) %
+          Allocator::kHugePageSize));
+  allocator->Decommit();
+}
+
+// Checks that Gemms on a context using huge pages, whether the system
+// provides them or not, still give the right results, and that the context
+// reports what the buffers of its allocators, including those of its
+// workers, got.
+void TestHugePages() {
+  // Large enough for the buffers of each thread to span a huge page.
+  ReferenceGemm gemm(1000, 2000, 500);
+  for (int threads : {1, 3}) {
+    GemmContext context;
+    context.set_max_num_threads(threads);
+    context.set_l2_bytes_to_use(4 * 1024 * 1024);
+    context.set_llc_bytes_to_use(0);
+    context.set_use_huge_pages(true);
+    Check(context.huge_pages() == HugePages::None);
+    Check(gemm.RunOn(&context));
+
+    // The least of what the allocators spanning a huge page got.
+    bool any_large_allocator = false;
+    HugePages least_huge_pages = HugePages::Explicit;
+    context.ForEachAllocator(
+        [&any_large_allocator, &least_huge_pages](Allocator* allocator) {
+          Check(allocator->use_huge_pages());
+          CheckHugePagesStorage(allocator);
+          if (allocator->storage_size() >= Allocator::kHugePageSize) {
+            any_large_allocator = true;
+            least_huge_pages =
+                std::min(least_huge_pages, allocator->huge_pages());
+          }
+        });
+    Check(any_large_allocator);
+    if (threads > 1) {
+      // The allocators of the tasks run by the workers.
+      int large_worker_allocators = 0;
+      context.workers_pool()->ForEachAllocator(
+          [&large_worker_allocators](Allocator* allocator) {
+            if (allocator->storage_size() >= Allocator::kHugePageSize) {
+              large_worker_allocators++;
+            }
+          });
+      Check(large_worker_allocators == threads);
+    }
+    Check(context.huge_pages() == least_huge_pages);
+
+    context.set_use_huge_pages(false);
+    Check(context.huge_pages() == HugePages::None);
+    context.ForEachAllocator([](Allocator* allocator) {
+      Check(!allocator->use_huge_pages());
+      Check(allocator->huge_pages() == HugePages::None);
+    });
+  }
+  printf("TestHugePages: PASS\n");
+}
+
+// A MemoryProvider keeping track of how much memory it has handed out.
+class CountingMemoryProvider : public MemoryProvider {
+ public:
+  CountingMemoryProvider() : bytes_(0), max_bytes_(0) {}
+
+  void* Allocate(std::size_t size, std::size_t alignment) override {
+    const std::size_t bytes = bytes_ += size;
+    std::size_t max_bytes = max_bytes_.load();
+    while (bytes > max_bytes &&
+           !max_bytes_.compare_exchange_weak(max_bytes, bytes)) {
+    }
+    return aligned_alloc(alignment, size);
+  }
+
+  void Free(void* data, std::size_t size) override {
+    bytes_ -= size;
+    aligned_free(data);
+  }
+
+  std::size_t bytes() const { return bytes_.load(); }
+  std::size_t max_bytes() const { return max_bytes_.load(); }
+
+ private:
+  std::atomic<std::size_t> bytes_;
+  std::atomic<std::size_t> max_bytes_;
+};
+
+// Checks that Gemms on a context with a scratch memory budget take their
+// memory from its provider, within that budget, and still give the right
+// results.
+void TestScratchBudget() {
+  const std::size_t kBudget = 256 * 1024;
+  ReferenceGemm gemm(500, 300, 400);
+  for (int threads : {1, 3}) {
+    CountingMemoryProvider memory_provider;
+    {
+      GemmContext context;
+      context.set_max_num_threads(threads);
+      context.set_l2_bytes_to_use(4 * 1024 * 1024);
+      context.set_memory_provider(&memory_provider);
+      context.set_max_scratch_bytes(kBudget);
+      Check(gemm.RunOn(&context));
+      Check(memory_provider.max_bytes() > 0);
+      Check(memory_provider.max_bytes() <= kBudget);
+    }
+    Check(memory_provider.bytes() == 0);
+  }
+  printf("TestScratchBudget: PASS\n");
+}
+
+// Checks that trimming the memory of a context frees its buffers, and
+// that Gemms then allocate them again.
+void TestTrimMemory() {
+  ReferenceGemm gemm(300, 200, 250);
+
+  GemmContext context;
+  context.set_max_num_threads(3);
+  context.set_decay_commits(4);
+  Check(context.scratch_bytes() == 0);
+  for (int i = 0; i < 2; i++) {
+    Check(gemm.RunOn(&context));
+    const std::size_t scratch_bytes = context.scratch_bytes();
+    Check(scratch_bytes > 0);
+    Check(context.high_water_scratch_bytes() >= scratch_bytes);
+    context.TrimMemory();
+    Check(context.scratch_bytes() == 0);
+    Check(context.high_water_scratch_bytes() >= scratch_bytes);
+  }
+  printf("TestTrimMemory: PASS\n");
+}
+
+// Checks that tuning tables round-trip through their text format, and
+// that contexts use their entries for the shapes that they cover.
+void TestTuningTable() {
+  TuningTable table;
+  TunedParams params;
+  params.l1_bytes_to_use = 16 * 1024;
+  params.l2_bytes_to_use = 64 * 1024;
+  params.l2_rhs_factor = 0.5f;
+  params.max_num_threads = 1;
+  params.llc_bytes_to_use = 0;
+  table.Set(500, 300, 400, params);
+  Check(table.Find(511, 256, 300) != nullptr);
+  Check(table.Find(512, 300, 400) == nullptr);
+  Check(table.Find(500, 300, 1000) == nullptr);
+
+  TuningTable parsed;
+  Check(parsed.Parse(table.Serialize()));
+  Check(parsed.size() == 1);
+  const TunedParams* found = parsed.Find(500, 300, 400);
+  Check(found != nullptr);
+  Check(found->l1_bytes_to_use == params.l1_bytes_to_use);
+  Check(found->l2_bytes_to_use == params.l2_bytes_to_use);
+  Check(found->l2_rhs_factor == params.l2_rhs_factor);
+  Check(found->max_num_threads == params.max_num_threads);
+  Check(!parsed.Parse("gemmlowp_tuning_table 1\n8 8 8 0 1 1 0\n"));
+  Check(parsed.empty());
+  Check(!parsed.Parse("8 8 8 1 1 1 0\n"));
+
+  ReferenceGemm gemm(500, 300, 400);
+  // The small L2 budget and the single thread of the table entry show in
+  // the memory used.
+  std::size_t max_bytes[2];
+  for (int use_table = 0; use_table < 2; use_table++) {
+    CountingMemoryProvider memory_provider;
+    GemmContext context;
+    context.set_max_num_threads(3);
+    context.set_l2_bytes_to_use(4 * 1024 * 1024);
+    context.set_memory_provider(&memory_provider);
+    context.set_tuning_table(use_table ? &table : nullptr);
+    Check(gemm.RunOn(&context));
+    max_bytes[use_table] = memory_provider.max_bytes();
+  }
+  Check(max_bytes[1] < max_bytes[0]);
+  printf("TestTuningTable: PASS\n");
+}
+
+// Checks the choices of thread counts of cost models, their round trip
+// through their text format, and that calibrating one gives a model that
+// Gemms run correctly with.
+void TestThreadCostModel() {
+  const int kKernelRows = 4;
+  const ThreadCostModel uncalibrated;
+  Check(!uncalibrated.calibrated());
+  for (int size : {16, 100, 1000}) {
+    Check(HowManyThreads<kKernelRows>(uncalibrated, 4, size, size, size) ==
+          HowManyThreads<kKernelRows>(4, size, size, size));
+  }
+
+  ThreadCostModel model;
+  model.dispatch_seconds_per_thread = 20e-6;
+  model.macs_per_second = 10e9;
+  model.pack_bytes_per_second = 5e9;
+  Check(model.calibrated());
+  // Tiny Gemms are not worth dispatching, large ones use all threads, and
+  // threads get at least a kernel's rows.
+  Check(HowManyThreads<kKernelRows>(model, 8, 32, 32, 32) == 1);
+  Check(HowManyThreads<kKernelRows>(model, 8, 1000, 1000, 1000) == 8);
+  Check(HowManyThreads<kKernelRows>(model, 8, 12, 10000, 10000) == 3);
+  Check(HowManyThreads<kKernelRows>(model, 1, 1000, 1000, 1000) == 1);
+  const int medium = HowManyThreads<kKernelRows>(model, 8, 200, 100, 100);
+  Check(medium > 1 && medium < 8);
+
+  ThreadCostModel parsed;
+  Check(parsed.Parse(model.Serialize()));
+  Check(parsed.calibrated());
+  Check(std::abs(parsed.macs_per_second - model.macs_per_second) <
+        1e-6 * model.macs_per_second);
+  Check(!parsed.Parse("gemmlowp_cost_model 1\n1e-5 0 1e9\n"));
+  Check(!parsed.calibrated());
+
+  ThreadCostModel fitted;
+  Check(fitted.FitRates(1e6, 1e3, 1e6 / 10e9 + 1e3 / 5e9, 1e4, 1e4,
+                        1e4 / 10e9 + 1e4 / 5e9));
+  Check(std::abs(fitted.macs_per_second - 10e9) < 1e3);
+  Check(std::abs(fitted.pack_bytes_per_second - 5e9) < 1e3);
+
+  ReferenceGemm gemm(300, 200, 250);
+  GemmContext context;
+  context.set_max_num_threads(3);
+  if (context.CalibrateCostModel()) {
+    Check(context.thread_cost_model().calibrated());
+  }
+  // The measurements leave the settings and statistics of the context
+  // untouched.
+  Check(context.max_num_threads() == 3);
+  Check(context.perf_counters().gemms == 0);
+  Check(context.pool_telemetry().dispatches == 0);
+  Check(gemm.RunOn(&context));
+  printf("TestThreadCostModel: PASS\n");
+}
+
+// Counts the phases that begin, and those that end on another thread than
+// they began or that did not begin.
+struct PhaseCountingListener : PerfPhaseListener {
+  void PhaseBegin(PerfPhase phase) override {
+    begin_counts[static_cast<int>(phase)]++;
+    if (current_phase() != PerfPhase::Count) {
+      unbalanced++;
+    }
+    current_phase() = phase;
+  }
+  void PhaseEnd(PerfPhase phase) override {
+    if (current_phase() != phase) {
+      unbalanced++;
+    }
+    current_phase() = PerfPhase::Count;
+  }
+  int begins(PerfPhase phase) const {
+    return begin_counts[static_cast<int>(phase)];
+  }
+
+  static PerfPhase& current_phase() {
+    static thread_local PerfPhase phase = PerfPhase::Count;
+    return phase;
+  }
+
+  std::atomic<int> begin_counts[static_cast<int>(PerfPhase::Count)] = {};
+  std::atomic<int> unbalanced{0};
+};
+
+// Checks the counters of contexts across single- and multi-threaded Gemms,
+// and that they are reset.
+void TestPerfCounters() {
+  const int rows = 300;
+  const int depth = 200;
+  const int cols = 250;
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> result(rows, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+
+  GemmContext context;
+  PerfCounters counters = context.perf_counters();
+  Check(counters.gemms == 0);
+  for (int max_num_threads : {1, 3}) {
+    context.set_max_num_threads(max_num_threads);
+    for (int i = 0; i < 2; i++) {
+      Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+          &context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+          74980, 123, 20);
+    }
+  }
+#ifndef GEMMLOWP_NO_PERF_COUNTERS
+  counters = context.perf_counters();
+  Check(counters.gemms == 4);
+  Check(counters.macs == 4ull * rows * depth * cols);
+  Check(counters.pack_lhs_seconds > 0);
+  Check(counters.pack_rhs_seconds > 0);
+  Check(counters.compute_seconds > 0);
+  Check(counters.unpack_seconds > 0);
+  Check(counters.pool_wait_seconds > 0);
+  Check(counters.max_threads_used == 3);
+  Check(counters.threads_used == 2 + 2 * 3);
+  // The allocators grow on the first Gemm on each of them, and only then.
+  Check(counters.allocator_growths > 0);
+  const std::uint64_t allocator_growths = counters.allocator_growths;
+  Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+      74980, 123, 20);
+  Check(context.perf_counters().allocator_growths == allocator_growths);
+
+  // Asynchronous Gemms count in the counters of the context issuing them.
+  GemmAsync<std::uint8_t, DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+      74980, 123, 20)
+      .Wait();
+  Check(context.perf_counters().gemms == 6);
+
+  // Listeners see each phase begin and end on the same thread.
+  PhaseCountingListener listener;
+  context.perf_counter_set()->set_phase_listener(&listener);
+  Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+      74980, 123, 20);
+  context.perf_counter_set()->set_phase_listener(nullptr);
+  Check(listener.begins(PerfPhase::Compute) > 0);
+  Check(listener.begins(PerfPhase::PackLhs) > 0);
+  Check(listener.begins(PerfPhase::PackRhs) > 0);
+  Check(listener.unbalanced == 0);
+#endif
+
+  context.ResetPerfCounters();
+  counters = context.perf_counters();
+  Check(counters.gemms == 0);
+  Check(counters.macs == 0);
+  Check(counters.compute_seconds == 0);
+  Check(counters.pool_wait_seconds == 0);
+  Check(counters.max_threads_used == 0);
+  Check(counters.allocator_growths == 0);
+  printf("TestPerfCounters: PASS\n");
+}
+
+// Checks the buckets of histograms, and the telemetry of the workers pool
+// of a context.
+void TestPoolTelemetry() {
+  for (std::uint64_t value : {0ull, 3ull, 4ull, 7ull, 8ull, 9ull, 1000ull,
+                              123456789ull, ~0ull}) {
+    const int bucket = Histogram::BucketOf(value);
+    Check(bucket < Histogram::kBuckets);
+    Check(Histogram::BucketLowerBound(bucket) <= value);
+    if (bucket + 1 < Histogram::kBuckets) {
+      Check(Histogram::BucketLowerBound(bucket + 1) > value);
+    }
+  }
+  Histogram histogram;
+  for (int i = 1; i <= 100; i++) {
+    histogram.Add(i);
+  }
+  Check(histogram.count() == 100);
+  Check(histogram.max() == 100);
+  Check(histogram.mean() == 50.5);
+  Check(histogram.Percentile(0.5) == 48);
+  Check(histogram.Percentile(1) == 96);
+
+  const int rows = 300;
+  const int depth = 200;
+  const int cols = 250;
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> result(rows, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  GemmContext context;
+  context.set_max_num_threads(3);
+  const int gemms = 3;
+  for (int i = 0; i < gemms; i++) {
+    Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+        &context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+        74980, 123, 20);
+  }
+#ifndef GEMMLOWP_NO_PERF_COUNTERS
+  const PoolTelemetry& telemetry = context.pool_telemetry();
+  Check(telemetry.dispatches == gemms);
+  Check(telemetry.task_time_ns.count() == 3 * gemms);
+  Check(telemetry.wake_latency_ns.count() == 2 * gemms);
+  Check(telemetry.idle_time_ns.count() == 3 * gemms);
+  Check(telemetry.imbalance_percent.count() == gemms);
+  Check(telemetry.imbalance_percent.Percentile(0) >= 96);
+  Check(telemetry.task_time_ns.max() > 0);
+
+  // With a single shared worker, the dispatching thread runs two tasks,
+  // but counts as one thread.
+  SharedWorkersPool shared_workers_pool(1);
+  WorkersPool workers_pool;
+  workers_pool.set_shared_workers_pool(&shared_workers_pool);
+  NopTask tasks[3];
+  workers_pool.ExecuteUnowned(tasks, 3);
+  const PoolTelemetry& shared_telemetry = workers_pool.telemetry();
+  Check(shared_telemetry.dispatches == 1);
+  Check(shared_telemetry.task_time_ns.count() == 3);
+  Check(shared_telemetry.wake_latency_ns.count() == 1);
+  Check(shared_telemetry.idle_time_ns.count() == 2);
+#endif
+  context.ResetPoolTelemetry();
+  Check(context.pool_telemetry().dispatches == 0);
+  Check(context.pool_telemetry().task_time_ns.count() == 0);
+  printf("TestPoolTelemetry: PASS\n");
+}
+
+// A thread recording the same record many times.
+struct GemmRecorderCaller {
+  static const int kRecords = 1000;
+
+  static void* Run(void* arg) {
+    auto* caller = static_cast<GemmRecorderCaller*>(arg);
+    for (int i = 0; i < kRecords; i++) {
+      caller->recorder->Record(caller->record);
+    }
+    return nullptr;
+  }
+
+  GemmRecorder* recorder;
+  GemmRecord record;
+};
+
+// Checks that Gemms are recorded as called, from any thread, and that
+// records survive a round trip through a file.
+void TestGemmRecorder() {
+  const int rows = 30;
+  const int depth = 70;
+  const int cols = 50;
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> result(rows, cols);
+  Matrix<std::int32_t, MapOrder::RowMajor> int32_result(rows, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+
+  GemmRecorder recorder;
+  GemmContext context;
+  context.set_gemm_recorder(&recorder);
+  // Fewer rows than columns, so transposed internally.
+  Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+      74980, 123, 20);
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                         L8R8WithLhsNonzeroBitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &int32_result.map(), -75,
+      -91, std::make_tuple());
+  GemmAsync<std::uint8_t, DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+      74980, 123, 20)
+      .Wait();
+  std::vector<GemmRecord> records = recorder.records();
+  Check(records.size() == 3);
+  for (const GemmRecord& record : records) {
+    Check(record.rows == rows);
+    Check(record.depth == depth);
+    Check(record.cols == cols);
+    Check(record.lhs_order == MapOrder::RowMajor);
+    Check(record.rhs_order == MapOrder::ColMajor);
+    Check(record.input_type == TypeId::Uint8);
+    Check(record.seconds > 0);
+  }
+  Check(records[0].result_order == MapOrder::ColMajor);
+  Check(records[0].output_type == TypeId::Uint8);
+  Check(records[0].output_stages == 2);
+  Check(records[0].lhs_min == 0);
+  Check(records[1].result_order == MapOrder::RowMajor);
+  Check(records[1].output_type == TypeId::Int32);
+  Check(records[1].output_stages == 0);
+  Check(records[1].lhs_min == 1);
+  Check(records[1].lhs_max == 255);
+
+  // Recording from several threads at once loses nothing.
+  recorder.clear();
+  const int kThreads = 4;
+  GemmRecorderCaller callers[kThreads];
+  pthread_t threads[kThreads];
+  for (int i = 0; i < kThreads; i++) {
+    callers[i].recorder = &recorder;
+    callers[i].record = records[0];
+    callers[i].record.rows = i;
+    pthread_create(&threads[i], nullptr, GemmRecorderCaller::Run, &callers[i]);
+  }
+  for (int i = 0; i < kThreads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  const int kRecordsPerThread = GemmRecorderCaller::kRecords;
+  records = recorder.records();
+  Check(records.size() == kThreads * kRecordsPerThread);
+  int records_per_thread[kThreads] = {};
+  for (const GemmRecord& record : records) {
+    records_per_thread[record.rows]++;
+  }
+  for (int t = 0; t < kThreads; t++) {
+    Check(records_per_thread[t] == kRecordsPerThread);
+  }
+
+  GemmRecord parsed;
+  Check(GemmRecorder::Parse(GemmRecorder::Serialize(records[0]), &parsed));
+  Check(parsed.rows == records[0].rows);
+  Check(parsed.result_order == records[0].result_order);
+  Check(parsed.output_type == records[0].output_type);
+  Check(std::abs(parsed.seconds - records[0].seconds) <=
+        1e-8 * records[0].seconds);
+  Check(!GemmRecorder::Parse("30 70 50 R C X 0 255 0 255 u8 u8 2 0.001",
+                             &parsed));
+  Check(!GemmRecorder::Parse("30 70 50 R C C 0 255 0 255 u8 f32 2 0.001",
+                             &parsed));
+  Check(!GemmRecorder::Parse("30 70 50 R C C 0 255 0 255 u8 u8 2", &parsed));
+
+  // Records streamed to a file, and records saved to one, load back.
+  char path[] = "/tmp/gemmlowp_gemm_records_XXXXXX";
+  const int fd = mkstemp(path);
+  Check(fd >= 0);
+  close(fd);
+  recorder.clear();
+  Check(recorder.Open(path));
+  Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &result.map(), -75, -91,
+      74980, 123, 20);
+  recorder.Close();
+  Check(recorder.records().empty());
+  std::vector<GemmRecord> loaded;
+  Check(GemmRecorder::Load(path, &loaded));
+  Check(loaded.size() == 1);
+  Check(loaded[0].rows == rows && loaded[0].cols == cols);
+  recorder.Record(loaded[0]);
+  recorder.Record(loaded[0]);
+  Check(recorder.Save(path));
+  Check(GemmRecorder::Load(path, &loaded));
+  Check(loaded.size() == 2);
+  remove(path);
+  Check(!GemmRecorder::Load(path, &loaded));
+  printf("TestGemmRecorder: PASS\n");
+}
+
 // Runs a small set of hand-calculated data through the implementation.
 void TestWithSmallData() {
   const int m = 4;
@@ -1616,6 +2578,27 @@ void test() {
   TestWithSmallDataPerChannelQuantization();
   TestWithLargeDataPerChannelQuantization();
   TestMultithreadedPerChannelQuantization();
+
+  // Test that packing the RHS on multiple threads matches serial packing.
+  TestParallelRhsPacking();
+  TestLastLevelCacheBlocking();
+
+  // Test the distribution of tiles of the result between threads.
+  TestMultithreadedTileScheduling();
+  TestSequentialWorkersPool();
+  TestSharedWorkersPool();
+  TestSharedWorkersPoolReuse();
+  TestSharedWorkersPoolYield();
+  TestGemmAsync();
+  TestPrewarm();
+  TestHugePages();
+  TestScratchBudget();
+  TestTrimMemory();
+  TestTuningTable();
+  TestThreadCostModel();
+  TestPerfCounters();
+  TestPoolTelemetry();
+  TestGemmRecorder();
 #ifdef GEMMLOWP_TEST_PROFILE
   FinishProfiling();
 #endif
@@ -0,0 +1,125 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// test_allocations.cc: checks that steady-state Gemms allocate no heap
+// memory. It replaces the global operator new and operator delete to count
+// allocations, which is why it is a test program of its own.
+
+#include "test.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// All the forms of operator new and operator delete that may be paired with
+// each other are replaced together, so that they all go through malloc and
+// free. None of them is inlined, so that the compiler does not see new
+// expressions being paired with free, or with operator new of another form.
+std::atomic<std::size_t> g_heap_allocations_count(0);
+
+GEMMLOWP_NOINLINE void* operator new(std::size_t size) {
+  g_heap_allocations_count++;
+  void* p = std::malloc(size ? size : 1);
+  if (!p) {
+    // Not throwing std::bad_alloc, to also build without exceptions.
+    std::abort();
+  }
+  return p;
+}
+
+GEMMLOWP_NOINLINE void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+GEMMLOWP_NOINLINE void* operator new(std::size_t size,
+                                     const std::nothrow_t&) noexcept {
+  g_heap_allocations_count++;
+  return std::malloc(size ? size : 1);
+}
+
+GEMMLOWP_NOINLINE void* operator new[](std::size_t size,
+                                       const std::nothrow_t& tag) noexcept {
+  return operator new(size, tag);
+}
+
+GEMMLOWP_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+
+GEMMLOWP_NOINLINE void operator delete[](void* p) noexcept { std::free(p); }
+
+GEMMLOWP_NOINLINE void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+GEMMLOWP_NOINLINE void operator delete[](void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+GEMMLOWP_NOINLINE void operator delete(void* p,
+                                       const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+GEMMLOWP_NOINLINE void operator delete[](void* p,
+                                         const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+namespace gemmlowp {
+
+// Checks that once warmed up, repeated identical multi-threaded Gemms
+// allocate no heap memory, and keep giving the same result, with workers
+// of the context's own or from a shared pool.
+void test_steady_state_allocations() {
+  const int rows = 300;
+  const int depth = 200;
+  const int cols = 250;
+  Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+  Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> expected(rows, cols);
+  Matrix<std::uint8_t, MapOrder::ColMajor> actual(rows, cols);
+  MakeRandom<OperandRange<0, 255>>(&lhs);
+  MakeRandom<OperandRange<0, 255>>(&rhs);
+  GemmContext reference_context;
+  Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+      &reference_context, lhs.const_map(), rhs.const_map(), &expected.map(),
+      -75, -91, 74980, 123, 20);
+
+  SharedWorkersPool shared_workers_pool(2);
+  for (bool shared : {false, true}) {
+    GemmContext context;
+    context.set_max_num_threads(3);
+    context.set_work_stealing(true);
+    if (shared) {
+      context.set_shared_workers_pool(&shared_workers_pool);
+    }
+    const int kWarmUpGemms = 2;
+    const int kGemms = 10;
+    std::size_t allocations_count = 0;
+    for (int i = 0; i < kWarmUpGemms + kGemms; i++) {
+      if (i == kWarmUpGemms) {
+        allocations_count = g_heap_allocations_count.load();
+      }
+      Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+          &context, lhs.const_map(), rhs.const_map(), &actual.map(), -75,
+          -91, 74980, 123, 20);
+      Check(actual == expected);
+    }
+    Check(g_heap_allocations_count.load() == allocations_count);
+  }
+}
+
+}  // namespace gemmlowp
+
+int main() { gemmlowp::test_steady_state_allocations(); }
@@ -39,6 +39,67 @@ void test_allocator(Allocator* a, int max_array_size) {
   a->Decommit();
 }
 
+// Huge pages are only used for storage spanning at least one, and when
+// available, which depends on the system: only check that any storage we
+// get is usable and, if backed by huge pages, aligned on them.
+void test_huge_pages() {
+  Allocator allocator;
+  allocator.set_use_huge_pages(true);
+  for (std::size_t size : {std::size_t(4096), 3 * Allocator::kHugePageSize}) {
+    auto handle = allocator.Reserve<std::uint8_t>(size);
+    allocator.Commit();
+    std::uint8_t* data = allocator.GetPointer<std::uint8_t>(handle);
+    memset(data, 1, size);
+    if (size < Allocator::kHugePageSize) {
+      Check(allocator.huge_pages() == HugePages::None);
+    } else if (allocator.huge_pages() != HugePages::None) {
+      Check(!(reinterpret_cast<std::uintptr_t>(data) %
+              Allocator::kHugePageSize));
+    }
+    allocator.Decommit();
+  }
+  allocator.set_use_huge_pages(false);
+  Check(allocator.huge_pages() == HugePages::None);
+  test_allocator(&allocator, 1000);
+}
+
+// Commits a block of the given size on the allocator.
+void commit_block(Allocator* allocator, std::size_t size) {
+  auto handle = allocator->Reserve<std::uint8_t>(size);
+  allocator->Commit();
+  memset(allocator->GetPointer<std::uint8_t>(handle), 0, size);
+  allocator->Decommit();
+}
+
+void test_trim_and_decay() {
+  const std::size_t kLarge = 1 << 20;
+  const std::size_t kSmall = 1000;
+  Allocator allocator;
+  commit_block(&allocator, kLarge);
+  Check(allocator.storage_size() == kLarge);
+  commit_block(&allocator, kSmall);
+  Check(allocator.storage_size() == kLarge);
+  Check(allocator.high_water_reserved_bytes() == kLarge);
+  allocator.Trim();
+  Check(allocator.storage_size() == 0);
+  Check(allocator.high_water_storage_size() == kLarge);
+
+  // Storage oversized for 3 commits in a row shrinks to what they needed.
+  allocator.set_decay_commits(3);
+  commit_block(&allocator, kLarge);
+  commit_block(&allocator, kSmall);
+  commit_block(&allocator, kSmall);
+  commit_block(&allocator, kLarge);
+  Check(allocator.storage_size() == kLarge);
+  commit_block(&allocator, kSmall);
+  commit_block(&allocator, 2 * kSmall);
+  Check(allocator.storage_size() == kLarge);
+  commit_block(&allocator, kSmall);
+  Check(allocator.storage_size() ==
+        RoundUpToPowerOfTwo(RoundUp<Allocator::kAlignment>(2 * kSmall)));
+  Check(allocator.high_water_storage_size() == kLarge);
+}
+
 void test_allocator() {
   Allocator allocator;
 
@@ -47,6 +108,9 @@ void test_allocator() {
   for (int i = 1; i < 1000; i += 10) {
     test_allocator(&allocator, i);
   }
+
+  test_huge_pages();
+  test_trim_and_decay();
 }
 
 }  // namespace gemmlowp
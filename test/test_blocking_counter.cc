@@ -15,6 +15,7 @@
 #include "test.h"
 #include "../profiling/pthread_everywhere.h"
 
+#include <cstdio>
 #include <vector>
 
 #include "../internal/multi_thread_gemm.h"
@@ -102,6 +103,57 @@ void test_blocking_counter() {
   delete blocking_counter;
 }
 
+// A task doing nothing, so that running it measures only the overhead of
+// handing it to a worker and waiting for it.
+struct EmptyTask : Task {
+  void Run() override {}
+};
+
+// Microbenchmark of the latency of a WorkersPool::ExecuteUnowned round-trip,
+// that is of dispatching tasks to workers and waiting for them, which matters
+// for small GEMMs taking only tens of microseconds. This is run in each
+// SpinMode, reporting how often workers got new work while still
+// busy-waiting.
+void benchmark_dispatch_latency(SpinMode spin_mode, const char* spin_mode_name) {
+  WorkersPool workers_pool;
+  workers_pool.set_spin_mode(spin_mode);
+  const double kMinBenchmarkTime = 0.1;
+  const int kMinIterations = 10;
+  for (int num_tasks = 1; num_tasks <= 8; num_tasks *= 2) {
+    // The tasks are reused across iterations, so that no heap allocation
+    // is timed.
+    std::vector<EmptyTask> tasks(num_tasks);
+    int iterations = 0;
+    double time_start = 0;
+    double time_now = 0;
+    // The first iteration is a warm-up, creating the workers.
+    while (iterations <= kMinIterations ||
+           time_now - time_start < kMinBenchmarkTime) {
+      workers_pool.ExecuteUnowned(tasks.data(), num_tasks);
+      time_now = real_time_in_seconds();
+      if (!iterations) {
+        time_start = time_now;
+      }
+      iterations++;
+    }
+    printf("WorkersPool::ExecuteUnowned latency (%s) with %d tasks: %.2f us\n",
+           spin_mode_name, num_tasks,
+           1e6 * (time_now - time_start) / (iterations - 1));
+  }
+  const SpinStats stats = workers_pool.spin_stats();
+  printf("Spin hits/misses (%s): %zu/%zu\n", spin_mode_name, stats.hits,
+         stats.misses);
+}
+
+void benchmark_dispatch_latency() {
+  benchmark_dispatch_latency(SpinMode::LatencyFirst, "latency-first");
+  benchmark_dispatch_latency(SpinMode::Balanced, "balanced");
+  benchmark_dispatch_latency(SpinMode::PowerFirst, "power-first");
+}
+
 }  // end namespace gemmlowp
 
-int main() { gemmlowp::test_blocking_counter(); }
+int main() {
+  gemmlowp::test_blocking_counter();
+  gemmlowp::benchmark_dispatch_latency();
+}
@@ -0,0 +1,285 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "test.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "../internal/cpu_topology.h"
+#include "../internal/multi_thread_gemm.h"
+
+namespace gemmlowp {
+
+void test_parse_cpu_list() {
+  std::vector<int> cpus;
+  Check(ParseCpuList("0-3,8,10-11\n", &cpus));
+  Check(cpus == std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  Check(ParseCpuList("5", &cpus));
+  Check(cpus == std::vector<int>({5}));
+  Check(!ParseCpuList("", &cpus));
+  Check(!ParseCpuList("3-1", &cpus));
+  Check(!ParseCpuList("0-3x", &cpus));
+
+  Check(ParseCacheSize("1024K\n") == 1024 * 1024);
+  Check(ParseCacheSize("2M\n") == 2 * 1024 * 1024);
+  Check(ParseCacheSize("512\n") == 512);
+
+  Check(ParseCgroupCpuMax("max 100000\n") == 0);
+  Check(ParseCgroupCpuMax("400000 100000\n") == 4);
+  Check(ParseCgroupCpuMax("150000 100000\n") == 2);
+  Check(ParseCgroupCpuMax("1000 100000\n") == 1);
+  Check(CpusOfCfsQuota(-1, 100000) == 0);
+  Check(CpusOfCfsQuota(200000, 100000) == 2);
+}
+
+#ifdef __linux__
+void WriteFile(const std::string& path, const char* contents) {
+  FILE* file = fopen(path.c_str(), "w");
+  Check(file != nullptr);
+  fputs(contents, file);
+  fclose(file);
+}
+
+void MakeDirectory(const std::string& path) { mkdir(path.c_str(), 0700); }
+
+// Builds a fake sysfs tree for 2 physical cores with 2 hardware threads
+// each, numbered like on x86 (siblings are 0,2 and 1,3), with a 1MB L2
+// cache per core, an 8MB L3 cache shared by all, and a NUMA node per core,
+// and checks what we read from it.
+void test_read_cpu_topology() {
+  char dir_template[] = "/tmp/gemmlowp_test_cpu_topology_XXXXXX";
+  Check(mkdtemp(dir_template) != nullptr);
+  const std::string root = dir_template;
+  WriteFile(root + "/online", "0-3\n");
+  for (int cpu = 0; cpu < 4; cpu++) {
+    const std::string cpu_dir = root + "/cpu" + std::to_string(cpu);
+    const char* siblings = cpu % 2 ? "1,3\n" : "0,2\n";
+    MakeDirectory(cpu_dir);
+    MakeDirectory(cpu_dir + "/topology");
+    MakeDirectory(cpu_dir + "/node" + std::to_string(cpu % 2));
+    WriteFile(cpu_dir + "/topology/thread_siblings_list", siblings);
+    MakeDirectory(cpu_dir + "/cache");
+    const char* const levels[] = {"1\n", "1\n", "2\n", "3\n"};
+    const char* const types[] = {"Data\n", "Instruction\n", "Unified\n",
+                                 "Unified\n"};
+    const char* const sizes[] = {"32K\n", "32K\n", "1024K\n", "8M\n"};
+    for (int index = 0; index < 4; index++) {
+      const std::string cache_dir =
+          cpu_dir + "/cache/index" + std::to_string(index);
+      MakeDirectory(cache_dir);
+      WriteFile(cache_dir + "/level", levels[index]);
+      WriteFile(cache_dir + "/type", types[index]);
+      WriteFile(cache_dir + "/size", sizes[index]);
+      WriteFile(cache_dir + "/shared_cpu_list",
+                index == 3 ? "0-3\n" : siblings);
+      WriteFile(cache_dir + "/coherency_line_size", "64\n");
+    }
+  }
+
+  CpuTopology topology;
+  Check(ReadCpuTopology(root, &topology));
+  Check(topology.cpus == std::vector<int>({0, 1, 2, 3}));
+  Check(topology.cores.size() == 2);
+  Check(topology.cores[0] == std::vector<int>({0, 2}));
+  Check(topology.cores[1] == std::vector<int>({1, 3}));
+  Check(topology.l2_caches.size() == 2);
+  Check(topology.l2_caches[0].size_bytes == 1024 * 1024);
+  Check(topology.l2_caches[1].cpus == std::vector<int>({1, 3}));
+  Check(topology.l1_caches.size() == 2);
+  Check(topology.l1_caches[0].size_bytes == 32 * 1024);
+  Check(topology.llc_caches.size() == 1);
+  Check(topology.llc_caches[0].cpus == std::vector<int>({0, 1, 2, 3}));
+
+  const CacheSizes cache_sizes = GetCacheSizesOfTopology(topology);
+  Check(cache_sizes.l1_bytes == 32 * 1024);
+  Check(cache_sizes.line_bytes == 64);
+  Check(cache_sizes.l2_bytes == 1024 * 1024);
+  Check(cache_sizes.l2_sharing == 2);
+  Check(cache_sizes.llc_bytes == 8 * 1024 * 1024);
+  Check(cache_sizes.llc_sharing == 4);
+  Check(topology.numa_nodes.size() == 2);
+  Check(topology.numa_nodes[1] == std::vector<int>({1, 3}));
+  Check(GetNumaNodeOfCpu(topology, 2) == 0);
+  Check(GetNumaNodeOfCpu(topology, 3) == 1);
+
+  const auto physical_cores =
+      GetThreadPlacement(topology, AffinityPolicy::PhysicalCores, {});
+  Check(physical_cores == topology.cores);
+  const auto avoid_smt =
+      GetThreadPlacement(topology, AffinityPolicy::AvoidSmtSiblings, {});
+  Check(avoid_smt == std::vector<std::vector<int>>({{0}, {1}}));
+  const auto cpu_set =
+      GetThreadPlacement(topology, AffinityPolicy::CpuSet, {0, 1, 2});
+  Check(cpu_set == std::vector<std::vector<int>>({{0}, {1}, {2}}));
+  Check(GetThreadPlacement(topology, AffinityPolicy::None, {}).empty());
+
+  // One thread per core gets a whole L2 cache, while two threads sharing
+  // a core share its L2 cache.
+  Check(GetL2BytesPerThread(topology, avoid_smt) == 1024 * 1024);
+  Check(GetL2BytesPerThread(topology, cpu_set) == 512 * 1024);
+
+  // Offlining a hardware thread removes it from its core.
+  WriteFile(root + "/online", "0-2\n");
+  Check(ReadCpuTopology(root, &topology));
+  Check(topology.cores[1] == std::vector<int>({1}));
+
+  // Without core information, the topology can't be read.
+  WriteFile(root + "/online", "0-4\n");
+  Check(!ReadCpuTopology(root, &topology));
+
+  std::string command = "rm -rf " + root;
+  Check(system(command.c_str()) == 0);
+}
+
+// Builds fake cgroup v1 and v2 hierarchies, with quotas at different
+// levels, and checks the limits that we read from them.
+void test_read_cgroup_cpu_limit() {
+  char dir_template[] = "/tmp/gemmlowp_test_cgroup_XXXXXX";
+  Check(mkdtemp(dir_template) != nullptr);
+  const std::string root = dir_template;
+
+  // v2: a 6 CPU quota on the pod, and a 3.5 CPU one on its container.
+  MakeDirectory(root + "/kubepods");
+  MakeDirectory(root + "/kubepods/pod");
+  WriteFile(root + "/cpu.max", "max 100000\n");
+  WriteFile(root + "/kubepods/cpu.max", "600000 100000\n");
+  WriteFile(root + "/kubepods/pod/cpu.max", "350000 100000\n");
+  Check(ReadCgroupCpuLimit(root, "0::/kubepods/pod\n") == 4);
+  Check(ReadCgroupCpuLimit(root, "0::/kubepods\n") == 6);
+  Check(ReadCgroupCpuLimit(root, "0::/\n") == 0);
+  // Without a cgroup namespace, the path of the container's own cgroup,
+  // mounted at the root, is not visible.
+  WriteFile(root + "/cpu.max", "200000 100000\n");
+  Check(ReadCgroupCpuLimit(root, "0::/host/path\n") == 2);
+
+  // v1, with the cpu and cpuacct controllers mounted together.
+  const std::string cpu_root = root + "/cpu,cpuacct";
+  MakeDirectory(cpu_root);
+  MakeDirectory(cpu_root + "/docker");
+  WriteFile(cpu_root + "/cpu.cfs_quota_us", "-1\n");
+  WriteFile(cpu_root + "/cpu.cfs_period_us", "100000\n");
+  WriteFile(cpu_root + "/docker/cpu.cfs_quota_us", "300000\n");
+  WriteFile(cpu_root + "/docker/cpu.cfs_period_us", "100000\n");
+  Check(ReadCgroupCpuLimit(root,
+                           "4:memory:/docker\n"
+                           "3:cpu,cpuacct:/docker\n") == 3);
+  Check(ReadCgroupCpuLimit(root, "4:memory:/docker\n") == 0);
+
+  std::string command = "rm -rf " + root;
+  Check(system(command.c_str()) == 0);
+}
+#endif
+
+// Checks that the CPUs available to this process are consistently
+// detected, and follow its affinity mask.
+void test_available_cpus() {
+  const int cpus = GetAvailableCpus();
+  Check(cpus >= 1 && cpus <= GetHardwareConcurrency(0));
+  Check(RefreshAvailableCpus() == cpus);
+  Check(GetAvailableConcurrency(0) == cpus);
+  Check(GetAvailableConcurrency(3) == 3);
+#ifdef __linux__
+  cpu_set_t saved_cpu_set;
+  Check(sched_getaffinity(0, sizeof(saved_cpu_set), &saved_cpu_set) == 0);
+  if (SetCurrentThreadAffinity({GetCpuTopology().cpus[0]})) {
+    Check(RefreshAvailableCpus() == 1);
+    Check(GetAvailableCpus() == 1);
+    Check(sched_setaffinity(0, sizeof(saved_cpu_set), &saved_cpu_set) == 0);
+    Check(RefreshAvailableCpus() == cpus);
+  }
+#endif
+}
+
+struct RecordCpuTask : Task {
+  explicit RecordCpuTask(int* _cpu) : cpu(_cpu) {}
+  void Run() override {
+#ifdef __linux__
+    *cpu = sched_getcpu();
+#endif
+  }
+  int* cpu;
+};
+
+// Checks that pinned workers actually run on the CPUs they're pinned to.
+void test_workers_pool_affinity() {
+  const CpuTopology& topology = GetCpuTopology();
+  Check(!topology.cpus.empty());
+  Check(!topology.cores.empty());
+
+  WorkersPool workers_pool;
+  const int last_cpu = topology.cpus.back();
+  workers_pool.set_affinity(AffinityPolicy::CpuSet, {last_cpu});
+  Check(workers_pool.placement().size() == 1);
+  const int kTasks = 3;
+  std::vector<int> cpus(kTasks, -1);
+  std::vector<Task*> tasks;
+  for (int i = 0; i < kTasks; i++) {
+    tasks.push_back(new RecordCpuTask(&cpus[i]));
+  }
+  workers_pool.Execute(tasks);
+#ifdef __linux__
+  // The last task runs on the calling thread, which is not pinned.
+  for (int i = 0; i < kTasks - 1; i++) {
+    Check(cpus[i] == last_cpu);
+  }
+#endif
+
+  workers_pool.set_affinity(AffinityPolicy::None);
+  Check(workers_pool.placement().empty());
+  tasks.clear();
+  for (int i = 0; i < kTasks; i++) {
+    tasks.push_back(new RecordCpuTask(&cpus[i]));
+  }
+  workers_pool.Execute(tasks);
+}
+
+// Checks that the detected caches, if any, are consistent, and that the
+// default cache budgets follow them.
+void test_cache_sizes() {
+  CacheSizes sizes;
+  if (ReadCacheSizesFromCpuid(&sizes)) {
+    Check(sizes.l1_bytes > 0 && sizes.line_bytes > 0);
+    Check(sizes.l2_bytes == 0 || sizes.l2_sharing > 0);
+  }
+  const CacheSizes& detected = GetCacheSizes();
+  Check(detected.llc_bytes == 0 || detected.llc_sharing > 0);
+  if (detected.l2_bytes) {
+    Check(DefaultL2BytesToUse() == detected.l2_bytes);
+  } else {
+    Check(DefaultL2BytesToUse() == kDefaultL2CacheSize);
+  }
+  Check(DefaultLlcBytesToUse() <= detected.llc_bytes);
+}
+
+void test_cpu_topology() {
+  test_parse_cpu_list();
+  test_cache_sizes();
+  test_available_cpus();
+#ifdef __linux__
+  test_read_cpu_topology();
+  test_read_cgroup_cpu_limit();
+#endif
+  test_workers_pool_affinity();
+}
+
+}  // end namespace gemmlowp
+
+int main() { gemmlowp::test_cpu_topology(); }
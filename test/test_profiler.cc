@@ -0,0 +1,132 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define GEMMLOWP_PROFILING
+
+#include <string>
+#include <vector>
+
+#include "test.h"
+#include "../profiling/profiler.h"
+
+namespace gemmlowp {
+
+void test_trace_buffer() {
+  TraceBuffer buffer(0);
+  std::vector<TraceEvent> events;
+  buffer.ReadEvents(&events);
+  Check(events.empty());
+
+  const std::size_t kEvents = TraceBuffer::kCapacity + 10;
+  for (std::size_t i = 0; i < kEvents; i++) {
+    TraceEvent event;
+    event.label = "event";
+    event.start_ns = i;
+    event.end_ns = i + 1;
+    buffer.Record(event);
+  }
+  buffer.ReadEvents(&events);
+  // Only the last kCapacity events are kept, oldest first, minus the one
+  // that the next event would overwrite.
+  Check(events.size() == TraceBuffer::kCapacity - 1);
+  for (std::size_t i = 0; i < events.size(); i++) {
+    Check(events[i].start_ns == kEvents - events.size() + i);
+  }
+}
+
+void* TracedThreadFunc(void*) {
+  ScopedProfilingLabel label("traced thread", TraceArgs(1, 2, 3, 4));
+  return nullptr;
+}
+
+std::string ReadChromeTrace() {
+  FILE* file = tmpfile();
+  Check(file);
+  WriteChromeTrace(file);
+  rewind(file);
+  std::string text;
+  char buf[4096];
+  std::size_t count;
+  while ((count = fread(buf, 1, sizeof(buf), file)) > 0) {
+    text.append(buf, count);
+  }
+  fclose(file);
+  return text;
+}
+
+bool Contains(const std::string& text, const char* str) {
+  return text.find(str) != std::string::npos;
+}
+
+void test_tracing() {
+  {
+    // Started before tracing, so not part of the trace.
+    ScopedProfilingLabel untraced("before tracing");
+    StartTracing();
+  }
+  {
+    ScopedProfilingLabel outer("outer");
+    ScopedProfilingLabel kernel("kernel", NotTraced());
+    ScopedProfilingLabel label("first");
+    label.Update("quoted \"label\"");
+  }
+  pthread_t thread;
+  pthread_create(&thread, nullptr, TracedThreadFunc, nullptr);
+  pthread_join(thread, nullptr);
+
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+  LhsType lhs(100, 70);
+  RhsType rhs(70, 30);
+  ResultType result(100, 30);
+  MakeConstant(&lhs, 1);
+  MakeConstant(&rhs, 1);
+  GemmContext context;
+  context.set_max_num_threads(4);
+  Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(
+      &context, lhs.const_map(), rhs.const_map(), &result.map(), 0, 0, 1, 1, 0);
+  FinishTracing();
+  {
+    ScopedProfilingLabel untraced("after tracing");
+  }
+
+  const std::string trace = ReadChromeTrace();
+  Check(trace[0] == '[');
+  Check(Contains(trace, "\"name\":\"outer\""));
+  Check(Contains(trace, "\"name\":\"first\""));
+  Check(Contains(trace, "\"name\":\"quoted \\\"label\\\"\""));
+  Check(!Contains(trace, "\"name\":\"kernel\""));
+  Check(!Contains(trace, "before tracing"));
+  Check(!Contains(trace, "after tracing"));
+  Check(Contains(trace, "\"rows\":1,\"depth\":2,\"cols\":3,\"task\":4}"));
+  Check(Contains(trace, "\"rows\":100,\"depth\":70,\"cols\":30"));
+  Check(Contains(trace, "\"name\":\"pack LHS\""));
+  Check(!Contains(trace, "optimized kernel"));
+  Check(Contains(trace, "\"name\":\"thread_name\""));
+
+  // Starting a new trace drops the events of the last one.
+  StartTracing();
+  FinishTracing();
+  Check(ReadChromeTrace() == "[\n]\n");
+}
+
+void test_profiler() {
+  test_trace_buffer();
+  test_tracing();
+}
+
+}  // namespace gemmlowp
+
+int main() { gemmlowp::test_profiler(); }